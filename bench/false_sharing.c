@@ -0,0 +1,85 @@
+/*
+ * Allocates one small counter per thread, one after another, and reports the time for every thread
+ * to bump its own counter: counters packed by an ordinary heap share cache lines, a padded heap
+ * gives each of them lines of its own. Every thread is pinned to a CPU of its own, so the threads
+ * really write at the same time; with fewer than two CPUs there's nothing to measure
+ */
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mem.h"
+
+#define MAX_THREADS 8
+#define INCREMENTS  20000000
+
+static void* bump( void* counter ) {
+    volatile uint64_t* const value = counter;
+    for (size_t i = 0; i < INCREMENTS; ++i) *value += 1;
+    return NULL;
+}
+
+/**
+ * Finds the CPUs the process may run on
+ * @param cpus where to put their numbers, MAX_THREADS at most
+ * @return how many were found
+ */
+static size_t usable_cpus( int* cpus ) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) return 0;
+    size_t count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < MAX_THREADS; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) cpus[count++] = cpu;
+    }
+    return count;
+}
+
+static double bump_ns( bool padded, int const* cpus, size_t threads ) {
+    const struct heap_options options = { .cacheline_pad = padded };
+    struct heap* const heap = heap_create(0, &options);
+
+    uint64_t* counters[MAX_THREADS];
+    for (size_t t = 0; t < threads; ++t) {
+        counters[t] = heap_malloc(heap, sizeof(uint64_t));
+        *counters[t] = 0;
+    }
+
+    pthread_t workers[MAX_THREADS];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t t = 0; t < threads; ++t) {
+        pthread_attr_t attr;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[t], &set);
+        pthread_attr_init(&attr);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        pthread_create(&workers[t], &attr, bump, counters[t]);
+        pthread_attr_destroy(&attr);
+    }
+    for (size_t t = 0; t < threads; ++t) pthread_join(workers[t], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for (size_t t = 0; t < threads; ++t) if (*counters[t] != INCREMENTS) abort();
+
+    heap_destroy(heap);
+    return ((double) (end.tv_sec - start.tv_sec) * 1e9 + (double) (end.tv_nsec - start.tv_nsec)) / INCREMENTS;
+}
+
+int main( void ) {
+    int cpus[MAX_THREADS];
+    const size_t threads = usable_cpus(cpus);
+    if (threads < 2) {
+        fprintf(stderr, "false sharing needs at least 2 CPUs, %zu usable\n", threads);
+        return 0;
+    }
+
+    printf("| mode | threads | ns/increment |\n");
+    printf("|---|---:|---:|\n");
+    printf("| packed | %zu | %.2f |\n", threads, bump_ns(false, cpus, threads));
+    printf("| padded | %zu | %.2f |\n", threads, bump_ns(true, cpus, threads));
+    return 0;
+}
@@ -0,0 +1,262 @@
+/*
+ * Replays synthetic allocation traces on heaps with different placement policies
+ * and reports how much memory each of them maps (and keeps resident) for the same live data
+ */
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mem.h"
+
+/* One trace event: allocation of `size` bytes for object `id` or, if size is 0, its release */
+struct op { uint32_t id; uint32_t size; };
+
+struct trace {
+  char const* name;
+  struct op*  ops;
+  size_t      count;
+  size_t      objects;
+};
+
+static uint64_t random_state;
+
+static uint64_t next_random( void ) {
+    random_state = random_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return random_state >> 33;
+}
+
+static size_t random_between( size_t from, size_t to ) { return from + next_random() % (to - from + 1); }
+
+/*  --- Генерация трасс --- */
+
+/* Pending releases ordered by step (binary heap) */
+struct death { size_t step; uint32_t id; };
+struct deaths { struct death* items; size_t count; };
+
+static void deaths_push( struct deaths* d, struct death item ) {
+    size_t i = d->count++;
+    while (i && d->items[(i - 1) / 2].step > item.step) {
+        d->items[i] = d->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    d->items[i] = item;
+}
+
+static struct death deaths_pop( struct deaths* d ) {
+    const struct death top = d->items[0];
+    const struct death last = d->items[--d->count];
+    size_t i = 0;
+    while (2 * i + 1 < d->count) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < d->count && d->items[child + 1].step < d->items[child].step) ++child;
+        if (d->items[child].step >= last.step) break;
+        d->items[i] = d->items[child];
+        i = child;
+    }
+    d->items[i] = last;
+    return top;
+}
+
+struct trace_builder { struct trace trace; size_t capacity; struct deaths deaths; };
+
+static void emit( struct trace_builder* b, uint32_t id, uint32_t size ) {
+    if (b->trace.count == b->capacity) {
+        b->capacity = b->capacity ? 2 * b->capacity : 4096;
+        b->trace.ops = realloc(b->trace.ops, b->capacity * sizeof(struct op));
+    }
+    b->trace.ops[b->trace.count++] = (struct op) { .id = id, .size = size };
+}
+
+static uint32_t alloc_for( struct trace_builder* b, size_t step, size_t size, size_t lifetime ) {
+    const uint32_t id = (uint32_t) b->trace.objects++;
+    emit(b, id, (uint32_t) size);
+    deaths_push(&b->deaths, (struct death) { .step = step + lifetime, .id = id });
+    return id;
+}
+
+static void release_due( struct trace_builder* b, size_t step ) {
+    while (b->deaths.count && b->deaths.items[0].step <= step) emit(b, deaths_pop(&b->deaths).id, 0);
+}
+
+static struct trace finish( struct trace_builder* b ) {
+    release_due(b, SIZE_MAX);
+    free(b->deaths.items);
+    return b->trace;
+}
+
+/* Request handling service: short-lived request objects around a long-lived cache */
+static struct trace trace_service( size_t steps ) {
+    struct trace_builder b = { .trace = { .name = "service" }, .deaths = { malloc(steps * 2 * sizeof(struct death)), 0 } };
+    random_state = 1;
+    for (size_t step = 0; step < steps; ++step) {
+        release_due(&b, step);
+        alloc_for(&b, step, random_between(16, 512), random_between(1, 64));
+        if (step % 8 == 0) alloc_for(&b, step, random_between(256, 16384), random_between(1000, 20000));
+    }
+    return finish(&b);
+}
+
+/* Program phases: each one lives with the next one and leaves some survivors */
+static struct trace trace_phases( size_t steps ) {
+    struct trace_builder b = { .trace = { .name = "phases" }, .deaths = { malloc(steps * sizeof(struct death)), 0 } };
+    random_state = 2;
+    static const size_t ranges[][2] = { { 64, 1024 }, { 1024, 4096 }, { 16, 128 }, { 4096, 32768 } };
+    const size_t phase_length = steps / 8;
+    for (size_t step = 0; step < steps; ++step) {
+        release_due(&b, step);
+        const size_t* const range = ranges[step / phase_length % 4];
+        const size_t lifetime = next_random() % 10 == 0 ? steps : random_between(phase_length, 2 * phase_length);
+        alloc_for(&b, step, random_between(range[0], range[1]), lifetime);
+    }
+    return finish(&b);
+}
+
+/* Building a big structure: small objects which mostly live to the end, a few temporaries between them */
+static struct trace trace_build( size_t steps ) {
+    struct trace_builder b = { .trace = { .name = "build" }, .deaths = { malloc(steps * sizeof(struct death)), 0 } };
+    random_state = 4;
+    for (size_t step = 0; step < steps; ++step) {
+        release_due(&b, step);
+        const size_t lifetime = next_random() % 10 == 0 ? random_between(1, 100) : steps;
+        alloc_for(&b, step, random_between(16, 256), lifetime);
+    }
+    return finish(&b);
+}
+
+/* Uniform sizes and lifetimes, the worst case for every policy */
+static struct trace trace_random( size_t steps ) {
+    struct trace_builder b = { .trace = { .name = "random" }, .deaths = { malloc(steps * sizeof(struct death)), 0 } };
+    random_state = 3;
+    for (size_t step = 0; step < steps; ++step) {
+        release_due(&b, step);
+        alloc_for(&b, step, random_between(1, 8192), random_between(1, 2000));
+    }
+    return finish(&b);
+}
+
+/*  --- Воспроизведение --- */
+
+struct result { size_t peak_live; size_t peak_mapped; size_t peak_resident; double ns_per_op; };
+
+/* Pages of the region which are in memory (mincore) */
+static size_t resident_bytes( struct heap_region_stats const* region ) {
+    static unsigned char* pages = NULL;
+    static size_t capacity = 0;
+
+    const size_t page = (size_t) getpagesize();
+    const size_t count = (region->size + page - 1) / page;
+    if (count > capacity) {
+        capacity = 2 * count;
+        pages = realloc(pages, capacity);
+    }
+    if (mincore(region->addr, region->size, pages) != 0) return 0;
+
+    size_t resident = 0;
+    for (size_t i = 0; i < count; ++i) resident += pages[i] & 1;
+    return resident * page;
+}
+
+/**
+ * Measures the heap
+ * @param heap heap
+ * @param resident_too also count resident pages of every region, it's slow
+ * @return mapped and resident bytes
+ */
+static struct result footprint_of( struct heap* heap, bool resident_too ) {
+    static struct heap_region_stats* stats = NULL;
+    static size_t capacity = 0;
+
+    const size_t count = heap_regions(heap, NULL, 0);
+    if (count > capacity) {
+        capacity = 2 * count;
+        stats = realloc(stats, capacity * sizeof(*stats));
+    }
+    heap_regions(heap, stats, count);
+
+    struct result footprint = {0};
+    for (size_t i = 0; i < count; ++i) {
+        footprint.peak_mapped += stats[i].size;
+        if (resident_too) footprint.peak_resident += resident_bytes(&stats[i]);
+    }
+    return footprint;
+}
+
+/**
+ * Replays the trace on a new heap
+ * @param trace trace
+ * @param fit placement policy of the heap
+ * @param wilderness preserve the top of the heap
+ * @param measure_memory follow the mapped size after every allocation, count resident pages at the end (the timing is meaningless then)
+ * @return peak sizes or time per operation
+ */
+static struct result replay( struct trace const* trace, enum heap_fit fit, bool wilderness, bool measure_memory ) {
+    const struct heap_options options = { .fit = fit, .wilderness = wilderness };
+    struct heap* const heap = heap_create(0, &options);
+    void** const objects = calloc(trace->objects, sizeof(void*));
+    uint32_t* const sizes = calloc(trace->objects, sizeof(uint32_t));
+
+    struct result result = {0};
+    size_t live = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < trace->count; ++i) {
+        const struct op op = trace->ops[i];
+        if (op.size) {
+            objects[op.id] = heap_malloc(heap, op.size);
+            if (!objects[op.id]) abort();
+            sizes[op.id] = op.size;
+            live += op.size;
+            if (live > result.peak_live) result.peak_live = live;
+
+            if (measure_memory) {
+                const size_t mapped = footprint_of(heap, false).peak_mapped;
+                if (mapped > result.peak_mapped) result.peak_mapped = mapped;
+            }
+        } else {
+            heap_free(heap, objects[op.id]);
+            live -= sizes[op.id];
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    result.ns_per_op = ((double) (end.tv_sec - start.tv_sec) * 1e9 + (double) (end.tv_nsec - start.tv_nsec)) / (double) trace->count;
+
+    // nothing is trimmed or purged during the replay, so touched pages stay resident and the peak is at the end
+    if (measure_memory) result.peak_resident = footprint_of(heap, true).peak_resident;
+
+    free(sizes);
+    free(objects);
+    heap_destroy(heap);
+    return result;
+}
+
+int main( void ) {
+    const struct trace traces[] = { trace_service(100000), trace_phases(50000), trace_random(50000), trace_build(100000) };
+    static const struct { enum heap_fit fit; char const* name; } policies[] = {
+        { HEAP_FIT_FIRST, "first fit" },
+        { HEAP_FIT_FIRST_INDEXED, "first fit, indexed" },
+        { HEAP_FIT_BEST, "best fit" },
+        { HEAP_FIT_NEXT, "next fit" },
+    };
+
+    printf("| trace | policy | top | peak live, KiB | peak mapped, KiB | overhead | peak resident, KiB | ns/op |\n");
+    printf("|---|---|---|---:|---:|---:|---:|---:|\n");
+    for (size_t t = 0; t < sizeof(traces) / sizeof(*traces); ++t) {
+        for (size_t p = 0; p < sizeof(policies) / sizeof(*policies); ++p) {
+            for (int wilderness = 0; wilderness < 2; ++wilderness) {
+                struct result r = replay(&traces[t], policies[p].fit, wilderness, true);
+                r.ns_per_op = replay(&traces[t], policies[p].fit, wilderness, false).ns_per_op;
+                printf("| %s | %s | %s | %zu | %zu | %.1f%% | %zu | %.0f |\n", traces[t].name, policies[p].name,
+                       wilderness ? "kept" : "-", r.peak_live / 1024, r.peak_mapped / 1024,
+                       100.0 * ((double) r.peak_mapped / (double) r.peak_live - 1), r.peak_resident / 1024, r.ns_per_op);
+            }
+        }
+        free(traces[t].ops);
+    }
+    return 0;
+}
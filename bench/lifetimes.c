@@ -0,0 +1,91 @@
+/*
+ * Builds a long-lived table between bursts of short-lived request buffers and reports how much
+ * memory the heap maps at its peak and keeps after every burst is trimmed: without hints,
+ * with explicit lifetime hints and with lifetimes learned by allocation site
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mem.h"
+
+#define BURSTS       200
+#define BURST_SIZE   400
+#define TABLE_GROWTH 50
+
+enum mode { MODE_PLAIN, MODE_HINTS, MODE_SITES };
+enum site { SITE_REQUEST = 1, SITE_TABLE = 2 };
+
+struct result { size_t peak_mapped; size_t trimmed_mapped; size_t live; };
+
+static size_t mapped_bytes( struct heap* heap ) {
+    static struct heap_region_stats* stats = NULL;
+    static size_t capacity = 0;
+
+    const size_t count = heap_regions(heap, NULL, 0);
+    if (count > capacity) {
+        capacity = 2 * count;
+        stats = realloc(stats, capacity * sizeof(*stats));
+    }
+    heap_regions(heap, stats, count);
+
+    size_t mapped = 0;
+    for (size_t i = 0; i < count; ++i) mapped += stats[i].size;
+    return mapped;
+}
+
+static void* allocate( struct heap* heap, enum mode mode, size_t size, enum site site ) {
+    switch (mode) {
+        case MODE_HINTS: return heap_malloc_hint(heap, size, site == SITE_REQUEST ? HINT_SHORT_LIVED : HINT_LONG_LIVED);
+        case MODE_SITES: return heap_malloc_site(heap, size, site);
+        default: return heap_malloc(heap, size);
+    }
+}
+
+static struct result run( enum mode mode ) {
+    const struct heap_options options = { .short_lifetime = mode == MODE_SITES ? 1024 : 0 };
+    struct heap* const heap = heap_create(0, &options);
+    void** const table = malloc(BURSTS * TABLE_GROWTH * sizeof(void*));
+    void* requests[BURST_SIZE];
+
+    struct result result = {0};
+    size_t rows = 0;
+    srand(45);
+    for (size_t burst = 0; burst < BURSTS; ++burst) {
+        // rows of the table are added while requests are served
+        for (size_t i = 0; i < BURST_SIZE; ++i) {
+            requests[i] = allocate(heap, mode, 256 + (size_t) rand() % 4096, SITE_REQUEST);
+            if (i % (BURST_SIZE / TABLE_GROWTH) == 0) {
+                const size_t size = 32 + (size_t) rand() % 224;
+                table[rows++] = allocate(heap, mode, size, SITE_TABLE);
+                result.live += size;
+            }
+        }
+        const size_t mapped = mapped_bytes(heap);
+        if (mapped > result.peak_mapped) result.peak_mapped = mapped;
+
+        for (size_t i = 0; i < BURST_SIZE; ++i) heap_free(heap, requests[i]);
+        heap_trim(heap);
+    }
+    result.trimmed_mapped = mapped_bytes(heap);
+
+    for (size_t i = 0; i < rows; ++i) heap_free(heap, table[i]);
+    free(table);
+    heap_destroy(heap);
+    return result;
+}
+
+int main( void ) {
+    static const struct { enum mode mode; char const* name; } modes[] = {
+        { MODE_PLAIN, "no hints" },
+        { MODE_HINTS, "hints" },
+        { MODE_SITES, "learned sites" },
+    };
+
+    printf("| mode | table, KiB | peak mapped, KiB | mapped after trim, KiB |\n");
+    printf("|---|---:|---:|---:|\n");
+    for (size_t m = 0; m < sizeof(modes) / sizeof(*modes); ++m) {
+        const struct result r = run(modes[m].mode);
+        printf("| %s | %zu | %zu | %zu |\n", modes[m].name, r.live / 1024, r.peak_mapped / 1024, r.trimmed_mapped / 1024);
+    }
+    return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * Threads take bursts of objects from one object cache and free them, objects taken by one thread
+ * are freed by the next one. Reports the time of an allocation and free pair through the locked
+ * cache and through per-thread magazines, and the depot traffic of the latter
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mem.h"
+
+#define THREADS 4
+#define BURSTS  20000
+#define BURST   48
+
+struct worker {
+    struct objcache* cache;
+    bool             magazines;
+    void**           handoff;  /* objects the previous thread took, this one frees them */
+    void**           taken;
+    pthread_barrier_t* barrier;
+};
+
+static bool object_ctor( void* object ) {
+    *(uint64_t*) object = 0;
+    return true;
+}
+
+static void* work( void* arg ) {
+    struct worker* const worker = arg;
+    struct objcache_thread thread;
+    objcache_thread_init(worker->cache, &thread);
+
+    for (size_t b = 0; b < BURSTS; ++b) {
+        for (size_t i = 0; i < BURST; ++i) {
+            worker->taken[i] = worker->magazines ? objcache_thread_alloc(&thread) : objcache_alloc(worker->cache);
+            *(uint64_t*) worker->taken[i] += 1;
+        }
+        pthread_barrier_wait(worker->barrier);
+        for (size_t i = 0; i < BURST; ++i) {
+            if (worker->magazines) objcache_thread_free(&thread, worker->handoff[i]);
+            else objcache_free(worker->cache, worker->handoff[i]);
+        }
+        pthread_barrier_wait(worker->barrier);
+    }
+    objcache_thread_flush(&thread);
+    return NULL;
+}
+
+static double pair_ns( bool magazines, struct objcache_stats* stats ) {
+    struct heap* const heap = heap_create(0, NULL);
+    struct objcache* const cache = heap_objcache_create(heap, 64, object_ctor, NULL);
+    if (magazines) objcache_magazines(cache, 0, 0);
+
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, THREADS);
+    static void* taken[THREADS][BURST];
+    struct worker workers[THREADS];
+    pthread_t threads[THREADS];
+    for (size_t t = 0; t < THREADS; ++t) {
+        workers[t] = (struct worker) {
+            .cache = cache, .magazines = magazines, .handoff = taken[(t + THREADS - 1) % THREADS], .taken = taken[t], .barrier = &barrier
+        };
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t t = 0; t < THREADS; ++t) pthread_create(&threads[t], NULL, work, &workers[t]);
+    for (size_t t = 0; t < THREADS; ++t) pthread_join(threads[t], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    objcache_stats(cache, stats);
+    pthread_barrier_destroy(&barrier);
+    heap_destroy(heap);
+    return ((double) (end.tv_sec - start.tv_sec) * 1e9 + (double) (end.tv_nsec - start.tv_nsec)) / ((double) THREADS * BURSTS * BURST);
+}
+
+int main( void ) {
+    struct objcache_stats locked, stats;
+    const double cache_ns = pair_ns(false, &locked);
+    const double magazine_ns = pair_ns(true, &stats);
+
+    printf("| mode | ns/pair | full taken | full returned | contended | rounds |\n");
+    printf("|---|---:|---:|---:|---:|---:|\n");
+    printf("| cache | %.1f | - | - | - | - |\n", cache_ns);
+    printf("| magazines | %.1f | %zu | %zu | %zu | %zu |\n", magazine_ns, stats.full_taken, stats.full_returned, stats.contended, stats.rounds);
+    return 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * Builds linked lists node by node, round-robin, in a heap full of scattered holes and reports
+ * the time to walk them: nodes placed by heap_malloc, near their predecessor and in groups
+ */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mem.h"
+
+#define FILLERS 200000
+#define LISTS   64
+#define NODES   500
+#define WALKS   80
+
+enum mode { MODE_PLAIN, MODE_NEAR, MODE_GROUP };
+
+struct node { struct node* next; uint64_t value; uint8_t payload[40]; };
+
+static double walk_ns( enum heap_fit fit, enum mode mode ) {
+    const struct heap_options options = { .fit = fit };
+    struct heap* const heap = heap_create(0, &options);
+
+    // a heap that has been in use: every fourth object is gone
+    void** const fillers = malloc(FILLERS * sizeof(void*));
+    srand(46);
+    for (size_t i = 0; i < FILLERS; ++i) fillers[i] = heap_malloc(heap, 32 + (size_t) rand() % 96);
+    for (size_t i = 0; i < FILLERS; i += 4) heap_free(heap, fillers[i]);
+
+    struct node* heads[LISTS] = {0};
+    struct node* tails[LISTS] = {0};
+    struct heap_group groups[LISTS];
+    if (mode == MODE_GROUP) {
+        for (size_t l = 0; l < LISTS; ++l) heap_group_init(heap, &groups[l], NODES * (sizeof(struct node) + 32));
+    }
+    for (size_t n = 0; n < NODES; ++n) {
+        for (size_t l = 0; l < LISTS; ++l) {
+            struct node* node;
+            switch (mode) {
+                case MODE_NEAR: node = heap_malloc_near(heap, sizeof(struct node), tails[l]); break;
+                case MODE_GROUP: node = heap_group_malloc(&groups[l], sizeof(struct node)); break;
+                default: node = heap_malloc(heap, sizeof(struct node));
+            }
+            *node = (struct node) { .next = NULL, .value = n };
+            if (tails[l]) tails[l]->next = node;
+            else heads[l] = node;
+            tails[l] = node;
+        }
+    }
+
+    uint64_t sum = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t w = 0; w < WALKS; ++w) {
+        for (size_t l = 0; l < LISTS; ++l) {
+            for (struct node const* node = heads[l]; node; node = node->next) sum += node->value;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (sum != (uint64_t) WALKS * LISTS * NODES * (NODES - 1) / 2) abort();
+
+    free(fillers);
+    heap_destroy(heap);
+    return ((double) (end.tv_sec - start.tv_sec) * 1e9 + (double) (end.tv_nsec - start.tv_nsec)) / (WALKS * LISTS * NODES);
+}
+
+int main( void ) {
+    static const struct { enum heap_fit fit; char const* name; } policies[] = {
+        { HEAP_FIT_FIRST_INDEXED, "first fit, indexed" },
+        { HEAP_FIT_BEST, "best fit" },
+    };
+
+    printf("| policy | ns/node | ns/node, near | ns/node, groups |\n");
+    printf("|---|---:|---:|---:|\n");
+    for (size_t p = 0; p < sizeof(policies) / sizeof(*policies); ++p) {
+        printf("| %s | %.2f | %.2f | %.2f |\n", policies[p].name, walk_ns(policies[p].fit, MODE_PLAIN),
+               walk_ns(policies[p].fit, MODE_NEAR), walk_ns(policies[p].fit, MODE_GROUP));
+    }
+    return 0;
+}
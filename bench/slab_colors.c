@@ -0,0 +1,55 @@
+/*
+ * Fills many slabs of 64-byte objects and reports the time to read the object at the same slot
+ * of every slab over and over: without colours these objects map to the same cache sets
+ * and evict each other, with colours they spread over as many sets as there are colours
+ */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mem.h"
+
+#define SLABS    512
+#define PER_SLAB 62
+#define WALKS    20000
+
+static double walk_ns( size_t colors ) {
+    const struct heap_options options = { .slabs = true, .slab_colors = colors };
+    struct heap* const heap = heap_create(0, &options);
+
+    // the first object of every slab, slabs follow each other as the class fills them
+    uint64_t** const objects = malloc(SLABS * PER_SLAB * sizeof(uint64_t*));
+    uint64_t* heads[SLABS];
+    size_t allocated = 0, count = 0;
+    while (count < SLABS) {
+        uint64_t* const object = heap_malloc(heap, 64);
+        *object = allocated;
+        if (!allocated || (uintptr_t) object / 4096 != (uintptr_t) objects[allocated - 1] / 4096) heads[count++] = object;
+        objects[allocated++] = object;
+    }
+
+    uint64_t sum = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t w = 0; w < WALKS; ++w) {
+        for (size_t s = 0; s < SLABS; ++s) sum += *heads[s];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (sum < (uint64_t) WALKS) abort();
+
+    for (size_t i = 0; i < allocated; ++i) heap_free(heap, objects[i]);
+    free(objects);
+    heap_destroy(heap);
+    return ((double) (end.tv_sec - start.tv_sec) * 1e9 + (double) (end.tv_nsec - start.tv_nsec)) / ((double) WALKS * SLABS);
+}
+
+int main( void ) {
+    static const size_t colors[] = { 0, 4, 8, 16 };
+
+    printf("| colours | ns/object |\n");
+    printf("|---:|---:|\n");
+    for (size_t c = 0; c < sizeof(colors) / sizeof(*colors); ++c) printf("| %zu | %.2f |\n", colors[c], walk_ns(colors[c]));
+    return 0;
+}
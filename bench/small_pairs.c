@@ -0,0 +1,57 @@
+/*
+ * Frees and allocates the same few small sizes over and over in a heap full of live
+ * objects and reports the time of a malloc/free pair with and without fastbins
+ */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mem.h"
+
+#define LIVE  20000
+#define PAIRS 2000000
+
+static const size_t sizes[] = { 24, 40, 64, 96 };
+
+static double pair_ns( enum heap_fit fit, size_t fastbin_max ) {
+    const struct heap_options options = { .fit = fit, .fastbin_max = fastbin_max };
+    struct heap* const heap = heap_create(0, &options);
+
+    // the front of the heap is densely taken, every object has a small hole after it
+    void** const live = malloc(LIVE * sizeof(void*));
+    for (size_t i = 0; i < LIVE; ++i) live[i] = heap_malloc(heap, 32 + i % 64);
+
+    void* recent[sizeof(sizes) / sizeof(*sizes)];
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i) recent[i] = heap_malloc(heap, sizes[i]);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < PAIRS; ++i) {
+        const size_t k = i % (sizeof(sizes) / sizeof(*sizes));
+        heap_free(heap, recent[k]);
+        recent[k] = heap_malloc(heap, sizes[k]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    free(live);
+    heap_destroy(heap);
+    return ((double) (end.tv_sec - start.tv_sec) * 1e9 + (double) (end.tv_nsec - start.tv_nsec)) / PAIRS;
+}
+
+int main( void ) {
+    static const struct { enum heap_fit fit; char const* name; } policies[] = {
+        { HEAP_FIT_FIRST, "first fit" },
+        { HEAP_FIT_FIRST_INDEXED, "first fit, indexed" },
+        { HEAP_FIT_BEST, "best fit" },
+        { HEAP_FIT_NEXT, "next fit" },
+    };
+
+    printf("| policy | ns/pair | ns/pair, fastbins |\n");
+    printf("|---|---:|---:|\n");
+    for (size_t p = 0; p < sizeof(policies) / sizeof(*policies); ++p) {
+        printf("| %s | %.1f | %.1f |\n", policies[p].name, pair_ns(policies[p].fit, 0), pair_ns(policies[p].fit, 128));
+    }
+    return 0;
+}
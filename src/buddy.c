@@ -0,0 +1,263 @@
+#define _DEFAULT_SOURCE
+
+#include <sys/mman.h>
+
+#include "buddy.h"
+
+#define ARENA_PAGES  (BUDDY_ARENA_SIZE / BUDDY_PAGE_SIZE)
+#define BITMAP_WORDS ((2 * ARENA_PAGES) / 64)
+
+/**
+ * First page of an arena, it's taken for good: the lower half of the arena is always split
+ * around it, so an arena holds one 4 MiB block at most, its upper half
+ */
+struct buddy_arena {
+  struct buddy_arena* next;
+  size_t   live_pages;              /* pages of taken blocks, this one included */
+  uint8_t  orders[ARENA_PAGES];     /* order + 1 of the taken block starting at the page, 0 if none */
+  uint64_t free_bits[BITMAP_WORDS]; /* per order: the block at this index is on the free list */
+};
+
+_Static_assert( sizeof( struct buddy_arena ) <= BUDDY_PAGE_SIZE, "arena metadata must fit its first page" );
+
+/**
+ * Free block, linked through its own first bytes
+ */
+struct buddy_free_block {
+  struct buddy_free_block* next;
+  struct buddy_free_block* prev;
+};
+
+static struct buddy_arena* arena_of( void const* mem ) {
+  return (struct buddy_arena*) ((uintptr_t) mem & ~(BUDDY_ARENA_SIZE - 1));
+}
+
+static size_t page_of( struct buddy_arena const* arena, void const* mem ) {
+  return ((uint8_t const*) mem - (uint8_t const*) arena) / BUDDY_PAGE_SIZE;
+}
+
+static void* page_at( struct buddy_arena* arena, size_t page ) {
+  return (uint8_t*) arena + page * BUDDY_PAGE_SIZE;
+}
+
+/* bitmaps of all orders are packed one after another, order k has ARENA_PAGES >> k bits */
+static size_t free_bit( unsigned order, size_t page ) {
+  return 2 * ARENA_PAGES - (2 * ARENA_PAGES >> order) + (page >> order);
+}
+
+static bool is_free_at( struct buddy_arena const* arena, unsigned order, size_t page ) {
+  const size_t bit = free_bit( order, page );
+  return arena->free_bits[bit / 64] >> (bit % 64) & 1;
+}
+
+static void set_free_at( struct buddy_arena* arena, unsigned order, size_t page, bool free ) {
+  const size_t bit = free_bit( order, page );
+  if (free) arena->free_bits[bit / 64] |= 1ULL << (bit % 64);
+  else arena->free_bits[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+static unsigned order_for( size_t query ) {
+  const size_t pages = (query + BUDDY_PAGE_SIZE - 1) / BUDDY_PAGE_SIZE;
+  unsigned order = 0;
+  while (((size_t) 1 << order) < pages) ++order;
+  return order;
+}
+
+/*  --- Списки свободных блоков --- */
+
+static void list_push( struct buddy_heap* heap, void* mem, unsigned order ) {
+    struct buddy_free_block* const block = mem;
+    *block = (struct buddy_free_block) { .next = heap->free_lists[order], .prev = NULL };
+    if (block->next) block->next->prev = block;
+    heap->free_lists[order] = block;
+    heap->nonempty |= 1u << order;
+
+    struct buddy_arena* const arena = arena_of(mem);
+    set_free_at(arena, order, page_of(arena, mem), true);
+}
+
+static void list_remove( struct buddy_heap* heap, void* mem, unsigned order ) {
+    struct buddy_free_block* const block = mem;
+    if (block->prev) block->prev->next = block->next;
+    else heap->free_lists[order] = block->next;
+    if (block->next) block->next->prev = block->prev;
+    if (!heap->free_lists[order]) heap->nonempty &= ~(1u << order);
+
+    struct buddy_arena* const arena = arena_of(mem);
+    set_free_at(arena, order, page_of(arena, mem), false);
+}
+
+/*  --- Арены --- */
+
+/**
+ * Maps an arena aligned to its size, so every block of it has its buddy at address ^ size
+ * @param heap heap
+ * @return arena or NULL
+ */
+static struct buddy_arena* map_arena( struct buddy_heap* heap ) {
+    struct page_provider* const provider = heap->provider;
+    uint8_t* const mapped = provider->map(provider, NULL, 2 * BUDDY_ARENA_SIZE, 0);
+    if (mapped == MAP_FAILED) return NULL;
+
+    // cut off misaligned head and the rest of the tail
+    uint8_t* const aligned = (uint8_t*) (((uintptr_t) mapped + BUDDY_ARENA_SIZE - 1) & ~(BUDDY_ARENA_SIZE - 1));
+    if (aligned != mapped) provider->unmap(provider, mapped, aligned - mapped);
+    provider->unmap(provider, aligned + BUDDY_ARENA_SIZE, mapped + BUDDY_ARENA_SIZE - aligned);
+    return (struct buddy_arena*) aligned;
+}
+
+/**
+ * Adds an arena, its first page is the metadata, the rest are free blocks of every order
+ * @param heap heap
+ * @return true if added
+ */
+static bool grow( struct buddy_heap* heap ) {
+    struct buddy_arena* const arena = map_arena(heap);
+    if (!arena) return false;
+
+    *arena = (struct buddy_arena) { .next = heap->arenas, .live_pages = 1 };
+    arena->orders[0] = 1;
+    heap->arenas = arena;
+
+    // pages 1, 2-3, 4-7, ... are the buddies on the way from the first page up to a half of the arena
+    for (unsigned order = 0; order <= BUDDY_MAX_ORDER; ++order) list_push(heap, page_at(arena, (size_t) 1 << order), order);
+    return true;
+}
+
+/**
+ * Returns a fully free arena to the provider, its free blocks are coalesced back to the initial ones
+ * @param heap heap
+ * @param arena empty arena
+ */
+static void release( struct buddy_heap* heap, struct buddy_arena* arena ) {
+    for (unsigned order = 0; order <= BUDDY_MAX_ORDER; ++order) list_remove(heap, page_at(arena, (size_t) 1 << order), order);
+
+    struct buddy_arena** link = &heap->arenas;
+    while (*link != arena) link = &(*link)->next;
+    *link = arena->next;
+
+    heap->provider->unmap(heap->provider, arena, BUDDY_ARENA_SIZE);
+}
+
+/*  --- Выделение и освобождение --- */
+
+/**
+ * Initializes an empty buddy heap, arenas are mapped on demand
+ * @param heap heap storage
+ * @param provider where arenas come from, NULL means page_provider_anonymous
+ */
+void buddy_init( struct buddy_heap* heap, struct page_provider* provider ) {
+    *heap = (struct buddy_heap) { .provider = provider ? provider : &page_provider_anonymous };
+}
+
+/**
+ * Unmaps every arena, all blocks become invalid
+ * @param heap heap
+ */
+void buddy_destroy( struct buddy_heap* heap ) {
+    struct page_provider* const provider = heap->provider;
+    for (struct buddy_arena* arena = heap->arenas; arena; ) {
+        struct buddy_arena* const next = arena->next;
+        provider->unmap(provider, arena, BUDDY_ARENA_SIZE);
+        arena = next;
+    }
+    buddy_init(heap, provider);
+}
+
+/**
+ * Allocates a block of the smallest power of two pages which fits
+ * @param heap heap
+ * @param query amount of bytes
+ * @return page aligned block or NULL (also if the query exceeds 4 MiB)
+ */
+void* buddy_malloc( struct buddy_heap* heap, size_t query ) {
+    if (query > ((size_t) BUDDY_PAGE_SIZE << BUDDY_MAX_ORDER)) return NULL;
+    const unsigned order = order_for(query);
+
+    // the smallest nonempty order which is big enough
+    uint32_t orders = heap->nonempty & ~((1u << order) - 1);
+    if (!orders) {
+        if (!grow(heap)) return NULL;
+        orders = heap->nonempty & ~((1u << order) - 1);
+    }
+    unsigned current = __builtin_ctz(orders);
+
+    uint8_t* const block = (uint8_t*) heap->free_lists[current];
+    list_remove(heap, block, current);
+
+    // upper halves go back to the lists
+    while (current > order) {
+        --current;
+        list_push(heap, block + ((size_t) BUDDY_PAGE_SIZE << current), current);
+    }
+
+    struct buddy_arena* const arena = arena_of(block);
+    arena->orders[page_of(arena, block)] = (uint8_t) (order + 1);
+    arena->live_pages += (size_t) 1 << order;
+    return block;
+}
+
+/**
+ * Releases a block merging it with its free buddies, an arena which gets empty is unmapped
+ * unless it's the last one
+ * @param heap heap the block belongs to
+ * @param mem block from buddy_malloc or NULL
+ */
+void buddy_free( struct buddy_heap* heap, void* mem ) {
+    if (!mem) return;
+    struct buddy_arena* const arena = arena_of(mem);
+    size_t page = page_of(arena, mem);
+    if (!arena->orders[page]) return;
+
+    unsigned order = arena->orders[page] - 1;
+    arena->orders[page] = 0;
+    arena->live_pages -= (size_t) 1 << order;
+
+    while (order < BUDDY_MAX_ORDER) {
+        const size_t buddy = page ^ ((size_t) 1 << order);
+        if (!is_free_at(arena, order, buddy)) break;
+        list_remove(heap, page_at(arena, buddy), order);
+        page &= ~((size_t) 1 << order);
+        ++order;
+    }
+    list_push(heap, page_at(arena, page), order);
+
+    if (arena->live_pages == 1 && (heap->arenas != arena || arena->next)) release(heap, arena);
+}
+
+/**
+ * Returns the size of a taken block
+ * @param heap heap the block belongs to
+ * @param mem block from buddy_malloc
+ * @return block size in bytes, 0 if the block isn't taken
+ */
+size_t buddy_usable_size( struct buddy_heap const* heap, void const* mem ) {
+    (void) heap;
+    struct buddy_arena const* const arena = arena_of(mem);
+    const uint8_t order = arena->orders[page_of(arena, mem)];
+    return order ? (size_t) BUDDY_PAGE_SIZE << (order - 1) : 0;
+}
+
+/**
+ * Counts free blocks of the order
+ * @param heap heap
+ * @param order order of the blocks (size is BUDDY_PAGE_SIZE << order)
+ * @return number of free blocks
+ */
+size_t buddy_free_blocks( struct buddy_heap const* heap, unsigned order ) {
+    if (order > BUDDY_MAX_ORDER) return 0;
+    size_t count = 0;
+    for (struct buddy_free_block const* block = heap->free_lists[order]; block; block = block->next) ++count;
+    return count;
+}
+
+/**
+ * Counts arenas the heap has mapped
+ * @param heap heap
+ * @return number of arenas
+ */
+size_t buddy_arenas( struct buddy_heap const* heap ) {
+    size_t count = 0;
+    for (struct buddy_arena const* arena = heap->arenas; arena; arena = arena->next) ++count;
+    return count;
+}
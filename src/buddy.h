@@ -0,0 +1,41 @@
+#ifndef _BUDDY_H_
+#define _BUDDY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "page_provider.h"
+
+#define BUDDY_PAGE_SIZE  4096
+#define BUDDY_MAX_ORDER  10                                   /* largest block is 4 MiB */
+#define BUDDY_ORDERS     (BUDDY_MAX_ORDER + 1)
+#define BUDDY_ARENA_SIZE ((size_t) BUDDY_PAGE_SIZE << (BUDDY_MAX_ORDER + 1))
+
+struct buddy_arena;
+struct buddy_free_block;
+
+/**
+ * Binary buddy heap for page-granular buffers (4 KiB - 4 MiB). Blocks are powers of two pages
+ * carved out of 8 MiB arenas aligned to their size, so the buddy of a block is found by XORing
+ * its address with its size. Splitting and coalescing are O(log n).
+ * The structure itself is owned by the caller, arenas keep their metadata in their first page
+ */
+struct buddy_heap {
+  struct page_provider*    provider;  /* where arenas come from */
+  struct buddy_arena*      arenas;
+  uint32_t                 nonempty;  /* bit per order: its free list has blocks */
+  struct buddy_free_block* free_lists[BUDDY_ORDERS];
+};
+
+void   buddy_init( struct buddy_heap* heap, struct page_provider* provider );
+void   buddy_destroy( struct buddy_heap* heap );
+
+void*  buddy_malloc( struct buddy_heap* heap, size_t query );
+void   buddy_free( struct buddy_heap* heap, void* mem );
+size_t buddy_usable_size( struct buddy_heap const* heap, void const* mem );
+
+size_t buddy_free_blocks( struct buddy_heap const* heap, unsigned order );
+size_t buddy_arenas( struct buddy_heap const* heap );
+
+#endif
@@ -1,8 +1,10 @@
 #define _DEFAULT_SOURCE
 
 #include <assert.h>
+#include <stdalign.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "mem_internals.h"
@@ -37,22 +39,146 @@ static void* map_pages(void const* addr, size_t length, int additional_flags) {
   return mmap( (void*) addr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | additional_flags , -1, 0 );
 }
 
+/*  --- Источник страниц по умолчанию: анонимный mmap --- */
+
+static void* anonymous_map( struct page_provider* self, void const* addr, size_t length, int flags ) {
+  (void) self;
+  return map_pages( addr, length, flags );
+}
+
+static void* anonymous_map_at( struct page_provider* self, void const* addr, size_t length, int flags ) {
+  (void) self;
+  return map_pages( addr, length, flags | MAP_FIXED_NOREPLACE );
+}
+
+static int anonymous_unmap( struct page_provider* self, void* addr, size_t length ) {
+  (void) self;
+  return munmap( addr, length );
+}
+
+static int anonymous_advise( struct page_provider* self, void* addr, size_t length, int advice ) {
+  (void) self;
+  return madvise( addr, length, advice );
+}
+
+struct page_provider page_provider_anonymous = {
+  .map = anonymous_map,
+  .map_at = anonymous_map_at,
+  .unmap = anonymous_unmap,
+  .advise = anonymous_advise
+};
+
+static struct heap default_heap = { .start = HEAP_START, .objcache_lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct page_provider* heap_provider( struct heap const* heap ) {
+  return heap->options.provider ? heap->options.provider : &page_provider_anonymous;
+}
+
+/**
+ * Returns mmap flags every mapping of the heap needs
+ * @param heap heap
+ * @return additional mmap flags
+ */
+static int heap_map_flags( struct heap const* heap ) {
+  // pinned heaps take all page faults right here
+  return heap->options.pinned ? MAP_POPULATE : 0;
+}
+
+static size_t round_up  ( size_t mem, size_t granule ) { return (mem + granule - 1) / granule * granule; }
+static size_t round_down( size_t mem, size_t granule ) { return mem / granule * granule; }
+
+static bool region_wants_huge_pages( struct heap const* heap, size_t region_size ) {
+  return heap->options.huge_threshold && region_size >= heap->options.huge_threshold;
+}
+
+/**
+ * Returns granularity trimming and purging must respect, so they never split a huge page
+ * @param heap heap
+ * @return granularity in bytes
+ */
+static size_t heap_granularity( struct heap const* heap ) {
+  return heap->options.huge_threshold ? HUGE_PAGE_SIZE : (size_t) getpagesize();
+}
+
+/**
+ * Maps memory somewhere with the start aligned to HUGE_PAGE_SIZE
+ * @param heap heap which needs memory
+ * @param length amount of bytes to map (multiple of HUGE_PAGE_SIZE)
+ * @return aligned mapped address or MAP_FAILED
+ */
+static void* map_huge_aligned( struct heap const* heap, size_t length ) {
+    struct page_provider* const provider = heap_provider(heap);
+    uint8_t* const mapped = provider->map(provider, NULL, length + HUGE_PAGE_SIZE, heap_map_flags(heap));
+    if (mapped == MAP_FAILED) return MAP_FAILED;
+
+    // cut off misaligned head and the rest of the tail
+    uint8_t* const aligned = (uint8_t*) round_up((uintptr_t) mapped, HUGE_PAGE_SIZE);
+    if (aligned != mapped) provider->unmap(provider, mapped, aligned - mapped);
+    provider->unmap(provider, aligned + length, mapped + HUGE_PAGE_SIZE - aligned);
+    return aligned;
+}
+
+/**
+ * Maps huge-page backed memory: hugetlbfs pool first (if configured), then transparent huge pages
+ * @param heap heap which needs memory
+ * @param addr address where we want to map (to extend the heap), rounded up to HUGE_PAGE_SIZE for the first region
+ * @param length amount of bytes to map (multiple of HUGE_PAGE_SIZE)
+ * @return mapped address or MAP_FAILED
+ */
+static void* map_huge_pages( struct heap const* heap, void const* addr, size_t length ) {
+    struct page_provider* const provider = heap_provider(heap);
+    const int flags = heap_map_flags(heap);
+
+    // the first region has nothing to grow contiguously from, so its hint (HEAP_START isn't) is aligned
+    if (addr && !heap->regions.count) addr = (void const*) round_up((uintptr_t) addr, HUGE_PAGE_SIZE);
+
+    if (heap->options.huge_tlb) {
+        void* mapped = addr ? provider->map_at(provider, addr, length, flags | MAP_HUGETLB) : MAP_FAILED;
+        if (mapped == MAP_FAILED) mapped = provider->map(provider, addr, length, flags | MAP_HUGETLB);
+        if (mapped != MAP_FAILED) return mapped;
+    }
+
+    // growing contiguously is worth more than alignment, THP still backs the aligned interior
+    void* mapped = addr ? provider->map_at(provider, addr, length, flags) : MAP_FAILED;
+    if (mapped == MAP_FAILED) mapped = map_huge_aligned(heap, length);
+    if (mapped == MAP_FAILED) return MAP_FAILED;
+
+    provider->advise(provider, mapped, length, MADV_HUGEPAGE);
+    return mapped;
+}
+
 /*  аллоцировать регион памяти и инициализировать его блоком */
 /**
  * Tries to allocate region and init a block
- * @param addr address where we want to allocate region
+ * @param heap heap which needs the region
+ * @param addr address where we want to allocate region (NULL if anywhere)
  * @param query amount of bytes we want to allocate
  * @return allocated region or invalid region
  */
-static struct region alloc_region  ( void const * addr, size_t query ) {
+static struct region alloc_region  ( struct heap const* heap, void const * addr, size_t query ) {
+    struct page_provider* const provider = heap_provider(heap);
     size_t region_size = region_actual_size(size_from_capacity((block_capacity){.bytes = query}).bytes);
 
-    void* allocated_region_address = map_pages(addr, region_size, MAP_FIXED_NOREPLACE);
+    void* allocated_region_address = MAP_FAILED;
+    if (region_wants_huge_pages(heap, region_size)) {
+        region_size = round_up(region_size, HUGE_PAGE_SIZE);
+        allocated_region_address = map_huge_pages(heap, addr, region_size);
+    }
+
+    // fallback to normal pages
+    if (allocated_region_address == MAP_FAILED && addr)
+        allocated_region_address = provider->map_at(provider, addr, region_size, heap_map_flags(heap));
     if (allocated_region_address == MAP_FAILED) {
-        allocated_region_address = map_pages(addr, region_size, 0);
+        allocated_region_address = provider->map(provider, addr, region_size, heap_map_flags(heap));
         if (allocated_region_address == MAP_FAILED) return REGION_INVALID;
     }
 
+    // locked heap is useless if its pages can be swapped out
+    if (heap->options.locked && mlock(allocated_region_address, region_size) != 0) {
+        provider->unmap(provider, allocated_region_address, region_size);
+        return REGION_INVALID;
+    }
+
     struct region allocated_region = {
             .addr = allocated_region_address,
             .extends = (allocated_region_address == addr),
@@ -63,7 +189,266 @@ static struct region alloc_region  ( void const * addr, size_t query ) {
     return allocated_region;
 }
 
+/*  --- Карта страниц --- */
+
+#define PAGEMAP_NODE_BYTES (PAGEMAP_FANOUT * sizeof(void*))
+
+static bool heap_has_pagemap( struct heap const* heap ) {
+    return heap->options.pagemap || heap->options.slabs || heap->options.tiny || heap->options.large_min;
+}
+
+/**
+ * Splits the page number of the address into indices of the levels
+ * @param addr address
+ * @param index where to put the indices
+ * @return false if the address is beyond 48 bits (never the heap's)
+ */
+static bool pagemap_index( void const* addr, size_t index[3] ) {
+  const uintptr_t page = (uintptr_t) addr >> PAGEMAP_PAGE_SHIFT;
+  if (page >> (3 * PAGEMAP_LEVEL_BITS)) return false;
+  index[0] = page >> (2 * PAGEMAP_LEVEL_BITS);
+  index[1] = (page >> PAGEMAP_LEVEL_BITS) & (PAGEMAP_FANOUT - 1);
+  index[2] = page & (PAGEMAP_FANOUT - 1);
+  return true;
+}
+
+/**
+ * Looks up what the page of the address holds, three loads and no search
+ * @param map page map
+ * @param addr address
+ * @return 0 if the page isn't the heap's, PAGEMAP_BLOCKS or the slab
+ */
+static uintptr_t pagemap_get( struct pagemap const* map, void const* addr ) {
+  size_t index[3];
+  if (!map->root || !pagemap_index( addr, index )) return 0;
+  uintptr_t** const middle = map->root[index[0]];
+  if (!middle) return 0;
+  uintptr_t* const leaf = middle[index[1]];
+  return leaf ? leaf[index[2]] : 0;
+}
+
+/**
+ * Maps a node of the tree, like the region table it never comes from the heap's provider
+ * @return zeroed node or NULL
+ */
+static void* pagemap_node( void ) {
+  void* const node = map_pages( NULL, PAGEMAP_NODE_BYTES, 0 );
+  return node == MAP_FAILED ? NULL : node;
+}
+
+/**
+ * Records what the pages hold
+ * @param map page map
+ * @param addr first page (page aligned)
+ * @param length bytes of pages
+ * @param value what they hold, 0 to forget them
+ * @return false if a node couldn't be mapped
+ */
+static bool pagemap_set( struct pagemap* map, void const* addr, size_t length, uintptr_t value ) {
+    if (!map->root && !(map->root = pagemap_node())) return false;
+
+    for (uint8_t const* page = addr; page < (uint8_t const*) addr + length; page += 1 << PAGEMAP_PAGE_SHIFT) {
+        size_t index[3];
+        if (!pagemap_index(page, index)) return false;
+
+        uintptr_t*** const middle = &map->root[index[0]];
+        if (!*middle && !(*middle = pagemap_node())) return false;
+        uintptr_t** const leaf = &(*middle)[index[1]];
+        if (!*leaf && !(*leaf = pagemap_node())) return false;
+        (*leaf)[index[2]] = value;
+    }
+    return true;
+}
+
+/**
+ * Unmaps every node of the tree
+ * @param map page map
+ */
+static void pagemap_reset( struct pagemap* map ) {
+    if (!map->root) return;
+    for (size_t i = 0; i < PAGEMAP_FANOUT; ++i) {
+        if (!map->root[i]) continue;
+        for (size_t j = 0; j < PAGEMAP_FANOUT; ++j) {
+            if (map->root[i][j]) munmap(map->root[i][j], PAGEMAP_NODE_BYTES);
+        }
+        munmap(map->root[i], PAGEMAP_NODE_BYTES);
+    }
+    munmap(map->root, PAGEMAP_NODE_BYTES);
+    map->root = NULL;
+}
+
+/*  --- Таблица регионов --- */
+
+static struct region_desc* region_descs( struct region_table* table ) {
+  return table->overflow ? table->overflow : table->inline_descs;
+}
+
+/**
+ * Finds the first region which ends after the address (binary search)
+ * @param table region table
+ * @param addr address
+ * @return index of the region or table->count
+ */
+static size_t region_lower_bound( struct region_table* table, void const* addr ) {
+    struct region_desc* const descs = region_descs(table);
+    size_t lo = 0, hi = table->count;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (descs[mid].addr + descs[mid].size <= (uint8_t const*) addr) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Finds the region the address belongs to
+ * @param heap heap
+ * @param addr address
+ * @return region descriptor or NULL if the heap doesn't own the address
+ */
+static struct region_desc* region_find( struct heap* heap, void const* addr ) {
+    struct region_table* const table = &heap->regions;
+    const size_t i = region_lower_bound(table, addr);
+    if (i == table->count || region_descs(table)[i].addr > (uint8_t const*) addr) return NULL;
+    return region_descs(table) + i;
+}
+
+/**
+ * Makes room for one more descriptor
+ * @param table region table
+ * @return true if there is room
+ */
+static bool region_table_reserve( struct region_table* table ) {
+    const size_t capacity = table->overflow ? table->capacity : REGION_TABLE_INLINE;
+    if (table->count < capacity) return true;
+
+    // never from the heap's provider: a buffer would get a hole below the heap's top
+    const size_t bytes = round_pages(2 * capacity * sizeof(struct region_desc));
+    struct region_desc* const descs = map_pages(NULL, bytes, 0);
+    if (descs == MAP_FAILED) return false;
+
+    memcpy(descs, region_descs(table), table->count * sizeof(struct region_desc));
+    if (table->overflow) munmap(table->overflow, round_pages(table->capacity * sizeof(struct region_desc)));
+    table->overflow = descs;
+    table->capacity = bytes / sizeof(struct region_desc);
+    return true;
+}
+
+/**
+ * Forgets every region, the memory stays mapped
+ * @param table region table
+ */
+static void region_table_reset( struct region_table* table ) {
+    if (table->overflow) munmap(table->overflow, round_pages(table->capacity * sizeof(struct region_desc)));
+    *table = (struct region_table) {0};
+}
+
+/**
+ * Records new region of the heap
+ * @param heap heap
+ * @param region region just mapped
+ * @param free bytes of the region its free block takes
+ * @return true if recorded
+ */
+static bool region_add( struct heap* heap, struct region const* region, size_t free ) {
+    struct region_table* const table = &heap->regions;
+    uint8_t* const addr = region->addr;
+    const size_t i = region_lower_bound(table, addr);
+
+    // region mapped over forgotten ones (unmapped behind the heap's back) makes them stale
+    size_t stale = i;
+    while (stale < table->count && region_descs(table)[stale].addr < addr + region->size) {
+        if (heap_has_pagemap(heap)) pagemap_set(&heap->pagemap, region_descs(table)[stale].addr, region_descs(table)[stale].size, 0);
+        ++stale;
+    }
+    memmove(region_descs(table) + i, region_descs(table) + stale, (table->count - stale) * sizeof(struct region_desc));
+    table->count -= stale - i;
+
+    if (heap_has_pagemap(heap) && !pagemap_set(&heap->pagemap, addr, region->size, PAGEMAP_BLOCKS)) {
+        pagemap_set(&heap->pagemap, addr, region->size, 0);
+        return false;
+    }
+
+    // region which continues the chain tail just makes its run longer
+    struct region_desc* const prev = i > 0 ? region_descs(table) + i - 1 : NULL;
+    if (region->extends && prev && prev->addr + prev->size == addr) {
+        prev->size += region->size;
+        prev->free += free;
+        prev->max_free = size_max(prev->max_free, capacity_from_size((block_size) {free}).bytes);
+        return true;
+    }
+
+    if (!region_table_reserve(table)) {
+        if (heap_has_pagemap(heap)) pagemap_set(&heap->pagemap, addr, region->size, 0);
+        return false;
+    }
+    struct region_desc* const descs = region_descs(table);
+    memmove(descs + i + 1, descs + i, (table->count - i) * sizeof(struct region_desc));
+    descs[i] = (struct region_desc) {
+        .addr = addr, .size = region->size, .live = 0, .free = free,
+        .max_free = capacity_from_size((block_size) {free}).bytes, .chain_next = NULL,
+        .seq = table->next_seq++
+    };
+    ++table->count;
+    return true;
+}
+
+/**
+ * Moves block's bytes between live and free bytes of its region
+ * @param heap heap
+ * @param block block which has just been taken or released
+ * @param taken new state of the block
+ */
+static void region_account( struct heap* heap, struct block_header const* block, bool taken ) {
+    struct region_desc* const region = region_find(heap, block);
+    if (!region) return;
+
+    const size_t size = size_from_capacity(block->capacity).bytes;
+    if (taken) {
+        region->live += size;
+        region->free -= size;
+    } else {
+        region->live -= size;
+        region->free += size;
+    }
+}
+
+/**
+ * Keeps the largest free capacity of the block's region an upper bound,
+ * call it whenever a free block gets bigger (merged with the rest of its run)
+ * @param heap heap
+ * @param block free block
+ */
+static void region_note_free( struct heap* heap, struct block_header const* block ) {
+    struct region_desc* const region = region_find(heap, block);
+    if (region) region->max_free = size_max(region->max_free, block->capacity.bytes);
+}
+
+/**
+ * Keeps the bound after a block is released: free blocks before it, not merged yet,
+ * make a run with it which a scan will merge
+ * @param heap heap
+ * @param block released block
+ */
+static void region_note_released( struct heap* heap, struct block_header const* block ) {
+    struct region_desc* const region = region_find(heap, block);
+    if (!region) return;
+
+    // the run before the block isn't known, it's not bigger than the old bound and all free bytes
+    size_t bound = region->max_free + size_from_capacity(block->capacity).bytes;
+    if (bound > region->free) bound = region->free;
+    region->max_free = size_max(region->max_free, size_max(bound, block->capacity.bytes));
+}
+
+static bool region_contains( struct region_desc const* region, void const* addr ) {
+    return region->addr <= (uint8_t const*) addr && (uint8_t const*) addr < region->addr + region->size;
+}
+
 static void* block_after( struct block_header const* block )         ;
+static bool  heap_indexed( struct heap const* heap );
+static bool  fastbins_consolidate( struct heap* heap );
+static void  indexed_init( struct heap* heap );
+static void  lifetime_table_reset( struct heap* heap );
 
 /**
  * Initializes the heap with the given size
@@ -71,13 +456,67 @@ static void* block_after( struct block_header const* block )         ;
  * @return initial block or NULL
  */
 void* heap_init( size_t initial ) {
-  const struct region region = alloc_region( HEAP_START, initial );
+  return heap_init_with( initial, NULL );
+}
+
+/**
+ * Initializes the heap with the given size and options
+ * @param initial initial size
+ * @param options heap tunables, NULL means defaults
+ * @return initial block or NULL
+ */
+void* heap_init_with( size_t initial, struct heap_options const* options ) {
+  default_heap.options = options ? *options : (struct heap_options) {0};
+  default_heap.rover = NULL;
+  memset( default_heap.fastbins, 0, sizeof( default_heap.fastbins ) );
+  memset( default_heap.slabs, 0, sizeof( default_heap.slabs ) );
+  memset( default_heap.slab_colors, 0, sizeof( default_heap.slab_colors ) );
+  default_heap.slab_count = 0;
+  default_heap.large = (struct large_space) {0};
+  memset( default_heap.lifetimes, 0, sizeof( default_heap.lifetimes ) );
+  default_heap.objcaches = NULL;
+  lifetime_table_reset( &default_heap );
+  pagemap_reset( &default_heap.pagemap );
+  region_table_reset( &default_heap.regions );
+
+  const struct region region = alloc_region( &default_heap, HEAP_START, initial );
   if ( region_is_invalid(&region) ) return NULL;
 
+  default_heap.start = region.addr;
+  region_add( &default_heap, &region, region.size );
+  if ( heap_indexed( &default_heap ) ) indexed_init( &default_heap );
   return region.addr;
 }
 
-#define BLOCK_MIN_CAPACITY 24
+/**
+ * Returns space the handle of a standalone heap takes before its first block
+ * @return size in bytes
+ */
+static size_t heap_handle_size( void ) { return round_up( sizeof( struct heap ), sizeof( max_align_t ) ); }
+
+/**
+ * Creates standalone heap with the given size and options
+ * @param initial initial size
+ * @param options heap tunables, NULL means defaults
+ * @return heap handle or NULL
+ */
+struct heap* heap_create( size_t initial, struct heap_options const* options ) {
+  const struct heap heap = { .start = NULL, .options = options ? *options : (struct heap_options) {0} };
+
+  const struct region region = alloc_region( &heap, NULL, initial + heap_handle_size() );
+  if ( region_is_invalid(&region) ) return NULL;
+
+  // the handle takes the beginning of the region, the first block follows it
+  struct heap* const created = region.addr;
+  *created = heap;
+  pthread_mutex_init( &created->objcache_lock, NULL );
+  created->start = (struct block_header*) ((uint8_t*) region.addr + heap_handle_size());
+  block_init( created->start, (block_size) {.bytes = region.size - heap_handle_size()}, NULL );
+  region_add( created, &region, region.size - heap_handle_size() );
+  if ( heap_indexed( created ) ) indexed_init( created );
+
+  return created;
+}
 
 /*  --- Разделение блоков (если найденный свободный блок слишком большой )--- */
 
@@ -162,6 +601,19 @@ static bool try_merge_with_next( struct block_header* block ) {
     return true;
 }
 
+/**
+ * Merges block with its next neighbour keeping the heap's rover on a block header
+ * @param heap heap the block belongs to (NULL if it has no rover)
+ * @param block block we try to extend
+ * @return true if merged
+ */
+static bool heap_merge_with_next( struct heap* heap, struct block_header* block ) {
+    struct block_header* const next = block->next;
+    if (!try_merge_with_next(block)) return false;
+    if (heap && heap->rover == next) heap->rover = block;
+    return true;
+}
+
 
 /*  --- ... ecли размера кучи хватает --- */
 
@@ -171,20 +623,52 @@ struct block_search_result {
 };
 
 /**
- * Tries find suitable block for the given size
+ * Tries find suitable block for the given size before the stop block, skipping regions which surely have no such block
+ * @param heap heap the chain belongs to (NULL if it has no region table, nothing is skipped then)
  * @param block first block of a block chain
  * @param sz size we try to allocate
- * @return search result with found block
+ * @param stop block the search ends at, it's never merged into the blocks before it (NULL for the end of the chain)
+ * @return search result with found block, the last block or the stop block
  */
-static struct block_search_result find_good_or_last  ( struct block_header* restrict block, size_t sz )    {
+static struct block_search_result find_good_before( struct heap* heap, struct block_header* restrict block, size_t sz, struct block_header* stop ) {
     if (!block || block->next == block) return (struct block_search_result) {.type = BSR_CORRUPTED, .block = block};
 
+    struct region_desc* region = NULL;
+    bool whole_region = false;  // the scan entered the region at its first block, so it sees every free one
+    size_t region_max_free = 0;
+
     // iterate through blocks
     while (block) {
 
+        // entering another region: the whole previous one was seen, its bound is exact now
+        if (heap && !(region && region_contains(region, block))) {
+            if (region && whole_region) region->max_free = region_max_free;
+
+            region = region_find(heap, block);
+            whole_region = region && ((uint8_t*) block == region->addr || block == heap->start);
+            region_max_free = 0;
+
+            // nothing big enough there, go straight to the next region (the tail is walked to find the last block)
+            while (whole_region && region->max_free < sz && region->chain_next && !(stop && region_contains(region, stop))) {
+                block = region->chain_next;
+                region = region_find(heap, block);
+                whole_region = region != NULL;
+            }
+        }
+
+        // the rest of the region isn't seen, its bound stays as it is
+        if (block == stop) {
+            whole_region = false;
+            break;
+        }
+
         // try to merge free blocks and return if merged is BIG ENOUGH
         if (block->is_free) {
-            while (try_merge_with_next(block));
+            while (block->next != stop && heap_merge_with_next(heap, block));
+            if (region) {
+                region_max_free = size_max(region_max_free, block->capacity.bytes);
+                region->max_free = size_max(region->max_free, block->capacity.bytes);
+            }
             if (block_is_big_enough(sz, block))
                 return (struct block_search_result) {.type = BSR_FOUND_GOOD_BLOCK, .block = block};
         }
@@ -193,118 +677,2278 @@ static struct block_search_result find_good_or_last  ( struct block_header* rest
         block = block->next;
     }
 
+    if (region && whole_region) region->max_free = region_max_free;
     return (struct block_search_result) {.type = BSR_REACHED_END_NOT_FOUND, .block = block};
 }
 
+/**
+ * Tries find suitable block for the given size, skipping regions which surely have no such block
+ * @param heap heap the chain belongs to (NULL if it has no region table, nothing is skipped then)
+ * @param block first block of a block chain
+ * @param sz size we try to allocate
+ * @return search result with found block
+ */
+static struct block_search_result find_good_or_last_in( struct heap* heap, struct block_header* restrict block, size_t sz ) {
+    return find_good_before(heap, block, sz, NULL);
+}
+
+/**
+ * Takes the found free block, splitting off what the query doesn't need
+ * @param block free block big enough for query
+ * @param query amount of bytes we allocate
+ */
+static void block_take( struct block_header* block, size_t query ) {
+    split_if_too_big(block, query);
+    block->is_free = false;
+}
+
 /*  Попробовать выделить память в куче начиная с блока `block` не пытаясь расширить кучу
  Можно переиспользовать как только кучу расширили. */
 /**
- * Tries find block to allocate memory without heap growing
+ * Tries find block to allocate memory without heap growing, the search ends at the stop block
+ * @param heap heap the chain belongs to (NULL if it has no region table)
  * @param query amount of bytes we try to allocate
  * @param block starting block
+ * @param stop block the search ends at (NULL for the end of the chain)
  * @return search result with found block
  */
-static struct block_search_result try_memalloc_existing ( size_t query, struct block_header* block ) {
+static struct block_search_result try_memalloc_before ( struct heap* heap, size_t query, struct block_header* block, struct block_header* stop ) {
     // try to find suitable block
-    struct block_search_result search_result = find_good_or_last(block, query);
+    struct block_search_result search_result = find_good_before(heap, block, query, stop);
 
     // if not found - sadness :(
     if (search_result.type != BSR_FOUND_GOOD_BLOCK) return search_result;
 
     // if found - split, allocate, return
-    split_if_too_big(search_result.block, query);
-    search_result.block->is_free = false;
+    block_take(search_result.block, query);
+    return search_result;
+}
+
+/**
+ * Tries find block to allocate memory without heap growing
+ * @param heap heap the chain belongs to (NULL if it has no region table)
+ * @param query amount of bytes we try to allocate
+ * @param block starting block
+ * @return search result with found block
+ */
+static struct block_search_result try_memalloc_in ( struct heap* heap, size_t query, struct block_header* block ) {
+    return try_memalloc_before(heap, query, block, NULL);
+}
+
+/**
+ * Tells if the block is the top: the free last block of the chain, the heap grows by merging into it.
+ * A heap which preserves the top carves it only when nothing else fits
+ * @param heap heap
+ * @param block free block or NULL
+ * @return true if the heap preserves the top and it's the block
+ */
+static bool heap_is_top( struct heap const* heap, struct block_header const* block ) {
+    return heap->options.wilderness && block && block->next == NULL;
+}
+
+static bool found_top( struct heap const* heap, struct block_search_result search_result ) {
+    return search_result.type == BSR_FOUND_GOOD_BLOCK && heap_is_top(heap, search_result.block);
+}
+
+/**
+ * Next fit: searches from the rover to the end of the chain, then wraps around up to the rover
+ * @param heap heap
+ * @param query amount of bytes we try to allocate
+ * @return search result with found block, the last block of the chain if nothing fits
+ */
+static struct block_search_result find_roving ( struct heap* heap, size_t query ) {
+    struct block_header* const rover = heap->rover ? heap->rover : heap->start;
+    const struct block_search_result search_result = find_good_before(heap, rover, query, NULL);
+    if ((search_result.type != BSR_REACHED_END_NOT_FOUND && !found_top(heap, search_result)) || rover == heap->start) return search_result;
+
+    // the rover is never merged into the blocks before it, so the last block found above stays valid
+    const struct block_search_result wrapped = find_good_before(heap, heap->start, query, rover);
+    return wrapped.type == BSR_FOUND_GOOD_BLOCK ? wrapped : search_result;
+}
+
+static struct block_search_result find_placed_once ( struct heap* heap, size_t query, struct block_header* heap_start ) {
+    if (heap->options.fit == HEAP_FIT_NEXT) return find_roving(heap, query);
+    return find_good_or_last_in(heap, heap_start, query);
+}
 
+/**
+ * Searches the heap with its placement policy, indexed heaps aside. Cached small blocks are merged
+ * and searched again if nothing fits (or only the preserved top does)
+ * @param heap heap
+ * @param query amount of bytes we try to allocate
+ * @param heap_start block the first fit search starts from
+ * @return search result with found block
+ */
+static struct block_search_result find_placed ( struct heap* heap, size_t query, struct block_header* heap_start ) {
+    struct block_search_result search_result = find_placed_once(heap, query, heap_start);
+    if ((search_result.type == BSR_REACHED_END_NOT_FOUND || found_top(heap, search_result)) && fastbins_consolidate(heap))
+        search_result = find_placed_once(heap, query, heap_start);
     return search_result;
 }
 
+/**
+ * Accounts the block just taken, the next search of a next fit heap resumes at it
+ * @param heap heap
+ * @param block taken block
+ */
+static void heap_took( struct heap* heap, struct block_header* block ) {
+    region_account(heap, block, true);
+    if (heap->options.fit == HEAP_FIT_NEXT) heap->rover = block;
+}
+
 
 /**
  * Tries to expand heap with the given size
+ * @param heap heap to expand
  * @param last last block header
  * @param query amount of bytes we want to allocate
  * @return new allocated block header or NULL
  */
-static struct block_header* grow_heap( struct block_header* restrict last, size_t query ) {
+static struct block_header* grow_heap( struct heap* heap, struct block_header* restrict last, size_t query ) {
     if (!last) return NULL;
 
     // try to allocate block
-    struct region new_region = alloc_region(block_after(last), query);
+    struct region new_region = alloc_region(heap, block_after(last), query);
 
     // if fail - return NULL
     if (region_is_invalid(&new_region)) return NULL;
 
+    // a region the heap can't remember would never be unmapped
+    if (!region_add(heap, &new_region, new_region.size)) {
+        heap_provider(heap)->unmap(heap_provider(heap), new_region.addr, new_region.size);
+        return NULL;
+    }
+
     // if success - update last header and return new allocated header
     last->next = new_region.addr;
 
+    // the region of the old tail isn't the tail anymore, searches may jump over it now
+    struct region_desc* const last_region = region_find(heap, last);
+    if (!new_region.extends && last_region) last_region->chain_next = new_region.addr;
+
     /*
      * I think this merge is not necessary.
      * Why should we merge the grown heap with the last block?
      * It will be done when _malloc is called.
      * This line I wrote just to pass all the tests
      */
-    if (try_merge_with_next(last)) return last;
+    if (try_merge_with_next(last)) {
+        region_note_free(heap, last);
+        return last;
+    }
     else return new_region.addr;
 }
 
 /*  Реализует основную логику malloc и возвращает заголовок выделенного блока */
 /**
  * Tries to allocate block in existing heap, grows heap if it's need
+ * @param heap heap we allocate in
  * @param query amount of bytes we want to allocate
  * @param heap_start start of the heap (L - logic)
  * @return allocated block header or null if fails
  */
-static struct block_header* memalloc( size_t query, struct block_header* heap_start) {
+static struct block_header* memalloc( struct heap* heap, size_t query, struct block_header* heap_start) {
     // allocate 1 byte? REALLY? not today
     query = size_max(query, BLOCK_MIN_CAPACITY);
 
-    // try to allocate in existing heap
-    struct block_search_result search_result = try_memalloc_existing(query, heap_start);
-
-    // if success - return found block
-    if (search_result.type == BSR_FOUND_GOOD_BLOCK) {
-        return search_result.block;
-    }
+    // try to allocate in existing heap, cached small blocks may make room once they are merged
+    struct block_search_result search_result = find_placed(heap, query, heap_start);
 
-    // if no more space - try to grow heap
-    if (search_result.type == BSR_REACHED_END_NOT_FOUND) {
-        struct block_header* new_block = grow_heap(search_result.block, query);
+    // if no more space - try to grow heap (pinned heap never grows, growing means syscalls and faults)
+    if (search_result.type == BSR_REACHED_END_NOT_FOUND && !heap->options.pinned) {
+        struct block_header* new_block = grow_heap(heap, search_result.block, query);
         if (!new_block) return NULL; // sadness :(
-        return try_memalloc_existing(query, new_block).block;
+        search_result = find_good_or_last_in(heap, new_block, query);
     }
 
-    return NULL;
+    // if success - return found block
+    if (search_result.type != BSR_FOUND_GOOD_BLOCK) return NULL;
+    block_take(search_result.block, query);
+    heap_took(heap, search_result.block);
+    return search_result.block;
 }
 
-/**
- * Allocates block in the heap and returns pointer
- * @param query amount of bytes you want to allocate
- * @return pointer to the mapped memory or null if fail
+/*  --- Индекс свободных блоков: first fit и best fit за O(log n) --- */
+
+/*
+ * Free blocks of an indexed heap form a treap. For first fit it's ordered like the chain:
+ * by the region's position in the chain, then by address. Every node knows the largest
+ * capacity in its subtree, so the leftmost block that fits is found without visiting the
+ * others. Neighbouring free blocks are merged right away, the same runs a chain walk would
+ * merge lazily.
+ * For best fit it's ordered by capacity, then by address. A released block merges only with
+ * the blocks after it (the one before it can't be found by size), the rest is merged when
+ * nothing fits, in the regions whose bound says a merged run may fit
  */
-void* _malloc( size_t query ) {
-  struct block_header* const addr = memalloc( query, (struct block_header*) HEAP_START );
-  if (addr) return addr->contents;
-  else return NULL;
+
+struct free_node {
+  struct block_header* left;
+  struct block_header* right;
+  size_t               max;  /* largest capacity in the subtree */
+};
+
+struct tree_key { size_t major; uintptr_t addr; };
+
+static struct free_node* free_node( struct block_header* block ) { return (struct free_node*) block->contents; }
+
+static size_t subtree_max( struct block_header* block ) { return block ? free_node(block)->max : 0; }
+
+static void node_update( struct block_header* block ) {
+    struct free_node* const node = free_node(block);
+    node->max = size_max(block->capacity.bytes, size_max(subtree_max(node->left), subtree_max(node->right)));
+}
+
+static uint64_t node_priority( struct block_header const* block ) {
+    // derived from the address, so a node needs no field for it
+    return (uint64_t) (uintptr_t) block * 0x9E3779B97F4A7C15ULL;
+}
+
+static struct tree_key tree_key_of( struct heap* heap, struct block_header const* block ) {
+    if (heap->options.fit == HEAP_FIT_BEST) return (struct tree_key) { .major = block->capacity.bytes, .addr = (uintptr_t) block };
+
+    struct region_desc const* const region = region_find(heap, block);
+    return (struct tree_key) { .major = region ? region->seq : 0, .addr = (uintptr_t) block };
+}
+
+static bool key_less( struct tree_key a, struct tree_key b ) {
+    return a.major < b.major || (a.major == b.major && a.addr < b.addr);
 }
 
 /**
- * Gets block_header pointer from it content
- * @param contents content pointer :)
- * @return block_header pointer
+ * Splits the subtree into blocks before the key and the rest
+ * @param heap heap
+ * @param root subtree
+ * @param key position in the tree
+ * @param less where to put the subtree of blocks before the key
+ * @param rest where to put the subtree of the other blocks
  */
-static struct block_header* block_get_header(void* contents) {
-  return (struct block_header*) (((uint8_t*)contents)-offsetof(struct block_header, contents));
+static void tree_split( struct heap* heap, struct block_header* root, struct tree_key key,
+                        struct block_header** less, struct block_header** rest ) {
+    if (!root) {
+        *less = *rest = NULL;
+        return;
+    }
+
+    struct free_node* const node = free_node(root);
+    if (key_less(tree_key_of(heap, root), key)) {
+        tree_split(heap, node->right, key, &node->right, rest);
+        *less = root;
+    } else {
+        tree_split(heap, node->left, key, less, &node->left);
+        *rest = root;
+    }
+    node_update(root);
 }
 
 /**
- * Deallocate mapped memory from the heap
- * @param mem pointer to the mapped area
+ * Joins two subtrees, every block of the first one goes before the second one
+ * @return joined subtree
  */
-void _free( void* mem ) {
-  if (!mem) return ;
-  struct block_header* header = block_get_header( mem );
-  header->is_free = true;
-  // what's time?
-  // IT'S MERGE TIME
-  while (try_merge_with_next(header));
+static struct block_header* tree_join( struct block_header* less, struct block_header* rest ) {
+    if (!less) return rest;
+    if (!rest) return less;
+
+    if (node_priority(less) > node_priority(rest)) {
+        free_node(less)->right = tree_join(free_node(less)->right, rest);
+        node_update(less);
+        return less;
+    }
+    free_node(rest)->left = tree_join(less, free_node(rest)->left);
+    node_update(rest);
+    return rest;
+}
+
+static void tree_insert( struct heap* heap, struct block_header* block ) {
+    *free_node(block) = (struct free_node) { .left = NULL, .right = NULL, .max = block->capacity.bytes };
+
+    struct block_header* less;
+    struct block_header* rest;
+    tree_split(heap, heap->free_root, tree_key_of(heap, block), &less, &rest);
+    heap->free_root = tree_join(tree_join(less, block), rest);
 }
+
+static struct block_header* tree_remove_from( struct heap* heap, struct block_header* root,
+                                              struct block_header* block, struct tree_key key ) {
+    if (!root) return NULL;
+    if (root == block) return tree_join(free_node(block)->left, free_node(block)->right);
+
+    struct free_node* const node = free_node(root);
+    if (key_less(key, tree_key_of(heap, root))) node->left = tree_remove_from(heap, node->left, block, key);
+    else node->right = tree_remove_from(heap, node->right, block, key);
+    node_update(root);
+    return root;
+}
+
+static void tree_remove( struct heap* heap, struct block_header* block ) {
+    heap->free_root = tree_remove_from(heap, heap->free_root, block, tree_key_of(heap, block));
+}
+
+/**
+ * Finds the first block of the chain which is big enough
+ * @param heap heap
+ * @param query capacity we need
+ * @return block or NULL
+ */
+static struct block_header* tree_first_fit( struct heap* heap, size_t query ) {
+    struct block_header* block = heap->free_root;
+    if (subtree_max(block) < query) return NULL;
+
+    while (true) {
+        struct free_node const* const node = free_node(block);
+        if (subtree_max(node->left) >= query) block = node->left;
+        else if (block_is_big_enough(query, block)) return block;
+        else block = node->right;
+    }
+}
+
+/**
+ * Finds the smallest block which is big enough (the lowest address among equal ones)
+ * @param heap heap
+ * @param query capacity we need
+ * @return block or NULL
+ */
+static struct block_header* tree_best_fit( struct heap* heap, size_t query ) {
+    struct block_header* found = NULL;
+    for (struct block_header* block = heap->free_root; block; ) {
+        if (block_is_big_enough(query, block)) {
+            found = block;
+            block = free_node(block)->left;
+        } else block = free_node(block)->right;
+    }
+    return found;
+}
+
+/**
+ * Finds the last free block before the given one in the chain (first fit order only)
+ * @param heap heap
+ * @param block block
+ * @return free block or NULL
+ */
+static struct block_header* tree_predecessor( struct heap* heap, struct block_header const* block ) {
+    const struct tree_key key = tree_key_of(heap, block);
+    struct block_header* found = NULL;
+    for (struct block_header* node = heap->free_root; node; ) {
+        if (key_less(tree_key_of(heap, node), key)) {
+            found = node;
+            node = free_node(node)->right;
+        } else node = free_node(node)->left;
+    }
+    return found;
+}
+
+/**
+ * Finds the first free block after the given one in the tree order
+ * @param heap heap
+ * @param block block
+ * @return free block or NULL
+ */
+static struct block_header* tree_successor( struct heap* heap, struct block_header const* block ) {
+    const struct tree_key key = tree_key_of(heap, block);
+    struct block_header* found = NULL;
+    for (struct block_header* node = heap->free_root; node; ) {
+        if (key_less(key, tree_key_of(heap, node))) {
+            found = node;
+            node = free_node(node)->left;
+        } else node = free_node(node)->right;
+    }
+    return found;
+}
+
+static bool heap_indexed( struct heap const* heap ) {
+    return heap->options.fit == HEAP_FIT_FIRST_INDEXED || heap->options.fit == HEAP_FIT_BEST;
+}
+
+/**
+ * Indexes the only block of a just created heap
+ * @param heap heap
+ */
+static void indexed_init( struct heap* heap ) {
+    heap->free_root = NULL;
+    heap->tail = heap->start;
+    tree_insert(heap, heap->start);
+}
+
+/**
+ * Merges every run of free blocks and indexes the result again
+ * @param heap heap
+ */
+static void tree_consolidate( struct heap* heap ) {
+    heap->free_root = NULL;
+    for (struct block_header* block = heap->start; block; block = block->next) {
+        heap->tail = block;
+        if (!block->is_free) continue;
+        while (try_merge_with_next(block));
+        tree_insert(heap, block);
+        region_note_free(heap, block);
+    }
+}
+
+/**
+ * Merges runs of free blocks in one region of a best fit heap, the region's bound becomes exact
+ * @param heap heap
+ * @param region region to merge
+ */
+static void region_consolidate( struct heap* heap, struct region_desc* region ) {
+    size_t max_free = 0;
+    struct block_header* block = region_contains(region, heap->start) ? heap->start : (struct block_header*) region->addr;
+    for (; block && region_contains(region, block); block = block->next) {
+        if (!block->is_free) continue;
+
+        if (block->next && mergeable(block, block->next)) {
+            tree_remove(heap, block);
+            for (struct block_header* next = block->next; next && mergeable(block, next); next = block->next) {
+                tree_remove(heap, next);
+                try_merge_with_next(block);
+                if (heap->tail == next) heap->tail = block;
+            }
+            tree_insert(heap, block);
+        }
+        max_free = size_max(max_free, block->capacity.bytes);
+    }
+    region->max_free = max_free;
+}
+
+/**
+ * Finds free block for the query according to the heap's placement policy
+ * @param heap indexed heap
+ * @param query capacity we need
+ * @return free indexed block or NULL
+ */
+static struct block_header* indexed_fit( struct heap* heap, size_t query ) {
+    if (heap->options.fit == HEAP_FIT_FIRST_INDEXED) return tree_first_fit(heap, query);
+
+    // the preserved top is the last resort, every block after it in the tree is bigger and fits too
+    struct block_header* block = tree_best_fit(heap, query);
+    if (heap_is_top(heap, block) && tree_successor(heap, block)) block = tree_successor(heap, block);
+    if (block && !heap_is_top(heap, block)) return block;
+
+    // blocks released after their free neighbours are still apart, merged they may fit
+    bool merged = false;
+    for (size_t i = 0; i < heap->regions.count; ++i) {
+        struct region_desc* const region = region_descs(&heap->regions) + i;
+        if (region->max_free < query) continue;
+        region_consolidate(heap, region);
+        merged = true;
+    }
+    if (!merged) return block;
+
+    // merging may have absorbed the top
+    block = tree_best_fit(heap, query);
+    if (heap_is_top(heap, block) && tree_successor(heap, block)) block = tree_successor(heap, block);
+    return block;
+}
+
+/**
+ * Finds free block for the query, cached small blocks are merged and searched again
+ * if nothing fits (or only the preserved top does)
+ * @param heap indexed heap
+ * @param query capacity we need
+ * @return free indexed block or NULL
+ */
+static struct block_header* indexed_find( struct heap* heap, size_t query ) {
+    struct block_header* block = indexed_fit(heap, query);
+    if ((!block || heap_is_top(heap, block)) && fastbins_consolidate(heap)) block = indexed_fit(heap, query);
+    return block;
+}
+
+/**
+ * Grows indexed heap after its tail
+ * @param heap heap
+ * @param query amount of bytes we want to allocate
+ * @return free indexed block big enough for query or NULL
+ */
+static struct block_header* indexed_grow( struct heap* heap, size_t query ) {
+    struct block_header* const last = heap->tail;
+
+    // the tail may grow by merging, its node is stale then
+    if (last->is_free) tree_remove(heap, last);
+    struct block_header* const grown = grow_heap(heap, last, query);
+    if (last->is_free && grown != last) tree_insert(heap, last);
+    if (!grown) return NULL;
+
+    heap->tail = grown;
+    tree_insert(heap, grown);
+    return grown;
+}
+
+/**
+ * Takes indexed free block, its split off remainder is indexed instead
+ * @param heap heap
+ * @param block free indexed block big enough for query
+ * @param query amount of bytes we allocate
+ * @return taken block
+ */
+static struct block_header* indexed_take( struct heap* heap, struct block_header* block, size_t query ) {
+    tree_remove(heap, block);
+    if (split_if_too_big(block, query)) {
+        if (heap->tail == block) heap->tail = block->next;
+        tree_insert(heap, block->next);
+    }
+    block->is_free = false;
+    region_account(heap, block, true);
+    return block;
+}
+
+/**
+ * Allocates block in indexed heap, places it exactly where memalloc would
+ * @param heap heap we allocate in
+ * @param query amount of bytes we want to allocate
+ * @return allocated block header or NULL
+ */
+static struct block_header* indexed_memalloc( struct heap* heap, size_t query ) {
+    query = size_max(query, BLOCK_MIN_CAPACITY);
+
+    struct block_header* block = indexed_find(heap, query);
+    if (!block && !heap->options.pinned) block = indexed_grow(heap, query);
+    if (!block) return NULL;
+    return indexed_take(heap, block, query);
+}
+
+/**
+ * Releases block of indexed heap merging it with free neighbours
+ * @param heap heap
+ * @param block block to release
+ */
+static void indexed_free( struct heap* heap, struct block_header* block ) {
+    block->is_free = true;
+
+    // best fit may have a run of them after the block, first fit has one at most
+    for (struct block_header* next = block->next; next && mergeable(block, next); next = block->next) {
+        tree_remove(heap, next);
+        try_merge_with_next(block);
+        if (heap->tail == next) heap->tail = block;
+    }
+
+    struct block_header* const prev = heap->options.fit == HEAP_FIT_FIRST_INDEXED ? tree_predecessor(heap, block) : NULL;
+    if (prev && blocks_continuous(prev, block)) {
+        tree_remove(heap, prev);
+        try_merge_with_next(prev);
+        if (heap->tail == block) heap->tail = prev;
+        block = prev;
+    }
+
+    tree_insert(heap, block);
+    if (heap->options.fit == HEAP_FIT_BEST) region_note_released(heap, block);
+    else region_note_free(heap, block);
+}
+
+/**
+ * Gets block_header pointer from it content
+ * @param contents content pointer :)
+ * @return block_header pointer
+ */
+static struct block_header* block_get_header(void* contents) {
+  return (struct block_header*) (((uint8_t*)contents)-offsetof(struct block_header, contents));
+}
+
+/**
+ * Returns taken block to the heap's free blocks
+ * @param heap heap the block belongs to
+ * @param header taken block
+ */
+static void heap_release( struct heap* heap, struct block_header* header ) {
+  region_account( heap, header, false );
+  if (heap_indexed(heap)) {
+    indexed_free( heap, header );
+    return;
+  }
+
+  header->is_free = true;
+  // what's time?
+  // IT'S MERGE TIME
+  while (heap_merge_with_next(heap, header));
+  region_note_released( heap, header );
+}
+
+/*  --- Fastbins: недавно освобождённые маленькие блоки --- */
+
+/*
+ * A released small block goes to the LIFO list of its size class (8 bytes wide, small queries
+ * are rounded up to the class) and stays taken in the chain, so nothing merges it and the next
+ * query of that class takes it back without a search or a split. A block which couldn't be
+ * split exactly goes to the class below its capacity. Lists are linked through the blocks'
+ * contents. Cached blocks are released for real (consolidated) before the heap grows and
+ * before it's trimmed or purged
+ */
+
+static struct block_header** fastbin_next( struct block_header* block ) { return (struct block_header**) block->contents; }
+
+/* the largest class, queries above it aren't cached */
+static size_t fastbin_limit( struct heap const* heap ) {
+  return round_down( heap->options.fastbin_max < FASTBIN_MAX_CAPACITY ? heap->options.fastbin_max : FASTBIN_MAX_CAPACITY, FASTBIN_STEP );
+}
+
+/**
+ * Rounds a small query up to the capacity of its fastbin, so released blocks fit the same queries exactly
+ * @param heap heap
+ * @param query amount of bytes
+ * @return query to allocate
+ */
+static size_t fastbin_query( struct heap const* heap, size_t query ) {
+  if (fastbin_limit(heap) < BLOCK_MIN_CAPACITY || query > fastbin_limit(heap)) return query;
+  return round_up(size_max(query, BLOCK_MIN_CAPACITY), FASTBIN_STEP);
+}
+
+/**
+ * Finds the fastbin of the capacity, every block of the bin fits a query rounded to its class
+ * @param heap heap
+ * @param capacity block capacity
+ * @return fastbin index or FASTBIN_COUNT if such blocks aren't cached
+ */
+static size_t fastbin_index( struct heap const* heap, size_t capacity ) {
+  const size_t limit = fastbin_limit(heap);
+  if (limit < BLOCK_MIN_CAPACITY || capacity >= limit + FASTBIN_STEP) return FASTBIN_COUNT;
+  return (capacity - BLOCK_MIN_CAPACITY) / FASTBIN_STEP;
+}
+
+/**
+ * Caches released block in its fastbin
+ * @param heap heap
+ * @param block taken block
+ * @return true if cached
+ */
+static bool fastbin_push( struct heap* heap, struct block_header* block ) {
+    // a padded block may keep a few bytes after its last line, padded queries only ask for whole lines
+    const size_t capacity = heap->options.cacheline_pad ? block->capacity.bytes / CACHE_LINE * CACHE_LINE : block->capacity.bytes;
+    const size_t index = fastbin_index(heap, capacity);
+    if (index == FASTBIN_COUNT) return false;
+    if (heap->fastbins[index] == block) return true; // released twice in a row
+
+    *fastbin_next(block) = heap->fastbins[index];
+    heap->fastbins[index] = block;
+    return true;
+}
+
+/**
+ * Takes the most recently cached block of the query's class
+ * @param heap heap
+ * @param query query rounded by fastbin_query
+ * @return block or NULL
+ */
+static struct block_header* fastbin_pop( struct heap* heap, size_t query ) {
+    if (query > fastbin_limit(heap)) return NULL;
+    const size_t index = fastbin_index(heap, query);
+    if (index == FASTBIN_COUNT || !heap->fastbins[index]) return NULL;
+
+    struct block_header* const block = heap->fastbins[index];
+    heap->fastbins[index] = *fastbin_next(block);
+    return block;
+}
+
+/**
+ * Releases every cached block, so they merge with their free neighbours
+ * @param heap heap
+ * @return true if anything was cached
+ */
+static bool fastbins_consolidate( struct heap* heap ) {
+    bool released = false;
+    for (size_t i = 0; i < FASTBIN_COUNT; ++i) {
+        for (struct block_header* block = heap->fastbins[i]; block; ) {
+            struct block_header* const next = *fastbin_next(block);
+            heap_release(heap, block);
+            block = next;
+            released = true;
+        }
+        heap->fastbins[i] = NULL;
+    }
+    return released;
+}
+
+/**
+ * Takes block from the heap with its placement policy
+ * @param heap heap we allocate in
+ * @param query amount of bytes
+ * @param grow whether the heap may grow (make syscalls)
+ * @return taken block or NULL
+ */
+static struct block_header* block_alloc( struct heap* heap, size_t query, bool grow ) {
+    if (grow) return heap_indexed(heap) ? indexed_memalloc(heap, query) : memalloc(heap, query, heap->start);
+
+    query = size_max(query, BLOCK_MIN_CAPACITY);
+    if (heap_indexed(heap)) {
+        struct block_header* const block = indexed_find(heap, query);
+        return block ? indexed_take(heap, block, query) : NULL;
+    }
+
+    const struct block_search_result search_result = find_placed(heap, query, heap->start);
+    if (search_result.type != BSR_FOUND_GOOD_BLOCK) return NULL;
+    block_take(search_result.block, query);
+    heap_took(heap, search_result.block);
+    return search_result.block;
+}
+
+/*  --- Слэбы: маленькие объекты без заголовков --- */
+
+/*
+ * Queries of at most SLAB_MAX_OBJECT bytes are rounded up to a class (SLAB_STEP wide) and served
+ * from slabs: pages carved out of the block heap as SLAB_SIZE-aligned taken blocks. A slab keeps
+ * a bitmap of free slots in its header, the objects have no headers at all. The slabs of a class
+ * which have free slots are linked, a slab gets out of the list when it's full and goes back to
+ * the block heap when it's empty (unless it's the last one of its class with free slots).
+ * Freed pointers are told from blocks by the page map, slab pages point to their slabs there.
+ *
+ * Tiny queries (at most TINY_MAX_OBJECT bytes) get the same slabs, only bigger: a 4 KiB slab
+ * of 8-byte slots spends a block header, its own header and the alignment slack on 496 objects,
+ * a TINY_SLAB_SIZE one spends them on 8056
+ */
+
+/**
+ * Takes a block whose contents are aligned, the slack around it goes back to the heap
+ * @param heap heap we allocate in
+ * @param align alignment of the contents (power of two)
+ * @param query amount of bytes
+ * @param grow whether the heap may grow
+ * @return taken block or NULL
+ */
+static struct block_header* block_alloc_aligned( struct heap* heap, size_t align, size_t query, bool grow ) {
+    const size_t header = offsetof(struct block_header, contents);
+    struct block_header* const block = block_alloc(heap, query + align + header + BLOCK_MIN_CAPACITY, grow);
+    if (!block) return NULL;
+
+    // the first aligned contents which leave room for a block before them
+    uint8_t* const contents = (uint8_t*) round_up((uintptr_t) block->contents + BLOCK_MIN_CAPACITY + header, align);
+    struct block_header* const aligned = (struct block_header*) (contents - header);
+    *aligned = (struct block_header) { .next = block->next, .capacity = { (uint8_t*) block_after(block) - contents }, .is_free = false };
+    block->next = aligned;
+    block->capacity.bytes = (uint8_t*) aligned - block->contents;
+    if (heap->tail == block) heap->tail = aligned;
+
+    // the rest after the aligned block, if it makes a block
+    if (aligned->capacity.bytes >= query + header + BLOCK_MIN_CAPACITY) {
+        struct block_header* const rest = (struct block_header*) (contents + query);
+        *rest = (struct block_header) { .next = aligned->next, .capacity = { aligned->capacity.bytes - query - header }, .is_free = false };
+        aligned->next = rest;
+        aligned->capacity.bytes = query;
+        if (heap->tail == aligned) heap->tail = rest;
+        heap_release(heap, rest);
+    }
+
+    heap_release(heap, block);
+    return aligned;
+}
+
+/**
+ * Rounds the query up to whole cache lines if the heap pads blocks
+ * @param heap heap
+ * @param query amount of bytes
+ * @return query to allocate
+ */
+static size_t padded_query( struct heap const* heap, size_t query ) {
+    return heap->options.cacheline_pad ? round_up(size_max(query, 1), CACHE_LINE) : query;
+}
+
+/**
+ * Takes a block for the padded query. A padded heap aligns the contents to a cache line,
+ * the next block's header starts on the line after the query, so the lines are the block's own
+ * @param heap heap we allocate in
+ * @param query amount of bytes, padded_query already applied
+ * @param grow whether the heap may grow
+ * @return taken block or NULL
+ */
+static struct block_header* block_alloc_padded( struct heap* heap, size_t query, bool grow ) {
+    if (!heap->options.cacheline_pad) return block_alloc(heap, query, grow);
+    return block_alloc_aligned(heap, CACHE_LINE, query, grow);
+}
+
+/**
+ * Finds the slab the object belongs to
+ * @param heap heap
+ * @param mem object or block contents
+ * @return slab or NULL if the pointer isn't an object of a slab
+ */
+static struct slab* slab_find( struct heap* heap, void const* mem ) {
+    if (!heap->slab_count) return NULL;
+    const uintptr_t page = pagemap_get(&heap->pagemap, mem);
+    return page > PAGEMAP_BLOCKS && !(page & PAGEMAP_LARGE) ? (struct slab*) page : NULL;
+}
+
+static size_t slab_class( size_t query ) { return query ? (query - 1) / SLAB_STEP : 0; }
+
+static bool slab_is_tiny( struct slab const* slab ) { return slab->size == TINY_SLAB_SIZE; }
+
+static uint8_t* slab_objects( struct slab* slab ) {
+    return (uint8_t*) slab + (slab_is_tiny(slab) ? TINY_OBJECTS_OFFSET : SLAB_OBJECTS_OFFSET) + slab->color;
+}
+
+/**
+ * Lays the objects of a new slab out: as many as fit with room for the colours, the slack after
+ * them decides how many colours the slab may take, the class's counter picks the next one
+ * @param heap heap
+ * @param slab slab with object_size and size set
+ * @param class size class
+ */
+static void slab_color( struct heap* heap, struct slab* slab, size_t class ) {
+    const size_t space = slab->size - (slab_objects(slab) - (uint8_t*) slab);
+    const size_t colors = size_min(size_max(heap->options.slab_colors, 1), SLAB_MAX_COLORS);
+    slab->capacity = (uint32_t) ((space - (colors - 1) * CACHE_LINE) / slab->object_size);
+
+    const size_t slack = space - (size_t) slab->capacity * slab->object_size;
+    const size_t usable = size_min(colors, slack / CACHE_LINE + 1);
+    slab->color = (uint32_t) (heap->slab_colors[class]++ % usable * CACHE_LINE);
+}
+
+/**
+ * Makes a new slab of the class and puts it to the class's list
+ * @param heap heap
+ * @param class size class
+ * @param grow whether the heap may grow
+ * @return slab or NULL
+ */
+static struct slab* slab_create( struct heap* heap, size_t class, bool grow ) {
+    const uint32_t object_size = (uint32_t) ((class + 1) * SLAB_STEP);
+    const bool tiny = heap->options.tiny && object_size <= TINY_MAX_OBJECT;
+    const size_t size = tiny ? TINY_SLAB_SIZE : SLAB_SIZE;
+    const size_t words = tiny ? TINY_BITMAP_WORDS : SLAB_BITMAP_WORDS;
+
+    struct block_header* const block = block_alloc_aligned(heap, size, size, grow);
+    if (!block) return NULL;
+
+    struct slab* const slab = (struct slab*) block->contents;
+    if (!pagemap_set(&heap->pagemap, slab, size, (uintptr_t) slab)) {
+        pagemap_set(&heap->pagemap, slab, size, PAGEMAP_BLOCKS);
+        heap_release(heap, block);
+        return NULL;
+    }
+    ++heap->slab_count;
+
+    *slab = (struct slab) { .object_size = object_size, .used = 0, .size = (uint32_t) size };
+    slab_color(heap, slab, class);
+    memset(slab->free_bits, 0, words * sizeof(uint64_t));
+    for (size_t i = 0; i < slab->capacity; ++i) slab->free_bits[i / 64] |= 1ULL << (i % 64);
+
+    slab->next = heap->slabs[class];
+    if (slab->next) slab->next->prev = slab;
+    heap->slabs[class] = slab;
+    return slab;
+}
+
+static void slab_unlink( struct heap* heap, struct slab* slab ) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else heap->slabs[slab_class(slab->object_size)] = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+/**
+ * Takes a free slot of the query's class
+ * @param heap heap
+ * @param query amount of bytes (at most SLAB_MAX_OBJECT)
+ * @param grow whether the heap may grow for a new slab
+ * @return object or NULL
+ */
+static void* slab_malloc( struct heap* heap, size_t query, bool grow ) {
+    const size_t class = slab_class(query);
+    struct slab* slab = heap->slabs[class];
+    if (!slab) slab = slab_create(heap, class, grow);
+    if (!slab) return NULL;
+
+    size_t word = 0;
+    while (!slab->free_bits[word]) ++word;
+    const size_t slot = word * 64 + __builtin_ctzll(slab->free_bits[word]);
+    slab->free_bits[word] &= slab->free_bits[word] - 1;
+
+    if (++slab->used == slab->capacity) slab_unlink(heap, slab);
+    return slab_objects(slab) + slot * slab->object_size;
+}
+
+/**
+ * Releases an object of a slab, an empty slab goes back to the block heap
+ * @param heap heap
+ * @param slab slab of the object
+ * @param mem object
+ */
+static void slab_free( struct heap* heap, struct slab* slab, void* mem ) {
+    const size_t slot = ((uint8_t*) mem - slab_objects(slab)) / slab->object_size;
+    if (slab->free_bits[slot / 64] >> (slot % 64) & 1) return; // released twice
+    slab->free_bits[slot / 64] |= 1ULL << (slot % 64);
+
+    struct slab** const list = &heap->slabs[slab_class(slab->object_size)];
+    if (slab->used-- == slab->capacity) {
+        slab->next = *list;
+        slab->prev = NULL;
+        if (slab->next) slab->next->prev = slab;
+        *list = slab;
+    }
+
+    // the last slab of the class with free slots stays, so a single object doesn't map and release pages over and over
+    if (slab->used || (*list == slab && !slab->next)) return;
+    slab_unlink(heap, slab);
+    pagemap_set(&heap->pagemap, slab, slab->size, PAGEMAP_BLOCKS);
+    --heap->slab_count;
+    heap_release(heap, block_get_header(slab));
+}
+
+static bool slab_wants( struct heap const* heap, size_t query ) {
+    if (heap->options.cacheline_pad) return false;
+    return (heap->options.slabs && query <= SLAB_MAX_OBJECT) || (heap->options.tiny && query <= TINY_MAX_OBJECT);
+}
+
+/*  --- Большие объекты: отрезки целых страниц --- */
+
+/*
+ * Queries from options.large_min up to LARGE_MAX_OBJECT bytes never get to the block chain.
+ * They take runs of whole pages from chunks of LARGE_CHUNK_SIZE bytes mapped apart from the
+ * heap's regions, so block searches don't walk over them and their sizes are exactly page-rounded.
+ * Free runs are kept in a treap by page count (then by address), the smallest that fits is split.
+ * A freed run merges with free neighbours through the descriptors of the pages around it.
+ * Its pages stay resident for a while, the next object of the size reuses them without faults;
+ * dirty runs are queued in the order they were freed and purged once options.large_purge_delay
+ * more frees have happened. Page map entries of a chunk point to it tagged with PAGEMAP_LARGE
+ */
+
+static bool large_wants( struct heap const* heap, size_t query ) {
+    return heap->options.large_min && query >= heap->options.large_min && query <= LARGE_MAX_OBJECT && !heap->options.pinned;
+}
+
+/**
+ * Finds the large chunk the address belongs to
+ * @param heap heap
+ * @param mem any address
+ * @return chunk or NULL
+ */
+static struct large_chunk* large_find( struct heap* heap, void const* mem ) {
+    if (!heap->large.chunks) return NULL;
+    const uintptr_t page = pagemap_get(&heap->pagemap, mem);
+    return page > PAGEMAP_BLOCKS && (page & PAGEMAP_LARGE) ? (struct large_chunk*) (page & ~PAGEMAP_LARGE) : NULL;
+}
+
+static struct large_chunk* large_chunk_of( struct heap* heap, struct large_run const* run ) { return large_find(heap, run); }
+
+static size_t large_index( struct large_chunk const* chunk, struct large_run const* run ) { return run - chunk->runs; }
+
+static uint8_t* large_pages( struct large_chunk* chunk, size_t index ) { return (uint8_t*) chunk + index * LARGE_PAGE_SIZE; }
+
+static bool run_less( struct large_run const* a, struct large_run const* b ) {
+    return a->pages < b->pages || (a->pages == b->pages && a < b);
+}
+
+static uint64_t run_priority( struct large_run const* run ) { return (uint64_t) (uintptr_t) run * 0x9E3779B97F4A7C15ULL; }
+
+static void run_tree_split( struct large_run* root, struct large_run const* key, struct large_run** less, struct large_run** rest ) {
+    if (!root) {
+        *less = *rest = NULL;
+        return;
+    }
+    if (run_less(root, key)) {
+        run_tree_split(root->right, key, &root->right, rest);
+        *less = root;
+    } else {
+        run_tree_split(root->left, key, less, &root->left);
+        *rest = root;
+    }
+}
+
+static struct large_run* run_tree_join( struct large_run* less, struct large_run* rest ) {
+    if (!less) return rest;
+    if (!rest) return less;
+    if (run_priority(less) > run_priority(rest)) {
+        less->right = run_tree_join(less->right, rest);
+        return less;
+    }
+    rest->left = run_tree_join(less, rest->left);
+    return rest;
+}
+
+static void run_tree_insert( struct large_space* space, struct large_run* run ) {
+    struct large_run* less;
+    struct large_run* rest;
+    run->left = run->right = NULL;
+    run_tree_split(space->free_root, run, &less, &rest);
+    space->free_root = run_tree_join(run_tree_join(less, run), rest);
+}
+
+static struct large_run* run_tree_remove_from( struct large_run* root, struct large_run* run ) {
+    if (root == run) return run_tree_join(run->left, run->right);
+    if (run_less(run, root)) root->left = run_tree_remove_from(root->left, run);
+    else root->right = run_tree_remove_from(root->right, run);
+    return root;
+}
+
+static void run_tree_remove( struct large_space* space, struct large_run* run ) {
+    space->free_root = run_tree_remove_from(space->free_root, run);
+}
+
+/**
+ * Finds the smallest free run of at least the given pages (the lowest address among equal ones)
+ * @param space large space
+ * @param pages pages we need
+ * @return run or NULL
+ */
+static struct large_run* run_tree_best_fit( struct large_space* space, size_t pages ) {
+    struct large_run* found = NULL;
+    for (struct large_run* run = space->free_root; run; ) {
+        if (run->pages >= pages) {
+            found = run;
+            run = run->left;
+        } else run = run->right;
+    }
+    return found;
+}
+
+static void dirty_unlink( struct large_space* space, struct large_run* run ) {
+    if (run->older) run->older->newer = run->newer;
+    else space->oldest = run->newer;
+    if (run->newer) run->newer->older = run->older;
+    else space->newest = run->older;
+    run->older = run->newer = NULL;
+    run->dirty = false;
+}
+
+static void dirty_push( struct large_space* space, struct large_run* run ) {
+    run->dirty = true;
+    run->newer = NULL;
+    run->older = space->newest;
+    if (space->newest) space->newest->newer = run;
+    else space->oldest = run;
+    space->newest = run;
+}
+
+/**
+ * Describes a run by its first and last pages
+ * @param chunk chunk
+ * @param index first page of the run
+ * @param pages length of the run
+ * @param is_free whether the run is free
+ * @return descriptor of the run
+ */
+static struct large_run* large_mark( struct large_chunk* chunk, size_t index, size_t pages, bool is_free ) {
+    struct large_run* const run = &chunk->runs[index];
+    run->pages = (uint32_t) pages;
+    run->is_free = is_free;
+    chunk->runs[index + pages - 1].pages = (uint32_t) pages;
+    chunk->runs[index + pages - 1].is_free = is_free;
+    return run;
+}
+
+/**
+ * Maps a new chunk, all of it after the header is one free clean run
+ * @param heap heap
+ * @return chunk or NULL
+ */
+static struct large_chunk* large_chunk_create( struct heap* heap ) {
+    struct page_provider* const provider = heap_provider(heap);
+    struct large_chunk* const chunk = provider->map(provider, NULL, LARGE_CHUNK_SIZE, heap_map_flags(heap));
+    if (chunk == MAP_FAILED) return NULL;
+    if (!pagemap_set(&heap->pagemap, chunk, LARGE_CHUNK_SIZE, (uintptr_t) chunk | PAGEMAP_LARGE)) {
+        pagemap_set(&heap->pagemap, chunk, LARGE_CHUNK_SIZE, 0);
+        provider->unmap(provider, chunk, LARGE_CHUNK_SIZE);
+        return NULL;
+    }
+
+    chunk->prev = NULL;
+    chunk->next = heap->large.chunks;
+    if (chunk->next) chunk->next->prev = chunk;
+    heap->large.chunks = chunk;
+
+    run_tree_insert(&heap->large, large_mark(chunk, LARGE_HEADER_PAGES, LARGE_CHUNK_PAGES - LARGE_HEADER_PAGES, true));
+    return chunk;
+}
+
+/**
+ * Drops physical pages of the dirty runs freed at least the delay ago (all of them if forced)
+ * @param heap heap
+ * @param all purge regardless of the age
+ */
+static void large_purge( struct heap* heap, bool all ) {
+    struct large_space* const space = &heap->large;
+    const size_t delay = heap->options.large_purge_delay ? heap->options.large_purge_delay : LARGE_DEFAULT_PURGE_DELAY;
+    struct page_provider* const provider = heap_provider(heap);
+
+    while (space->oldest && (all || space->oldest->freed_at + delay <= space->epoch)) {
+        struct large_run* const run = space->oldest;
+        struct large_chunk* const chunk = large_chunk_of(heap, run);
+        provider->advise(provider, large_pages(chunk, large_index(chunk, run)), (size_t) run->pages * LARGE_PAGE_SIZE, MADV_DONTNEED);
+        dirty_unlink(space, run);
+    }
+}
+
+/**
+ * Takes the smallest free run that fits, the rest of it stays free
+ * @param heap heap
+ * @param query amount of bytes (at most LARGE_MAX_OBJECT)
+ * @param grow whether a new chunk may be mapped
+ * @return pages of the run or NULL
+ */
+static void* large_malloc( struct heap* heap, size_t query, bool grow ) {
+    struct large_space* const space = &heap->large;
+    const size_t pages = round_up(query ? query : 1, LARGE_PAGE_SIZE) / LARGE_PAGE_SIZE;
+
+    struct large_run* run = run_tree_best_fit(space, pages);
+    if (!run && grow && large_chunk_create(heap)) run = run_tree_best_fit(space, pages);
+    if (!run) return NULL;
+
+    struct large_chunk* const chunk = large_chunk_of(heap, run);
+    const size_t index = large_index(chunk, run);
+    const size_t total = run->pages;
+    run_tree_remove(space, run);
+
+    // the rest takes the run's place in the dirty queue, it was freed at the same time
+    if (total > pages) {
+        struct large_run* const rest = large_mark(chunk, index + pages, total - pages, true);
+        rest->dirty = run->dirty;
+        rest->freed_at = run->freed_at;
+        rest->older = run->older;
+        rest->newer = run->newer;
+        if (run->dirty) {
+            if (rest->older) rest->older->newer = rest;
+            else space->oldest = rest;
+            if (rest->newer) rest->newer->older = rest;
+            else space->newest = rest;
+        }
+        run_tree_insert(space, rest);
+    } else if (run->dirty) dirty_unlink(space, run);
+
+    run->dirty = false;
+    run->older = run->newer = NULL;
+    large_mark(chunk, index, pages, false);
+    return large_pages(chunk, index);
+}
+
+/**
+ * Frees the run of a large object, merging it with free neighbours
+ * @param heap heap
+ * @param chunk chunk of the object
+ * @param mem object
+ */
+static void large_free( struct heap* heap, struct large_chunk* chunk, void* mem ) {
+    struct large_space* const space = &heap->large;
+    size_t index = ((uint8_t*) mem - (uint8_t*) chunk) / LARGE_PAGE_SIZE;
+    if (chunk->runs[index].is_free) return; // released twice
+    size_t pages = chunk->runs[index].pages;
+
+    const size_t after = index + pages;
+    if (after < LARGE_CHUNK_PAGES && chunk->runs[after].is_free) {
+        struct large_run* const next = &chunk->runs[after];
+        run_tree_remove(space, next);
+        if (next->dirty) dirty_unlink(space, next);
+        pages += next->pages;
+    }
+    if (index > LARGE_HEADER_PAGES && chunk->runs[index - 1].is_free) {
+        struct large_run* const prev = &chunk->runs[index - chunk->runs[index - 1].pages];
+        run_tree_remove(space, prev);
+        if (prev->dirty) dirty_unlink(space, prev);
+        index -= prev->pages;
+        pages += prev->pages;
+    }
+
+    struct large_run* const run = large_mark(chunk, index, pages, true);
+    run->freed_at = ++space->epoch;
+    dirty_push(space, run);
+    run_tree_insert(space, run);
+    large_purge(heap, false);
+}
+
+/**
+ * Unmaps the chunks without a single taken page
+ * @param heap heap
+ */
+static void large_trim( struct heap* heap ) {
+    struct page_provider* const provider = heap_provider(heap);
+    for (struct large_chunk* chunk = heap->large.chunks, *next; chunk; chunk = next) {
+        next = chunk->next;
+        struct large_run* const run = &chunk->runs[LARGE_HEADER_PAGES];
+        if (!run->is_free || run->pages != LARGE_CHUNK_PAGES - LARGE_HEADER_PAGES) continue;
+
+        run_tree_remove(&heap->large, run);
+        if (run->dirty) dirty_unlink(&heap->large, run);
+        if (chunk->prev) chunk->prev->next = chunk->next;
+        else heap->large.chunks = chunk->next;
+        if (chunk->next) chunk->next->prev = chunk->prev;
+        pagemap_set(&heap->pagemap, chunk, LARGE_CHUNK_SIZE, 0);
+        provider->unmap(provider, chunk, LARGE_CHUNK_SIZE);
+    }
+}
+
+/**
+ * Unmaps every chunk of the large space
+ * @param heap heap
+ */
+static void large_destroy( struct heap* heap ) {
+    struct page_provider* const provider = heap_provider(heap);
+    for (struct large_chunk* chunk = heap->large.chunks, *next; chunk; chunk = next) {
+        next = chunk->next;
+        provider->unmap(provider, chunk, LARGE_CHUNK_SIZE);
+    }
+    heap->large = (struct large_space) {0};
+}
+
+/*  --- Время жизни: короткоживущие и долгоживущие объекты в своих подкучах --- */
+
+/**
+ * Finds the sub-heap of the lifetime class, it's created on the first hint
+ * @param heap heap
+ * @param hint HINT_SHORT_LIVED or HINT_LONG_LIVED
+ * @return sub-heap or NULL (pinned heap never maps another one)
+ */
+static struct heap* lifetime_heap( struct heap* heap, enum heap_hint hint ) {
+    struct heap** const sub = &heap->lifetimes[hint - 1];
+    if (*sub || heap->options.pinned) return *sub;
+
+    // the same tunables, only the sub-heap doesn't learn by itself
+    struct heap_options options = heap->options;
+    options.short_lifetime = 0;
+    *sub = heap_create(0, &options);
+    return *sub;
+}
+
+/**
+ * Finds the sub-heap the memory belongs to
+ * @param heap heap
+ * @param mem any address
+ * @return sub-heap or NULL if it's the heap's own memory (or nobody's)
+ */
+static struct heap* lifetime_owner( struct heap* heap, void const* mem ) {
+    for (size_t i = 0; i < LIFETIME_CLASSES; ++i) {
+        if (heap->lifetimes[i] && heap_owns(heap->lifetimes[i], mem)) return heap->lifetimes[i];
+    }
+    return NULL;
+}
+
+static size_t lifetime_hash( uint64_t key, size_t buckets ) { return (size_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & (buckets - 1); }
+
+/**
+ * Maps the statistics of learned lifetimes, like the region table they never come from the heap's provider
+ * @return zeroed table or NULL
+ */
+static struct lifetime_table* lifetime_table_map( void ) {
+    struct lifetime_table* const table = map_pages(NULL, round_pages(sizeof(struct lifetime_table)), 0);
+    return table == MAP_FAILED ? NULL : table;
+}
+
+static void lifetime_table_reset( struct heap* heap ) {
+    if (heap->lifetime) munmap(heap->lifetime, round_pages(sizeof(struct lifetime_table)));
+    heap->lifetime = NULL;
+}
+
+/**
+ * Finds statistics of the site, a new site takes an empty slot
+ * @param table statistics
+ * @param site site
+ * @return statistics of the site or NULL if the table is full
+ */
+static struct lifetime_site* lifetime_site( struct lifetime_table* table, uint32_t site ) {
+    size_t slot = lifetime_hash(site, LIFETIME_SITES);
+    for (size_t i = 0; i < LIFETIME_SITES; ++i, slot = (slot + 1) & (LIFETIME_SITES - 1)) {
+        struct lifetime_site* const stats = &table->sites[slot];
+        if (!stats->used) *stats = (struct lifetime_site) { .site = site, .used = true };
+        if (stats->site == site) return stats;
+    }
+    return NULL;
+}
+
+static void lifetime_record( struct lifetime_table* table, struct lifetime_sample const* sample ) {
+    struct lifetime_site* const stats = lifetime_site(table, sample->site);
+    if (!stats) return;
+    stats->samples++;
+    stats->total += table->clock - sample->birth;
+}
+
+/**
+ * Predicts the lifetime class of the site's next object from the lifetimes of its sampled ones
+ * @param heap learning heap
+ * @param stats statistics of the site or NULL
+ * @return lifetime class, HINT_NONE until enough objects are observed or if they live moderately
+ */
+static enum heap_hint lifetime_predict( struct heap const* heap, struct lifetime_site const* stats ) {
+    if (!stats || stats->samples < LIFETIME_MIN_SAMPLES) return HINT_NONE;
+    const uint64_t mean = stats->total / stats->samples;
+    if (mean < heap->options.short_lifetime) return HINT_SHORT_LIVED;
+    if (mean >= LIFETIME_LONG_FACTOR * heap->options.short_lifetime) return HINT_LONG_LIVED;
+    return HINT_NONE;
+}
+
+/**
+ * Records objects alive past the long-lived bound as long-lived (they live at least that long),
+ * their slots are freed for new samples
+ * @param heap learning heap
+ */
+static void lifetime_sweep( struct heap* heap ) {
+    struct lifetime_table* const table = heap->lifetime;
+    for (size_t i = 0; i < LIFETIME_SAMPLES; ++i) {
+        struct lifetime_sample* const slot = &table->samples[i];
+        if (!slot->mem || table->clock - slot->birth < LIFETIME_LONG_FACTOR * heap->options.short_lifetime) continue;
+        lifetime_record(table, slot);
+        slot->mem = NULL;
+    }
+}
+
+/**
+ * Starts observing the object if its tick is sampled and its slot is empty. Once in LIFETIME_SAMPLES
+ * ticks the table is swept, so that objects which are never freed don't keep their slots
+ * @param heap learning heap
+ * @param mem object just allocated
+ * @param site its site
+ */
+static void lifetime_sample( struct heap* heap, void const* mem, uint32_t site ) {
+    struct lifetime_table* const table = heap->lifetime;
+    if (table->clock % LIFETIME_SAMPLES == 0) lifetime_sweep(heap);
+    if (table->clock % LIFETIME_SAMPLE_PERIOD) return;
+
+    struct lifetime_sample* const slot = &table->samples[lifetime_hash((uintptr_t) mem, LIFETIME_SAMPLES)];
+    if (!slot->mem) *slot = (struct lifetime_sample) { .mem = mem, .birth = table->clock, .site = site };
+}
+
+/**
+ * Records the lifetime of the object if it's sampled
+ * @param heap learning heap
+ * @param mem object being freed
+ */
+static void lifetime_observe( struct heap* heap, void const* mem ) {
+    struct lifetime_table* const table = heap->lifetime;
+    struct lifetime_sample* const slot = &table->samples[lifetime_hash((uintptr_t) mem, LIFETIME_SAMPLES)];
+    if (slot->mem != mem) return;
+    lifetime_record(table, slot);
+    slot->mem = NULL;
+}
+
+/*  --- Размещение рядом: объекты, которые обходят вместе --- */
+
+static size_t distance( uint8_t const* a, uint8_t const* b ) { return a < b ? (size_t) (b - a) : (size_t) (a - b); }
+
+/**
+ * Finds free block for the query closest to the address in its region, the walk stops
+ * at the first fitting block after the address (the next ones are only farther)
+ * @param heap heap
+ * @param region region of the address
+ * @param near address
+ * @param query capacity we need
+ * @return free block (indexed if the heap is) or NULL
+ */
+static struct block_header* region_fit_near( struct heap* heap, struct region_desc* region, uint8_t const* near, size_t query ) {
+    struct block_header* found = NULL;
+    struct block_header* block = region_contains(region, heap->start) ? heap->start : (struct block_header*) region->addr;
+    for (; block && region_contains(region, block); block = block->next) {
+        if (!block->is_free) continue;
+
+        // indexed heaps keep free blocks in the tree as they are
+        if (!heap_indexed(heap)) {
+            while (heap_merge_with_next(heap, block));
+            region_note_free(heap, block);
+        }
+        if (!block_is_big_enough(query, block) || heap_is_top(heap, block)) continue;
+
+        if (!found || distance(block->contents, near) < distance(found->contents, near)) found = block;
+        if (block->contents > near) break;
+    }
+    return found;
+}
+
+/*  --- Кэши объектов: объекты, сохраняющие состояние после конструктора --- */
+
+/*
+ * An object cache hands out objects of one size in their constructed state. Freed objects
+ * aren't destroyed, they wait in the cache for the next allocation, so the constructor runs once
+ * per object's memory, not per allocation (Bonwick's object caching). Objects are ordinary
+ * allocations of the heap: small ones come from its slabs if they are on. The destructor runs
+ * only when the cache shrinks: heap_trim reaps every cache of the heap, the cache gives back the
+ * objects it didn't need since the previous reap. The cached list is under the lock of its cache.
+ * Caches of one heap may be used by different threads, so the heap calls of all of them and the list
+ * of caches are under one lock of the heap. Constructors and destructors run outside of both
+ */
+
+static void** objcache_link( struct objcache const* cache, void* object ) {
+    return (void**) ((uint8_t*) object + cache->link);
+}
+
+/**
+ * Allocates memory of a new object aligned for any type, constructors put mutexes and the like there.
+ * Slab and large objects are aligned as they are: the size is a multiple of the alignment
+ * @param cache cache, the heap is locked
+ * @return object memory or NULL
+ */
+static void* objcache_object_alloc( struct objcache* cache ) {
+    struct heap* const heap = cache->heap;
+    const size_t size = round_up(cache->link + sizeof(void*), alignof(max_align_t));
+    if (slab_wants(heap, size) || large_wants(heap, size)) return heap_malloc(heap, size);
+
+    // block contents follow a 17-byte header
+    struct block_header* const block = block_alloc_aligned(heap, alignof(max_align_t), size, true);
+    return block ? block->contents : NULL;
+}
+
+/* the cache is locked */
+static void* objcache_pop( struct objcache* cache ) {
+    void* const object = cache->cached;
+    if (!object) return NULL;
+    cache->cached = *objcache_link(cache, object);
+    if (--cache->cached_count < cache->low_water) cache->low_water = cache->cached_count;
+    return object;
+}
+
+/* the cache is locked */
+static void objcache_push( struct objcache* cache, void* object ) {
+    *objcache_link(cache, object) = cache->cached;
+    cache->cached = object;
+    ++cache->cached_count;
+}
+
+static void objcache_destruct( struct objcache* cache, void* const* objects, size_t count ) {
+    if (cache->dtor) {
+        for (size_t i = 0; i < count; ++i) cache->dtor(objects[i]);
+    }
+    pthread_mutex_lock(&cache->heap->objcache_lock);
+    for (size_t i = 0; i < count; ++i) heap_free(cache->heap, objects[i]);
+    pthread_mutex_unlock(&cache->heap->objcache_lock);
+}
+
+/**
+ * Destroys cached objects and gives their memory back to the heap
+ * @param cache cache
+ * @param count how many objects to destroy at most
+ * @return how many were destroyed
+ */
+static size_t objcache_shrink( struct objcache* cache, size_t count ) {
+    void* batch[64];
+    size_t destroyed = 0;
+    while (destroyed < count) {
+        size_t taken = 0;
+        pthread_mutex_lock(&cache->lock);
+        while (taken < 64 && destroyed + taken < count && cache->cached) batch[taken++] = objcache_pop(cache);
+        pthread_mutex_unlock(&cache->lock);
+        if (!taken) break;
+        objcache_destruct(cache, batch, taken);
+        destroyed += taken;
+    }
+    return destroyed;
+}
+
+static void objcaches_reap( struct heap* heap ) {
+    pthread_mutex_lock(&heap->objcache_lock);
+    struct objcache* cache = heap->objcaches;
+    pthread_mutex_unlock(&heap->objcache_lock);
+
+    // the reap makes heap calls under the lock itself
+    while (cache) {
+        objcache_reap(cache);
+        pthread_mutex_lock(&heap->objcache_lock);
+        cache = cache->next;
+        pthread_mutex_unlock(&heap->objcache_lock);
+    }
+}
+
+/*
+ * Magazines (Bonwick and Adams) take the lock off the way of most allocations. A thread keeps
+ * two magazines in its objcache_thread: it takes objects from the loaded one and frees them to it,
+ * when it runs out the loaded and the previous one are swapped. Only when both are empty (or
+ * both are full) the thread goes to the depot and trades the previous one for a full (an empty)
+ * magazine there in one locking. Objects travel between threads in whole magazines, the cache
+ * itself is only asked when the depot has nothing. A depot locking that had to wait counts as
+ * contention: once there was enough of it, new magazines are twice as big, so threads come
+ * to the depot half as often
+ */
+
+static struct objcache_magazine* magazine_create( struct objcache* cache, size_t capacity ) {
+    pthread_mutex_lock(&cache->heap->objcache_lock);
+    struct objcache_magazine* const magazine = heap_malloc(cache->heap, sizeof(struct objcache_magazine) + capacity * sizeof(void*));
+    pthread_mutex_unlock(&cache->heap->objcache_lock);
+    if (magazine) *magazine = (struct objcache_magazine) { .next = NULL, .capacity = capacity, .rounds = 0 };
+    return magazine;
+}
+
+/**
+ * Destroys the objects of the magazine and the magazine itself
+ * @param cache cache of the magazine
+ * @param magazine magazine
+ * @return number of destroyed objects
+ */
+static size_t magazine_destroy( struct objcache* cache, struct objcache_magazine* magazine ) {
+    const size_t rounds = magazine->rounds;
+    objcache_destruct(cache, magazine->objects, rounds);
+    pthread_mutex_lock(&cache->heap->objcache_lock);
+    heap_free(cache->heap, magazine);
+    pthread_mutex_unlock(&cache->heap->objcache_lock);
+    return rounds;
+}
+
+static void depot_lock( struct objcache_depot* depot ) {
+    if (!pthread_mutex_trylock(&depot->lock)) return;
+    pthread_mutex_lock(&depot->lock);
+    ++depot->stats.contended;
+    if (++depot->contention >= MAGAZINE_CONTENTION && depot->stats.rounds < depot->max_rounds) {
+        depot->stats.rounds = size_min(2 * depot->stats.rounds, depot->max_rounds);
+        depot->contention = 0;
+        ++depot->stats.resizes;
+    }
+}
+
+/* the depot is locked */
+static struct objcache_magazine* depot_take( struct objcache_magazine** list, size_t* count, size_t* low ) {
+    struct objcache_magazine* const magazine = *list;
+    if (!magazine) return NULL;
+    *list = magazine->next;
+    if (--*count < *low) *low = *count;
+    return magazine;
+}
+
+/* the depot is locked */
+static void depot_give( struct objcache_magazine** list, size_t* count, struct objcache_magazine* magazine ) {
+    magazine->next = *list;
+    *list = magazine;
+    ++*count;
+}
+
+/* the depot is locked, the previous magazine of the thread is full */
+static void depot_give_full( struct objcache_depot* depot, struct objcache_thread* thread ) {
+    if (!thread->previous) return;
+    depot_give(&depot->full, &depot->stats.full, thread->previous);
+    ++depot->stats.full_returned;
+}
+
+/**
+ * Makes a cache of constructed objects in the heap, magazines are off
+ * @param heap heap the objects and the cache itself are allocated in
+ * @param size object size
+ * @param ctor constructor, may be NULL
+ * @param dtor destructor, may be NULL
+ * @return cache or NULL if it couldn't be allocated
+ */
+struct objcache* heap_objcache_create( struct heap* heap, size_t size, objcache_ctor ctor, objcache_dtor dtor ) {
+    // block contents follow a 17-byte header, the locks need their alignment
+    pthread_mutex_lock(&heap->objcache_lock);
+    struct block_header* const block = block_alloc_aligned(heap, CACHE_LINE, sizeof(struct objcache), true);
+    if (!block) {
+        pthread_mutex_unlock(&heap->objcache_lock);
+        return NULL;
+    }
+    struct objcache* const cache = (struct objcache*) block->contents;
+    *cache = (struct objcache) {
+        .heap = heap, .next = heap->objcaches, .ctor = ctor, .dtor = dtor,
+        .link = round_up(size_max(size, 1), alignof(void*)), .cached = NULL, .cached_count = 0, .low_water = 0
+    };
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_mutex_init(&cache->depot.lock, NULL);
+    heap->objcaches = cache;
+    pthread_mutex_unlock(&heap->objcache_lock);
+    return cache;
+}
+
+/**
+ * Takes a constructed object, a cached one if there is any, a fresh one is constructed
+ * @param cache cache
+ * @return object or NULL if the heap is out of memory or the constructor failed
+ */
+void* objcache_alloc( struct objcache* cache ) {
+    pthread_mutex_lock(&cache->lock);
+    void* const cached = objcache_pop(cache);
+    pthread_mutex_unlock(&cache->lock);
+    if (cached) return cached;
+
+    pthread_mutex_lock(&cache->heap->objcache_lock);
+    void* const object = objcache_object_alloc(cache);
+    pthread_mutex_unlock(&cache->heap->objcache_lock);
+    if (!object) return NULL;
+
+    if (cache->ctor && !cache->ctor(object)) {
+        pthread_mutex_lock(&cache->heap->objcache_lock);
+        heap_free(cache->heap, object);
+        pthread_mutex_unlock(&cache->heap->objcache_lock);
+        return NULL;
+    }
+    return object;
+}
+
+/**
+ * Puts the object back to the cache, it must be in its constructed state
+ * @param cache cache the object was taken from
+ * @param object object or NULL
+ */
+void objcache_free( struct objcache* cache, void* object ) {
+    if (!object) return;
+    pthread_mutex_lock(&cache->lock);
+    objcache_push(cache, object);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Destroys the cached objects and frees the depot's magazines which weren't needed since the previous reap
+ * @param cache cache
+ * @return number of destroyed objects
+ */
+size_t objcache_reap( struct objcache* cache ) {
+    struct objcache_depot* const depot = &cache->depot;
+    struct objcache_magazine* idle = NULL;
+    size_t idle_count = 0;
+
+    depot_lock(depot);
+    for (size_t i = depot->full_low; i > 0; --i) depot_give(&idle, &idle_count, depot_take(&depot->full, &depot->stats.full, &depot->full_low));
+    for (size_t i = depot->empty_low; i > 0; --i) depot_give(&idle, &idle_count, depot_take(&depot->empty, &depot->stats.empty, &depot->empty_low));
+    depot->full_low = depot->stats.full;
+    depot->empty_low = depot->stats.empty;
+    pthread_mutex_unlock(&depot->lock);
+
+    size_t destroyed = 0;
+    while (idle) {
+        struct objcache_magazine* const next = idle->next;
+        destroyed += magazine_destroy(cache, idle);
+        idle = next;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    const size_t surplus = cache->low_water;
+    pthread_mutex_unlock(&cache->lock);
+    destroyed += objcache_shrink(cache, surplus);
+    pthread_mutex_lock(&cache->lock);
+    cache->low_water = cache->cached_count;
+    pthread_mutex_unlock(&cache->lock);
+    return destroyed;
+}
+
+/**
+ * Destroys every cached object and the cache, objects still taken must have been freed to it
+ * and the threads' magazines flushed
+ * @param cache cache
+ */
+void objcache_destroy( struct objcache* cache ) {
+    struct heap* const heap = cache->heap;
+    struct objcache_depot* const depot = &cache->depot;
+    struct objcache_magazine* const lists[] = { depot->full, depot->empty };
+    for (size_t i = 0; i < 2; ++i) {
+        for (struct objcache_magazine* magazine = lists[i]; magazine; ) {
+            struct objcache_magazine* const next = magazine->next;
+            magazine_destroy(cache, magazine);
+            magazine = next;
+        }
+    }
+    objcache_shrink(cache, SIZE_MAX);
+    pthread_mutex_destroy(&depot->lock);
+    pthread_mutex_destroy(&cache->lock);
+
+    pthread_mutex_lock(&heap->objcache_lock);
+    struct objcache** link = &heap->objcaches;
+    while (*link != cache) link = &(*link)->next;
+    *link = cache->next;
+    heap_free(heap, cache);
+    pthread_mutex_unlock(&heap->objcache_lock);
+}
+
+/**
+ * Turns the cache's magazines on, it should be done before threads use the cache
+ * @param cache cache
+ * @param rounds capacity of magazines, 0 means MAGAZINE_ROUNDS (16)
+ * @param max_rounds capacity they may grow up to under contention, 0 means MAGAZINE_MAX_ROUNDS (256)
+ */
+void objcache_magazines( struct objcache* cache, size_t rounds, size_t max_rounds ) {
+    struct objcache_depot* const depot = &cache->depot;
+    pthread_mutex_lock(&depot->lock);
+    depot->stats.rounds = rounds ? rounds : MAGAZINE_ROUNDS;
+    depot->max_rounds = size_max(max_rounds ? max_rounds : MAGAZINE_MAX_ROUNDS, depot->stats.rounds);
+    pthread_mutex_unlock(&depot->lock);
+}
+
+/**
+ * Reports the depot traffic of the cache
+ * @param cache cache
+ * @param stats where to put the statistics
+ */
+void objcache_stats( struct objcache* cache, struct objcache_stats* stats ) {
+    pthread_mutex_lock(&cache->depot.lock);
+    *stats = cache->depot.stats;
+    pthread_mutex_unlock(&cache->depot.lock);
+    pthread_mutex_lock(&cache->lock);
+    stats->cached = cache->cached_count;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Prepares the magazines of a thread, it has none until it frees or takes objects
+ * @param cache cache
+ * @param thread the thread's magazines
+ */
+void objcache_thread_init( struct objcache* cache, struct objcache_thread* thread ) {
+    *thread = (struct objcache_thread) { .cache = cache, .loaded = NULL, .previous = NULL };
+}
+
+/**
+ * Takes a constructed object from the thread's magazines, a full magazine of the depot
+ * or the cache itself (without magazines always the latter)
+ * @param thread the thread's magazines
+ * @return object or NULL if the heap is out of memory or the constructor failed
+ */
+void* objcache_thread_alloc( struct objcache_thread* thread ) {
+    struct objcache_magazine* const loaded = thread->loaded;
+    if (loaded && loaded->rounds) return loaded->objects[--loaded->rounds];
+    if (thread->previous && thread->previous->rounds) {
+        thread->loaded = thread->previous;
+        thread->previous = loaded;
+        return thread->loaded->objects[--thread->loaded->rounds];
+    }
+
+    // both are empty, the previous one is traded for a full one
+    struct objcache* const cache = thread->cache;
+    struct objcache_depot* const depot = &cache->depot;
+    if (depot->max_rounds) {
+        depot_lock(depot);
+        struct objcache_magazine* const full = depot_take(&depot->full, &depot->stats.full, &depot->full_low);
+        if (full) {
+            ++depot->stats.full_taken;
+            if (thread->previous) {
+                depot_give(&depot->empty, &depot->stats.empty, thread->previous);
+                ++depot->stats.empty_returned;
+            }
+            thread->previous = loaded;
+            thread->loaded = full;
+        }
+        pthread_mutex_unlock(&depot->lock);
+        if (full) return full->objects[--full->rounds];
+    }
+    return objcache_alloc(cache);
+}
+
+/**
+ * Puts the object to the thread's magazines, to an empty magazine of the depot (a new one if there is none)
+ * or to the cache itself if a magazine can't be allocated
+ * @param thread the thread's magazines
+ * @param object object in its constructed state or NULL
+ */
+void objcache_thread_free( struct objcache_thread* thread, void* object ) {
+    if (!object) return;
+    struct objcache_magazine* const loaded = thread->loaded;
+    if (loaded && loaded->rounds < loaded->capacity) {
+        loaded->objects[loaded->rounds++] = object;
+        return;
+    }
+    if (thread->previous && !thread->previous->rounds) {
+        thread->loaded = thread->previous;
+        thread->previous = loaded;
+        thread->loaded->objects[thread->loaded->rounds++] = object;
+        return;
+    }
+
+    // both are full, the previous one is traded for an empty one
+    struct objcache* const cache = thread->cache;
+    struct objcache_depot* const depot = &cache->depot;
+    if (!depot->max_rounds) {
+        objcache_free(cache, object);
+        return;
+    }
+
+    depot_lock(depot);
+    struct objcache_magazine* empty = depot_take(&depot->empty, &depot->stats.empty, &depot->empty_low);
+    struct objcache_magazine* stale = NULL;
+    if (empty && empty->capacity < depot->stats.rounds) {
+        // made before the magazines grew
+        stale = empty;
+        empty = NULL;
+    }
+    if (empty) {
+        ++depot->stats.empty_taken;
+        depot_give_full(depot, thread);
+    }
+    const size_t rounds = depot->stats.rounds;
+    pthread_mutex_unlock(&depot->lock);
+
+    if (stale) magazine_destroy(cache, stale);
+    if (!empty) {
+        empty = magazine_create(cache, rounds);
+        if (!empty) {
+            objcache_free(cache, object);
+            return;
+        }
+        depot_lock(depot);
+        depot_give_full(depot, thread);
+        pthread_mutex_unlock(&depot->lock);
+    }
+    thread->previous = loaded;
+    thread->loaded = empty;
+    empty->objects[empty->rounds++] = object;
+}
+
+/**
+ * Gives the thread's magazines back to the depot: full ones as they are, objects of partial ones
+ * go to the cache. Done before the thread exits
+ * @param thread the thread's magazines
+ */
+void objcache_thread_flush( struct objcache_thread* thread ) {
+    struct objcache* const cache = thread->cache;
+    struct objcache_depot* const depot = &cache->depot;
+    struct objcache_magazine* const magazines[] = { thread->loaded, thread->previous };
+    for (size_t i = 0; i < 2; ++i) {
+        struct objcache_magazine* const magazine = magazines[i];
+        if (!magazine) continue;
+
+        const bool full = magazine->rounds == magazine->capacity;
+        if (!full && magazine->rounds) {
+            pthread_mutex_lock(&cache->lock);
+            while (magazine->rounds) objcache_push(cache, magazine->objects[--magazine->rounds]);
+            pthread_mutex_unlock(&cache->lock);
+        }
+        depot_lock(depot);
+        if (full) {
+            depot_give(&depot->full, &depot->stats.full, magazine);
+            ++depot->stats.full_returned;
+        } else {
+            depot_give(&depot->empty, &depot->stats.empty, magazine);
+            ++depot->stats.empty_returned;
+        }
+        pthread_mutex_unlock(&depot->lock);
+    }
+    thread->loaded = thread->previous = NULL;
+}
+
+/*  --- Выделение и освобождение --- */
+
+/**
+ * Allocates block in the heap and returns pointer
+ * @param heap heap we allocate in
+ * @param query amount of bytes you want to allocate
+ * @return pointer to the mapped memory or null if fail
+ */
+void* heap_malloc( struct heap* heap, size_t query ) {
+  if (slab_wants( heap, query )) return slab_malloc( heap, query, true );
+  if (large_wants( heap, query )) return large_malloc( heap, query, true );
+
+  query = fastbin_query( heap, padded_query( heap, query ) );
+  struct block_header* const cached = fastbin_pop( heap, query );
+  if (cached) return cached->contents;
+
+  struct block_header* const addr = block_alloc_padded( heap, query, true );
+  if (addr) return addr->contents;
+  else return NULL;
+}
+
+/**
+ * Allocates block only from free blocks of the existing heap, never grows it (no syscalls)
+ * @param heap heap we allocate in
+ * @param query amount of bytes you want to allocate
+ * @return pointer to the allocated memory or null if no free block is big enough
+ */
+void* heap_malloc_try( struct heap* heap, size_t query ) {
+    if (slab_wants(heap, query)) return slab_malloc(heap, query, false);
+    if (large_wants(heap, query)) return large_malloc(heap, query, false);
+
+    query = fastbin_query(heap, padded_query(heap, query));
+    struct block_header* const cached = fastbin_pop(heap, query);
+    if (cached) return cached->contents;
+
+    struct block_header* const block = block_alloc_padded(heap, query, false);
+    return block ? block->contents : NULL;
+}
+
+/**
+ * Allocates block in the sub-heap of the expected lifetime, so that short-lived objects don't pin
+ * regions of long-lived ones and empty regions can be trimmed
+ * @param heap heap we allocate in
+ * @param query amount of bytes you want to allocate
+ * @param hint expected lifetime, anything but HINT_SHORT_LIVED or HINT_LONG_LIVED allocates in the heap itself
+ * @return pointer to the allocated memory or null if fail
+ */
+void* heap_malloc_hint( struct heap* heap, size_t query, enum heap_hint hint ) {
+    struct heap* const sub = hint == HINT_SHORT_LIVED || hint == HINT_LONG_LIVED ? lifetime_heap(heap, hint) : NULL;
+    return heap_malloc(sub ? sub : heap, query);
+}
+
+/**
+ * Allocates block in the sub-heap the site's objects are predicted to belong to by their observed lifetimes
+ * @param heap heap we allocate in
+ * @param query amount of bytes you want to allocate
+ * @param site caller's id of the allocation site
+ * @return pointer to the allocated memory or null if fail
+ */
+void* heap_malloc_site( struct heap* heap, size_t query, uint32_t site ) {
+    if (!heap->options.short_lifetime) return heap_malloc(heap, query);
+    if (!heap->lifetime && !(heap->lifetime = lifetime_table_map())) return heap_malloc(heap, query);
+
+    struct lifetime_table* const table = heap->lifetime;
+    ++table->clock;
+    void* const mem = heap_malloc_hint(heap, query, lifetime_predict(heap, lifetime_site(table, site)));
+    if (mem) lifetime_sample(heap, mem, site);
+    return mem;
+}
+
+/**
+ * Allocates block as close to the neighbour as its region allows (the same page if there is room),
+ * so that objects used together share cache lines and pages. Falls back to heap_malloc (always in a padded heap)
+ * @param heap heap we allocate in
+ * @param query amount of bytes you want to allocate
+ * @param neighbour object the new one is used with, may be NULL
+ * @return pointer to the allocated memory or null if fail
+ */
+void* heap_malloc_near( struct heap* heap, size_t query, void const* neighbour ) {
+    struct heap* const sub = neighbour ? lifetime_owner(heap, neighbour) : NULL;
+    if (sub) return heap_malloc_near(sub, query, neighbour);
+    if (!neighbour || heap->options.cacheline_pad || slab_wants(heap, query) || large_wants(heap, query)) return heap_malloc(heap, query);
+
+    // the region's bound says in O(log n) if a walk may find anything
+    query = size_max(fastbin_query(heap, query), BLOCK_MIN_CAPACITY);
+    struct region_desc* const region = region_find(heap, neighbour);
+    struct block_header* const block = region && region->max_free >= query ? region_fit_near(heap, region, neighbour, query) : NULL;
+    if (!block) return heap_malloc(heap, query);
+
+    if (heap_indexed(heap)) return indexed_take(heap, block, query)->contents;
+    block_take(block, query);
+    heap_took(heap, block);
+    return block->contents;
+}
+
+/**
+ * Reserves a contiguous run for a group of objects used together
+ * @param heap heap we allocate in
+ * @param group group to initialize
+ * @param bytes capacity of the run, headers of the objects take some of it
+ * @return false if the run couldn't be taken (the group allocates near its objects then)
+ */
+bool heap_group_init( struct heap* heap, struct heap_group* group, size_t bytes ) {
+    struct block_header* const run = block_alloc_padded(heap, padded_query(heap, size_max(bytes, BLOCK_MIN_CAPACITY)), true);
+    *group = (struct heap_group) { .heap = heap, .rest = run ? run->contents : NULL, .last = NULL };
+    return run != NULL;
+}
+
+/**
+ * Allocates the next object of the group right after the previous one. Once the run is used up
+ * the objects are allocated near the last one
+ * @param group group
+ * @param query amount of bytes you want to allocate
+ * @return pointer to the allocated memory (an ordinary block, freed by heap_free) or null if fail
+ */
+void* heap_group_malloc( struct heap_group* group, size_t query ) {
+    struct heap* const heap = group->heap;
+    query = size_max(fastbin_query(heap, padded_query(heap, query)), BLOCK_MIN_CAPACITY);
+
+    // a padded object also takes the line of the next header, so the next contents start a line
+    const size_t header = offsetof(struct block_header, contents);
+    const size_t taken = heap->options.cacheline_pad ? query + CACHE_LINE - header : query;
+
+    struct block_header* const rest = group->rest ? block_get_header(group->rest) : NULL;
+    if (!rest || rest->capacity.bytes < query) {
+        void* const mem = heap_malloc_near(heap, query, group->last);
+        if (mem) group->last = mem;
+        return mem;
+    }
+
+    // the rest after the object stays taken, nothing merges into it or allocates from it
+    group->rest = NULL;
+    if (rest->capacity.bytes >= taken + header + BLOCK_MIN_CAPACITY) {
+        struct block_header* const next = (struct block_header*) (rest->contents + taken);
+        *next = (struct block_header) { .next = rest->next, .capacity = { rest->capacity.bytes - taken - header }, .is_free = false };
+        rest->next = next;
+        rest->capacity.bytes = taken;
+        if (heap->tail == rest) heap->tail = next;
+        group->rest = next->contents;
+    }
+    group->last = rest->contents;
+    return rest->contents;
+}
+
+/**
+ * Returns the unused rest of the group's run to the heap, its objects stay
+ * @param group group
+ */
+void heap_group_release( struct heap_group* group ) {
+    heap_free(group->heap, group->rest);
+    group->rest = NULL;
+}
+
+/**
+ * Grows the heap in advance, so that a free block of the given capacity exists
+ * @param heap heap to grow
+ * @param bytes capacity of the block which should be available for heap_malloc_try
+ * @return true if such block exists (or was just mapped)
+ */
+bool heap_reserve( struct heap* heap, size_t bytes ) {
+    fastbins_consolidate(heap);
+    if (heap_indexed(heap)) return indexed_fit(heap, bytes) || indexed_grow(heap, bytes);
+
+    const struct block_search_result search_result = find_good_or_last_in(heap, heap->start, bytes);
+    if (search_result.type == BSR_FOUND_GOOD_BLOCK) return true;
+    if (search_result.type != BSR_REACHED_END_NOT_FOUND) return false;
+
+    // merged with a free last block or a standalone new one, both are big enough
+    return grow_heap(heap, search_result.block, bytes) != NULL;
+}
+
+/**
+ * Deallocate mapped memory from the heap
+ * @param heap heap the memory belongs to
+ * @param mem pointer to the mapped area
+ */
+void heap_free( struct heap* heap, void* mem ) {
+  if (!mem) return ;
+  if (heap->lifetime) lifetime_observe( heap, mem );
+  struct heap* const sub = lifetime_owner( heap, mem );
+  if (sub) {
+    heap_free( sub, mem );
+    return;
+  }
+  struct slab* const slab = slab_find( heap, mem );
+  if (slab) {
+    slab_free( heap, slab, mem );
+    return;
+  }
+  struct large_chunk* const chunk = large_find( heap, mem );
+  if (chunk) {
+    large_free( heap, chunk, mem );
+    return;
+  }
+
+  struct block_header* header = block_get_header( mem );
+  if (header->is_free) return;
+  if (fastbin_push( heap, header )) return;
+  heap_release( heap, header );
+}
+
+/**
+ * Tells how many bytes of the allocation may be used
+ * @param heap heap the memory belongs to
+ * @param mem pointer returned by the heap
+ * @return usable bytes, at least the query
+ */
+size_t heap_usable_size( struct heap* heap, void* mem ) {
+  if (!mem) return 0;
+  struct heap* const sub = lifetime_owner( heap, mem );
+  if (sub) return heap_usable_size( sub, mem );
+  struct slab const* const slab = slab_find( heap, mem );
+  if (slab) return slab->object_size;
+  struct large_chunk const* const chunk = large_find( heap, mem );
+  if (chunk) return (size_t) chunk->runs[((uint8_t*) mem - (uint8_t const*) chunk) / LARGE_PAGE_SIZE].pages * LARGE_PAGE_SIZE;
+  return block_get_header( mem )->capacity.bytes;
+}
+
+/**
+ * Tells if the address lies in memory mapped by the heap
+ * @param heap heap
+ * @param mem any address
+ * @return true if the heap owns the address
+ */
+bool heap_owns( struct heap* heap, void const* mem ) {
+  if (lifetime_owner( heap, mem )) return true;
+  if (heap_has_pagemap( heap )) return pagemap_get( &heap->pagemap, mem ) != 0;
+  struct region_desc const* const region = region_find( heap, mem );
+  return region && region_contains( region, mem );
+}
+
+/**
+ * Destroys the heap's object caches and unmaps every region of the heap (standalone heap handle becomes invalid)
+ * @param heap heap to destroy
+ */
+void heap_destroy( struct heap* heap ) {
+    // cached objects may hold things outside the heap, their destructors run
+    while (heap->objcaches) objcache_destroy(heap->objcaches);
+    for (size_t i = 0; i < LIFETIME_CLASSES; ++i) {
+        if (heap->lifetimes[i]) heap_destroy(heap->lifetimes[i]);
+        heap->lifetimes[i] = NULL;
+    }
+    lifetime_table_reset(heap);
+    large_destroy(heap);
+
+    struct page_provider* const provider = heap_provider(heap);
+    struct region_desc* const descs = region_descs(&heap->regions);
+
+    // top down, so a buffer gets back all of its stack; the region with the handle holds the table, it goes last
+    struct region_desc handle_region = {0};
+    for (size_t i = heap->regions.count; i-- > 0; ) {
+        if (descs[i].addr == (uint8_t*) heap) handle_region = descs[i];
+        else provider->unmap(provider, descs[i].addr, descs[i].size);
+    }
+
+    region_table_reset(&heap->regions);
+    heap->rover = NULL;
+    memset(heap->fastbins, 0, sizeof(heap->fastbins));
+    memset(heap->slabs, 0, sizeof(heap->slabs));
+    memset(heap->slab_colors, 0, sizeof(heap->slab_colors));
+    heap->slab_count = 0;
+    pagemap_reset(&heap->pagemap);
+    if (handle_region.addr) provider->unmap(provider, handle_region.addr, handle_region.size);
+}
+
+/**
+ * Reports statistics of the heap's regions in address order, then those of its lifetime sub-heaps
+ * @param heap heap
+ * @param stats where to put statistics (may be NULL if max is 0)
+ * @param max capacity of stats
+ * @return number of regions (may be more than max)
+ */
+size_t heap_regions( struct heap* heap, struct heap_region_stats* stats, size_t max ) {
+    struct region_desc const* const descs = region_descs(&heap->regions);
+    for (size_t i = 0; i < heap->regions.count && i < max; ++i) {
+        stats[i] = (struct heap_region_stats) { .addr = descs[i].addr, .size = descs[i].size, .live = descs[i].live, .free = descs[i].free };
+    }
+
+    size_t count = heap->regions.count;
+    for (size_t i = 0; i < LIFETIME_CLASSES; ++i) {
+        if (heap->lifetimes[i]) count += heap_regions(heap->lifetimes[i], count < max ? stats + count : NULL, count < max ? max - count : 0);
+    }
+    return count;
+}
+
+
+/*  --- Возврат памяти системе --- */
+
+/**
+ * Finds the last block of the region's run of the chain
+ * @param heap heap
+ * @param region region
+ * @return block whose next is in another region or NULL
+ */
+static struct block_header* region_last_block( struct heap* heap, struct region_desc* region ) {
+    struct block_header* block = region_contains(region, heap->start) ? heap->start : (struct block_header*) region->addr;
+    while (block->next && region_contains(region, block->next)) block = block->next;
+    return block;
+}
+
+/**
+ * Unmaps the region without live blocks, the chain goes around it
+ * @param heap heap with consolidated fastbins
+ * @param before region the chain enters the released one from
+ * @param last its last block
+ * @param region region to release, not the one of the first block
+ */
+static void region_release( struct heap* heap, struct region_desc* before, struct block_header* last, struct region_desc* region ) {
+    struct block_header* const after = region->chain_next;
+
+    // its blocks are free, they leave the tree and the rover
+    for (struct block_header* block = (struct block_header*) region->addr; block && region_contains(region, block); block = block->next) {
+        if (heap_indexed(heap)) tree_remove(heap, block);
+        if (heap->rover == block) heap->rover = NULL;
+        if (heap->tail == block) heap->tail = last;
+    }
+    last->next = after;
+    before->chain_next = after;
+
+    // a region the provider doesn't take back is forgotten anyway, like holes of a buffer
+    uint8_t* const addr = region->addr;
+    const size_t size = region->size;
+    if (heap_has_pagemap(heap)) pagemap_set(&heap->pagemap, addr, size, 0);
+    struct region_table* const table = &heap->regions;
+    const size_t i = region - region_descs(table);
+    memmove(region_descs(table) + i, region_descs(table) + i + 1, (table->count - i - 1) * sizeof(struct region_desc));
+    --table->count;
+    heap_provider(heap)->unmap(heap_provider(heap), addr, size);
+}
+
+/**
+ * Unmaps every region without live blocks, except the one of the first block
+ * @param heap heap with consolidated fastbins
+ */
+static void regions_release_empty( struct heap* heap ) {
+    struct region_desc* before = region_find(heap, heap->start);
+    while (before && before->chain_next) {
+        struct region_desc* const region = region_find(heap, before->chain_next);
+        if (!region) return;
+        if (region->live) {
+            before = region;
+            continue;
+        }
+
+        // descriptors move when one is removed, the chain is followed from the block before
+        struct block_header* const last = region_last_block(heap, before);
+        region_release(heap, before, last, region);
+        before = region_find(heap, last);
+    }
+}
+
+/**
+ * Reaps the heap's object caches, then returns regions without live blocks and the free tail
+ * of the heap to the OS (at heap granularity, so huge pages are never split)
+ * @param heap heap to trim
+ */
+void heap_trim( struct heap* heap ) {
+    objcaches_reap(heap);
+    if (heap->options.pinned) return;
+    for (size_t i = 0; i < LIFETIME_CLASSES; ++i) {
+        if (heap->lifetimes[i]) heap_trim(heap->lifetimes[i]);
+    }
+    fastbins_consolidate(heap);
+    large_trim(heap);
+
+    // not even a page is free, so the chain isn't worth walking
+    size_t free = 0;
+    for (size_t i = 0; i < heap->regions.count; ++i) free += region_descs(&heap->regions)[i].free;
+    if (free < (size_t) getpagesize()) return;
+    regions_release_empty(heap);
+
+    // indexed heap knows its tail, others walk to it merging free blocks on the way (only the tail region is really walked)
+    struct block_header* last = heap->tail;
+    if (!heap_indexed(heap)) {
+        const struct block_search_result search_result = find_good_or_last_in(heap, heap->start, SIZE_MAX);
+        if (search_result.type != BSR_REACHED_END_NOT_FOUND) return;
+        last = search_result.block;
+    }
+    if (!last->is_free) return;
+
+    // the last block keeps its header and minimal capacity
+    uint8_t* const keep_end = (uint8_t*) round_up((uintptr_t) (last->contents + BLOCK_MIN_CAPACITY), heap_granularity(heap));
+    uint8_t* const end = block_after(last);
+    if (keep_end >= end) return;
+
+    struct page_provider* const provider = heap_provider(heap);
+    if (provider->unmap(provider, keep_end, end - keep_end) != 0) return;
+    if (heap_has_pagemap(heap)) pagemap_set(&heap->pagemap, keep_end, end - keep_end, 0);
+    if (heap_indexed(heap)) tree_remove(heap, last);
+    last->capacity.bytes = keep_end - last->contents;
+    if (heap_indexed(heap)) tree_insert(heap, last);
+
+    struct region_desc* const region = region_find(heap, last);
+    if (region) {
+        region->size -= end - keep_end;
+        region->free -= end - keep_end;
+    }
+}
+
+/**
+ * Drops physical pages under free blocks (at heap granularity, so huge pages are never split)
+ * @param heap heap to purge
+ */
+void heap_purge( struct heap* heap ) {
+    if (heap->options.pinned) return;
+    for (size_t i = 0; i < LIFETIME_CLASSES; ++i) {
+        if (heap->lifetimes[i]) heap_purge(heap->lifetimes[i]);
+    }
+    fastbins_consolidate(heap);
+    large_purge(heap, true);
+
+    // best fit keeps some free neighbours apart, merging them in place would break its tree
+    if (heap->options.fit == HEAP_FIT_BEST) tree_consolidate(heap);
+
+    struct page_provider* const provider = heap_provider(heap);
+    const size_t granularity = heap_granularity(heap);
+    for (struct block_header* block = heap->start; block; block = block->next) {
+        if (!block->is_free) continue;
+        while (heap_merge_with_next(heap, block));
+        region_note_free(heap, block);
+
+        // headers and the index node at the start of contents stay untouched,
+        // only whole granules after them are purged
+        uint8_t* const from = (uint8_t*) round_up((uintptr_t) block->contents + sizeof(struct free_node), granularity);
+        uint8_t* const to = (uint8_t*) round_down((uintptr_t) block_after(block), granularity);
+        if (from < to) provider->advise(provider, from, to - from, MADV_DONTNEED);
+    }
+}
+
+/**
+ * Reports capacity left in the pinned heap (it never grows, so this is all it can ever serve)
+ * @param heap heap
+ * @return total capacity of free blocks in bytes
+ */
+size_t heap_pinned_left( struct heap* heap ) {
+    fastbins_consolidate(heap);
+    if (heap->options.fit == HEAP_FIT_BEST) tree_consolidate(heap);
+
+    size_t left = 0;
+    for (struct block_header* block = heap->start; block; block = block->next) {
+        if (!block->is_free) continue;
+        while (heap_merge_with_next(heap, block));
+        region_note_free(heap, block);
+        left += block->capacity.bytes;
+    }
+    return left;
+}
+
+
+/*  --- Куча по умолчанию --- */
+
+void*  _malloc( size_t query )          { return heap_malloc( &default_heap, query ); }
+void   _free( void* mem )               { heap_free( &default_heap, mem ); }
+void*  _malloc_try( size_t query )      { return heap_malloc_try( &default_heap, query ); }
+void*  _malloc_hint( size_t query, enum heap_hint hint ) { return heap_malloc_hint( &default_heap, query, hint ); }
+void*  _malloc_site( size_t query, uint32_t site )       { return heap_malloc_site( &default_heap, query, site ); }
+void*  _malloc_near( size_t query, void const* neighbour ) { return heap_malloc_near( &default_heap, query, neighbour ); }
+bool   _heap_group_init( struct heap_group* group, size_t bytes ) { return heap_group_init( &default_heap, group, bytes ); }
+struct objcache* _objcache_create( size_t size, objcache_ctor ctor, objcache_dtor dtor ) { return heap_objcache_create( &default_heap, size, ctor, dtor ); }
+bool   _heap_reserve( size_t bytes )    { return heap_reserve( &default_heap, bytes ); }
+void   _heap_trim( void )               { heap_trim( &default_heap ); }
+void   _heap_purge( void )              { heap_purge( &default_heap ); }
+size_t _heap_pinned_left( void )        { return heap_pinned_left( &default_heap ); }
+size_t _heap_regions( struct heap_region_stats* stats, size_t max ) { return heap_regions( &default_heap, stats, max ); }
+void   _heap_destroy( void )            { heap_destroy( &default_heap ); }
+size_t _malloc_usable_size( void* mem ) { return heap_usable_size( &default_heap, mem ); }
+bool   _heap_owns( void const* mem )    { return heap_owns( &default_heap, mem ); }
@@ -8,11 +8,190 @@
 
 #include <sys/mman.h>
 
+#include "page_provider.h"
+
 #define HEAP_START ((void*)0x04040000)
 
+/**
+ * How the heap picks a free block
+ */
+enum heap_fit {
+  HEAP_FIT_FIRST = 0,     /* first fit, walks the block chain */
+  HEAP_FIT_FIRST_INDEXED, /* the same placement, free blocks are indexed by a tree, O(log n) */
+  HEAP_FIT_BEST,          /* the smallest free block that fits (equal ones by address), O(log n) */
+  HEAP_FIT_NEXT           /* first fit resuming where the previous search ended, wraps around the chain */
+};
+
+/**
+ * Expected lifetime of an allocation, hinted objects live in sub-heaps of their class
+ */
+enum heap_hint {
+  HINT_NONE = 0,         /* the heap itself */
+  HINT_SHORT_LIVED = 1,  /* freed soon, kept apart so that long-lived objects don't pin its regions */
+  HINT_LONG_LIVED = 2    /* lives long, packed densely away from the churn */
+};
+
+/**
+ * Tunables of the heap, zero-initialized options mean the classic behaviour
+ */
+struct heap_options {
+  /* where regions come from, NULL means page_provider_anonymous */
+  struct page_provider* provider;
+  /* regions of at least this size are 2 MiB-aligned and backed by huge pages, 0 disables huge pages */
+  size_t huge_threshold;
+  /* take huge regions from the configured hugetlbfs pool (MAP_HUGETLB) before falling back to THP */
+  bool   huge_tlb;
+  /* prefault every region (MAP_POPULATE) and never grow, so allocations take no faults and no syscalls */
+  bool   pinned;
+  /* mlock every region, so pinned pages are never swapped out */
+  bool   locked;
+  /* placement policy */
+  enum heap_fit fit;
+  /* the free last block of the chain (the top, the heap grows by merging into it) is carved only when nothing else fits;
+   * heap_trim gives back its tail and, as in any heap, regions without live blocks */
+  bool   wilderness;
+  /* contents of blocks start and end on 64-byte cache line boundaries, so no two allocations share a line
+   * (no false sharing between them), costs a line per block; slabs and tiny slabs are off */
+  bool   cacheline_pad;
+  /* queries of at most this many bytes (up to 160) are rounded up to 8-byte size classes, released blocks
+   * of these classes are cached per class and reused LIFO, 0 disables fastbins */
+  size_t fastbin_max;
+  /* queries of at most 64 bytes are served from page-sized slabs of 8-byte size classes, objects carry no headers,
+   * implies pagemap */
+  bool   slabs;
+  /* queries of at most 16 bytes are packed into 8- and 16-byte slots of 64 KiB slabs, implies pagemap */
+  bool   tiny;
+  /* successive slabs of a class shift their objects by 0, 1, ... this many - 1 cache lines (up to 16), so objects
+   * at the same slot of different slabs fall into different cache sets; lines beyond a slab's slack come out
+   * of its capacity, 0 or 1 disables colouring */
+  size_t slab_colors;
+  /* queries from this many bytes up to 4 MiB take runs of whole pages in 8 MiB chunks apart from the block chain,
+   * 0 disables the large space; implies pagemap */
+  size_t large_min;
+  /* frees in the large space a free run stays resident for before it's purged, 0 means 64 */
+  size_t large_purge_delay;
+  /* keep a radix tree from every page of the heap to its metadata, heap_owns and the slab lookup become O(1) */
+  bool   pagemap;
+  /* learned lifetimes: sites whose sampled objects live fewer than this many site allocations on average
+   * are short-lived, 16 times as many make them long-lived, 0 makes _malloc_site a plain allocation */
+  size_t short_lifetime;
+};
+
+/**
+ * Statistics of one region of the heap (continuous run of its mappings)
+ */
+struct heap_region_stats {
+  void*  addr;
+  size_t size;
+  size_t live;  /* bytes of taken blocks, headers included */
+  size_t free;  /* bytes of free blocks, headers included */
+};
+
+/**
+ * Contiguous run reserved for objects used together, they are ordinary blocks of the heap
+ */
+struct heap_group {
+  struct heap* heap;
+  void*        rest;  /* the reserved rest of the run, NULL once it's used up */
+  void*        last;  /* the last object, the ones which don't fit the run go near it */
+};
+
+/**
+ * Object cache hooks: the constructor brings fresh memory into the constructed state (false if it can't,
+ * the allocation fails then), the destructor undoes it once the cache gives the object back to the heap
+ */
+typedef bool (*objcache_ctor)( void* object );
+typedef void (*objcache_dtor)( void* object );
+
+/**
+ * Cache of constructed objects of one size, freed objects keep their state and come back as they are
+ */
+struct objcache;
+struct objcache_magazine;
+
+/**
+ * Magazines of one thread for an object cache, owned by the thread. It takes and frees objects
+ * without locks while its magazines allow, whole magazines are traded with the cache's depot
+ */
+struct objcache_thread {
+  struct objcache*          cache;
+  struct objcache_magazine* loaded;    /* objects are taken from and freed to it */
+  struct objcache_magazine* previous;  /* full or empty, swapped with the loaded one before the depot is asked */
+};
+
+/**
+ * Depot traffic of an object cache
+ */
+struct objcache_stats {
+  size_t rounds;         /* capacity of new magazines, 0 if magazines are off */
+  size_t full;           /* full magazines in the depot */
+  size_t empty;          /* empty magazines in the depot */
+  size_t full_taken;     /* full magazines handed to threads */
+  size_t full_returned;  /* full magazines threads gave back */
+  size_t empty_taken;
+  size_t empty_returned;
+  size_t contended;      /* depot lockings which had to wait */
+  size_t resizes;        /* times the magazines grew */
+  size_t cached;         /* objects cached outside magazines */
+};
+
+/* Default heap, it starts at HEAP_START */
 void* _malloc( size_t query );
 void  _free( void* mem );
+void* _malloc_try( size_t query );
+void* _malloc_hint( size_t query, enum heap_hint hint );
+void* _malloc_site( size_t query, uint32_t site );
+void* _malloc_near( size_t query, void const* neighbour );
+bool  _heap_group_init( struct heap_group* group, size_t bytes );
+struct objcache* _objcache_create( size_t size, objcache_ctor ctor, objcache_dtor dtor );
+bool  _heap_reserve( size_t bytes );
 void* heap_init( size_t initial_size );
+void* heap_init_with( size_t initial_size, struct heap_options const* options );
+
+void  _heap_trim( void );
+void  _heap_purge( void );
+size_t _heap_pinned_left( void );
+size_t _heap_regions( struct heap_region_stats* stats, size_t max );
+void  _heap_destroy( void );
+size_t _malloc_usable_size( void* mem );
+bool  _heap_owns( void const* mem );
+
+/* Standalone heaps, the handle lives at the beginning of the heap's first region */
+struct heap;
+
+struct heap* heap_create( size_t initial_size, struct heap_options const* options );
+void  heap_destroy( struct heap* heap );
+void* heap_malloc( struct heap* heap, size_t query );
+void  heap_free( struct heap* heap, void* mem );
+void* heap_malloc_try( struct heap* heap, size_t query );
+void* heap_malloc_hint( struct heap* heap, size_t query, enum heap_hint hint );
+void* heap_malloc_site( struct heap* heap, size_t query, uint32_t site );
+void* heap_malloc_near( struct heap* heap, size_t query, void const* neighbour );
+bool  heap_group_init( struct heap* heap, struct heap_group* group, size_t bytes );
+void* heap_group_malloc( struct heap_group* group, size_t query );
+void  heap_group_release( struct heap_group* group );
+struct objcache* heap_objcache_create( struct heap* heap, size_t size, objcache_ctor ctor, objcache_dtor dtor );
+bool  heap_reserve( struct heap* heap, size_t bytes );
+
+void  heap_trim( struct heap* heap );
+void  heap_purge( struct heap* heap );
+size_t heap_pinned_left( struct heap* heap );
+size_t heap_regions( struct heap* heap, struct heap_region_stats* stats, size_t max );
+size_t heap_usable_size( struct heap* heap, void* mem );
+bool  heap_owns( struct heap* heap, void const* mem );
+
+/* Object caches of either kind of heap. A cache may be used by several threads (each with its own
+ * objcache_thread) as long as nothing else uses its heap meanwhile */
+void* objcache_alloc( struct objcache* cache );
+void  objcache_free( struct objcache* cache, void* object );
+size_t objcache_reap( struct objcache* cache );
+void  objcache_destroy( struct objcache* cache );
+void  objcache_magazines( struct objcache* cache, size_t rounds, size_t max_rounds );
+void  objcache_stats( struct objcache* cache, struct objcache_stats* stats );
+void  objcache_thread_init( struct objcache* cache, struct objcache_thread* thread );
+void* objcache_thread_alloc( struct objcache_thread* thread );
+void  objcache_thread_free( struct objcache_thread* thread, void* object );
+void  objcache_thread_flush( struct objcache_thread* thread );
 
 #define DEBUG_FIRST_BYTES 4
 
@@ -2,10 +2,16 @@
 #define _MEM_INTERNALS_
 
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 
+#include "mem.h"
+
 #define REGION_MIN_SIZE (2 * 4096)
+#define HUGE_PAGE_SIZE  (2 * 1024 * 1024)
+#define BLOCK_MIN_CAPACITY 24
+#define CACHE_LINE 64
 
 struct region { void* addr; size_t size; bool extends; };
 static const struct region REGION_INVALID = {0};
@@ -22,6 +28,228 @@ struct block_header {
   uint8_t        contents[];
 };
 
+#define REGION_TABLE_INLINE 16
+
+#define FASTBIN_STEP         8
+#define FASTBIN_MAX_CAPACITY 160
+#define FASTBIN_COUNT        ((FASTBIN_MAX_CAPACITY - BLOCK_MIN_CAPACITY) / FASTBIN_STEP + 1)
+
+#define SLAB_SIZE           4096
+#define SLAB_STEP           8
+#define SLAB_MAX_OBJECT     64
+#define SLAB_CLASSES        (SLAB_MAX_OBJECT / SLAB_STEP)
+#define SLAB_OBJECTS_OFFSET 128
+#define SLAB_BITMAP_WORDS   ((SLAB_SIZE - SLAB_OBJECTS_OFFSET) / SLAB_STEP / 64 + 1)
+
+#define TINY_SLAB_SIZE      (64 * 1024)
+#define TINY_MAX_OBJECT     16
+#define TINY_OBJECTS_OFFSET 1088
+#define TINY_BITMAP_WORDS   ((TINY_SLAB_SIZE - TINY_OBJECTS_OFFSET) / SLAB_STEP / 64 + 1)
+#define SLAB_MAX_COLORS     16
+
+/**
+ * Descriptor of a continuous run of memory the heap has mapped
+ */
+struct region_desc {
+  uint8_t* addr;
+  size_t   size;
+  size_t   live;  /* bytes of taken blocks, headers included */
+  size_t   free;  /* bytes of free blocks, headers included */
+  size_t   max_free;  /* no run of free blocks of the region has more capacity (may be stale upwards) */
+  struct block_header* chain_next;  /* first block of the region following this one in the chain, NULL for the tail */
+  size_t   seq;   /* position of the region in the chain */
+};
+
+/**
+ * Region descriptors sorted by address, inline until they don't fit
+ */
+struct region_table {
+  size_t              count;
+  size_t              capacity;  /* of overflow, the inline array is used while it's NULL */
+  size_t              next_seq;
+  struct region_desc* overflow;
+  struct region_desc  inline_descs[REGION_TABLE_INLINE];
+};
+
+/**
+ * Page of objects of one size class, it's the contents of a taken block aligned to its size
+ * (SLAB_SIZE, or TINY_SLAB_SIZE for tiny objects). Objects follow this header at SLAB_OBJECTS_OFFSET
+ * (TINY_OBJECTS_OFFSET) plus the slab's colour and have no headers of their own
+ */
+struct slab {
+  struct slab* next;  /* slabs of the class with free slots */
+  struct slab* prev;
+  uint32_t     object_size;
+  uint32_t     used;
+  uint32_t     capacity;
+  uint32_t     size;   /* bytes of the slab, header included */
+  uint32_t     color;  /* bytes the objects are shifted by, a multiple of CACHE_LINE */
+  uint64_t     free_bits[];  /* set bit is a free slot, SLAB_BITMAP_WORDS or TINY_BITMAP_WORDS of them */
+};
+
+#define LARGE_PAGE_SIZE          4096
+#define LARGE_CHUNK_SIZE         (8 * 1024 * 1024)
+#define LARGE_CHUNK_PAGES        (LARGE_CHUNK_SIZE / LARGE_PAGE_SIZE)
+#define LARGE_MAX_OBJECT         (4 * 1024 * 1024)
+#define LARGE_DEFAULT_PURGE_DELAY 64
+
+/**
+ * Run of whole pages of a large chunk, the descriptor of its first page describes it.
+ * The descriptor of its last page repeats pages and is_free, so the run after it finds it
+ */
+struct large_run {
+  uint32_t          pages;
+  bool              is_free;
+  bool              dirty;     /* free and its pages may still be resident */
+  size_t            freed_at;  /* epoch of the large space when it was freed */
+  struct large_run* left;      /* tree of free runs by page count */
+  struct large_run* right;
+  struct large_run* older;     /* dirty runs in the order they were freed */
+  struct large_run* newer;
+};
+
+/**
+ * Mapping of LARGE_CHUNK_SIZE bytes carved into page runs, its header takes the first pages
+ */
+struct large_chunk {
+  struct large_chunk* next;
+  struct large_chunk* prev;
+  struct large_run    runs[LARGE_CHUNK_PAGES];  /* per page, only first and last pages of runs are meaningful */
+};
+
+#define LARGE_HEADER_PAGES ((sizeof(struct large_chunk) + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE)
+
+/**
+ * Space of large objects, they never get to the block chain
+ */
+struct large_space {
+  struct large_chunk* chunks;
+  struct large_run*   free_root;  /* free runs by page count, then by address */
+  struct large_run*   oldest;     /* dirty runs, purged from the oldest once they are old enough */
+  struct large_run*   newest;
+  size_t              epoch;      /* frees so far */
+};
+
+#define PAGEMAP_PAGE_SHIFT 12
+#define PAGEMAP_LEVEL_BITS 12
+#define PAGEMAP_FANOUT     (1 << PAGEMAP_LEVEL_BITS)
+#define PAGEMAP_BLOCKS     ((uintptr_t) 1)  /* the page belongs to the heap's block regions */
+#define PAGEMAP_LARGE      ((uintptr_t) 2)  /* tag of a large chunk, the rest is its address */
+
+/**
+ * Radix tree from page number (48-bit addresses, 3 levels of 12 bits) to what the page holds:
+ * 0 if it isn't the heap's, PAGEMAP_BLOCKS for blocks, the slab descriptor or the tagged large chunk
+ */
+struct pagemap {
+  uintptr_t*** root;  /* root[i][j][k] is the page (i, j, k), levels are mapped on demand */
+};
+
+#define LIFETIME_CLASSES       2
+#define LIFETIME_SITES         256
+#define LIFETIME_SAMPLES       1024
+#define LIFETIME_SAMPLE_PERIOD 16
+#define LIFETIME_MIN_SAMPLES   4
+#define LIFETIME_LONG_FACTOR   16
+
+/**
+ * Observed lifetimes of the objects of one allocation site
+ */
+struct lifetime_site {
+  uint32_t site;
+  uint32_t samples;  /* lifetimes observed so far */
+  uint64_t total;    /* their sum in ticks */
+  bool     used;     /* false if the slot is empty */
+};
+
+/**
+ * Object whose lifetime is being observed
+ */
+struct lifetime_sample {
+  void const* mem;    /* NULL if the slot is empty */
+  uint64_t    birth;  /* tick it was allocated at */
+  uint32_t    site;
+};
+
+/**
+ * Statistics of the learned lifetimes, a tick is an allocation through heap_malloc_site. Every
+ * LIFETIME_SAMPLE_PERIOD-th object is sampled, slots are direct-mapped by address, an object alive
+ * past the long-lived bound is recorded as long-lived by the next sweep
+ */
+struct lifetime_table {
+  uint64_t               clock;
+  struct lifetime_site   sites[LIFETIME_SITES];      /* open addressing by site */
+  struct lifetime_sample samples[LIFETIME_SAMPLES];
+};
+
+#define MAGAZINE_ROUNDS     16   /* default capacity of magazines */
+#define MAGAZINE_MAX_ROUNDS 256  /* default bound they grow up to */
+#define MAGAZINE_CONTENTION 16   /* contended depot lockings which double the capacity of new magazines */
+
+/**
+ * Stack of constructed objects a thread takes and frees without locks
+ */
+struct objcache_magazine {
+  struct objcache_magazine* next;  /* magazines of a depot list */
+  size_t                    capacity;
+  size_t                    rounds;  /* objects in it */
+  void*                     objects[];
+};
+
+/**
+ * Full and empty magazines shared by the threads of a cache, each is taken or given back
+ * in one locking. The fewest magazines of a list since the last reap weren't needed, the reap frees them
+ */
+struct objcache_depot {
+  pthread_mutex_t           lock;
+  struct objcache_magazine* full;
+  struct objcache_magazine* empty;
+  size_t                    full_low;
+  size_t                    empty_low;
+  size_t                    max_rounds;  /* 0 while magazines are off, set once */
+  size_t                    contention;  /* contended lockings since the magazines last grew */
+  struct objcache_stats     stats;       /* rounds is the capacity of new magazines, cached is unused */
+};
+
+/**
+ * Object cache, it lives in its heap. Cached objects are linked through a pointer after their
+ * contents, so the constructed state stays untouched. The fewest objects cached since the last
+ * reap weren't needed all that time, the next reap destroys that many
+ */
+struct objcache {
+  struct heap*     heap;
+  struct objcache* next;         /* the heap's caches */
+  objcache_ctor    ctor;         /* may be NULL */
+  objcache_dtor    dtor;         /* may be NULL */
+  size_t           link;         /* offset of the link in an object */
+  void*            cached;       /* constructed objects ready to be handed out */
+  size_t           cached_count;
+  size_t           low_water;    /* the fewest cached objects since the last reap */
+  pthread_mutex_t  lock;         /* of the cached list */
+  struct objcache_depot depot;
+};
+
+/**
+ * Heap state, the default heap is static, standalone heaps keep it in their first region
+ */
+struct heap {
+  struct block_header* start;
+  struct heap_options  options;
+  struct region_table  regions;
+  struct block_header* free_root;  /* tree of free blocks, indexed placement only */
+  struct block_header* tail;       /* last block of the chain, indexed placement only */
+  struct block_header* rover;      /* block the last next fit search ended at, NULL for the start */
+  struct block_header* fastbins[FASTBIN_COUNT];  /* released small blocks per size class, still taken in the chain */
+  struct slab*         slabs[SLAB_CLASSES];      /* slabs with free slots per size class */
+  uint32_t             slab_colors[SLAB_CLASSES];  /* colour the next slab of the class gets, counts up */
+  size_t               slab_count;
+  struct pagemap       pagemap;                  /* kept if options.pagemap, slabs, tiny or large_min is set */
+  struct large_space   large;
+  struct heap*         lifetimes[LIFETIME_CLASSES];  /* sub-heaps of short- and long-lived objects, made by the first hint */
+  struct lifetime_table* lifetime;                   /* mapped by the first site allocation if options.short_lifetime is set */
+  struct objcache*     objcaches;  /* object caches of the heap, heap_trim reaps them */
+  pthread_mutex_t      objcache_lock;  /* of the list of caches and of the heap calls the caches make */
+};
+
 inline block_size size_from_capacity( block_capacity cap ) { return (block_size) {cap.bytes + offsetof( struct block_header, contents ) }; }
 inline block_capacity capacity_from_size( block_size sz ) { return (block_capacity) {sz.bytes - offsetof( struct block_header, contents ) }; }
 
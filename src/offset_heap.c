@@ -0,0 +1,496 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mem_internals.h"
+#include "offset_heap.h"
+#include "util.h"
+
+#define OFFSET_HEAP_MAGIC   0x5041454854455346ULL /* "FSETHEAP" */
+#define OFFSET_HEAP_VERSION 2
+
+/**
+ * Beginning of the file, the first block follows it
+ */
+struct offset_heap_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t clean;     /* set by offset_heap_detach, cleared while the heap is attached */
+  uint64_t size;      /* bytes of the file the chain covers */
+  uint64_t first;     /* offset of the first block */
+  uint64_t root;      /* offset of the user's root object, 0 if none */
+  pthread_mutex_t lock; /* robust and process-shared, taken by shared heaps only */
+};
+
+struct offset_block_header {
+  uint64_t       next;  /* offset from the heap base, 0 for the last block */
+  block_capacity capacity;
+  bool           is_free;
+  uint8_t        contents[];
+};
+
+#define OFFSET_BLOCK_HEADER_SIZE offsetof( struct offset_block_header, contents )
+
+static size_t offset_heap_round_pages( size_t mem ) { return (mem + getpagesize() - 1) / getpagesize() * getpagesize(); }
+static size_t offset_heap_first_block( void ) { return (sizeof( struct offset_heap_header ) + 63) / 64 * 64; }
+
+static struct offset_heap_header* header_of( struct offset_heap const* heap ) {
+  return (struct offset_heap_header*) heap->base;
+}
+
+static struct offset_block_header* block_at( struct offset_heap const* heap, uint64_t offset ) {
+  return (struct offset_block_header*) (heap->base + offset);
+}
+
+static uint64_t offset_of( struct offset_heap const* heap, struct offset_block_header const* block ) {
+  return (uint8_t const*) block - heap->base;
+}
+
+static struct offset_block_header* block_of_contents( void* contents ) {
+  return (struct offset_block_header*) ((uint8_t*) contents - OFFSET_BLOCK_HEADER_SIZE);
+}
+
+static void offset_block_init( struct offset_heap const* heap, uint64_t offset, size_t size, uint64_t next ) {
+  *block_at( heap, offset ) = (struct offset_block_header) {
+    .next = next,
+    .capacity = { .bytes = size - OFFSET_BLOCK_HEADER_SIZE },
+    .is_free = true
+  };
+}
+
+/**
+ * Maps part of the file at the same offset of the reservation
+ * @param heap heap
+ * @param from first byte of the file to map (page aligned)
+ * @param to end of the mapped part of the file
+ * @return true if mapped
+ */
+static bool map_extent( struct offset_heap* heap, size_t from, size_t to ) {
+    if (to <= from) return true;
+    void* const mapped = mmap(heap->base + from, to - from, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, heap->fd, (off_t) from);
+    if (mapped == MAP_FAILED) return false;
+    heap->mapped = to;
+    return true;
+}
+
+/**
+ * Maps image of the heap kept in the file copy-on-write over the whole mapped part
+ * @param heap heap with reserved address space
+ * @param fd file with the image
+ * @param size bytes of the image
+ * @return true if mapped
+ */
+static bool map_private( struct offset_heap* heap, int fd, size_t size ) {
+    void* const mapped = mmap(heap->base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    if (mapped == MAP_FAILED) return false;
+    heap->mapped = size;
+    heap->cow = true;
+    return true;
+}
+
+/**
+ * Makes [from, to) of the reservation usable: extends the file or,
+ * for copy-on-write heaps, maps private anonymous memory
+ * @param heap heap
+ * @param from end of the chain (page aligned)
+ * @param to new end of the mapped part
+ * @return true if extended
+ */
+static bool extend( struct offset_heap* heap, size_t from, size_t to ) {
+    if (!heap->cow) return ftruncate(heap->fd, (off_t) to) == 0 && map_extent(heap, from, to);
+
+    void* const mapped = mmap(heap->base + from, to - from, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if (mapped == MAP_FAILED) return false;
+    heap->mapped = to;
+    return true;
+}
+
+/**
+ * Formats empty file as a heap with one free block
+ * @param heap heap with reserved address space
+ * @return true if formatted
+ */
+static bool format( struct offset_heap* heap ) {
+    if (REGION_MIN_SIZE > heap->reserved) return false;
+    if (ftruncate(heap->fd, REGION_MIN_SIZE) != 0) return false;
+    if (!map_extent(heap, 0, REGION_MIN_SIZE)) return false;
+
+    *header_of(heap) = (struct offset_heap_header) {
+        .magic = OFFSET_HEAP_MAGIC,
+        .version = OFFSET_HEAP_VERSION,
+        .clean = false,
+        .size = REGION_MIN_SIZE,
+        .first = offset_heap_first_block(),
+        .root = 0
+    };
+
+    // survives the death of its owner, so a crashed process doesn't lock everybody out
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    const int error = pthread_mutex_init(&header_of(heap)->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (error) return false;
+
+    offset_block_init(heap, offset_heap_first_block(), REGION_MIN_SIZE - offset_heap_first_block(), 0);
+    return true;
+}
+
+/**
+ * Maps the file (formats it if it's empty)
+ * @param heap process-local heap structure to fill
+ * @param fd file opened for reading and writing
+ * @param max_size address space to reserve, the heap can't grow beyond it
+ * @param shared whether other processes use the heap at the same time
+ * @return how the heap was left by the previous user or OFFSET_HEAP_FAILED
+ */
+static enum offset_heap_state attach( struct offset_heap* heap, int fd, size_t max_size, bool shared ) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return OFFSET_HEAP_FAILED;
+    const size_t file_size = (size_t) st.st_size;
+
+    // reserve address space once, so growing never moves the heap inside this process
+    const size_t reserved = offset_heap_round_pages(size_max(max_size, file_size));
+    void* const base = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) return OFFSET_HEAP_FAILED;
+    *heap = (struct offset_heap) { .base = base, .mapped = 0, .reserved = reserved, .fd = fd, .shared = shared };
+
+    if (file_size == 0) {
+        if (!format(heap)) goto failed;
+        return OFFSET_HEAP_CREATED;
+    }
+
+    if (file_size < offset_heap_first_block() || !map_extent(heap, 0, file_size)) goto failed;
+
+    const struct offset_heap_header* const header = header_of(heap);
+    if (header->magic != OFFSET_HEAP_MAGIC || header->version != OFFSET_HEAP_VERSION) goto failed;
+    if (header->size > file_size) goto failed;
+
+    if (shared) return OFFSET_HEAP_JOINED;
+    return header->clean ? OFFSET_HEAP_CLEAN : OFFSET_HEAP_UNCLEAN;
+
+failed:
+    munmap(base, reserved);
+    return OFFSET_HEAP_FAILED;
+}
+
+/**
+ * Attaches the heap kept in the file (formats the file if it's empty)
+ * @param heap process-local heap structure to fill
+ * @param fd file opened for reading and writing
+ * @param max_size address space to reserve, the heap can't grow beyond it
+ * @return how the heap was left by the previous user or OFFSET_HEAP_FAILED
+ */
+enum offset_heap_state offset_heap_attach( struct offset_heap* heap, int fd, size_t max_size ) {
+    const enum offset_heap_state state = attach(heap, fd, max_size, false);
+    if (state == OFFSET_HEAP_FAILED) return state;
+
+    // until detached the heap counts as crashed
+    header_of(heap)->clean = false;
+    msync(heap->base, getpagesize(), MS_SYNC);
+    return state;
+}
+
+/**
+ * Creates memfd-backed heap other processes can attach with offset_heap_attach_shared
+ * (the descriptor is inherited by fork or passed over a unix socket)
+ * @param heap process-local heap structure to fill
+ * @param name memfd name, only for debugging
+ * @param max_size address space to reserve, the heap can't grow beyond it
+ * @return OFFSET_HEAP_CREATED or OFFSET_HEAP_FAILED
+ */
+enum offset_heap_state offset_heap_create_shared( struct offset_heap* heap, char const* name, size_t max_size ) {
+    const int fd = memfd_create(name, 0);
+    if (fd < 0) return OFFSET_HEAP_FAILED;
+
+    const enum offset_heap_state state = attach(heap, fd, max_size, true);
+    if (state == OFFSET_HEAP_FAILED) close(fd);
+    return state;
+}
+
+/**
+ * Attaches heap which is used by other processes at the same time
+ * @param heap process-local heap structure to fill
+ * @param fd descriptor of the heap's file (memfd)
+ * @param max_size address space to reserve, the heap can't grow beyond it
+ * @return OFFSET_HEAP_JOINED (OFFSET_HEAP_CREATED for an empty file) or OFFSET_HEAP_FAILED
+ */
+enum offset_heap_state offset_heap_attach_shared( struct offset_heap* heap, int fd, size_t max_size ) {
+    return attach(heap, fd, max_size, true);
+}
+
+/**
+ * Maps the part of the file other processes have grown the heap by
+ * @param heap heap
+ * @return true if the whole heap is mapped, false if it outgrew the reserved space or mmap failed
+ */
+bool offset_heap_refresh( struct offset_heap* heap ) {
+    const size_t size = header_of(heap)->size;
+    if (size <= heap->mapped) return true;
+    return size <= heap->reserved && map_extent(heap, heap->mapped, size);
+}
+
+/**
+ * Takes the lock of a shared heap, so several operations can be done atomically.
+ * If the previous owner died holding it, the chain is validated before going on
+ * @param heap heap
+ * @return true if locked, false if the heap is unusable or grew past what this process can map
+ */
+bool offset_heap_lock( struct offset_heap* heap ) {
+    if (!heap->shared) return true;
+
+    const int error = pthread_mutex_lock(&header_of(heap)->lock);
+    if (error && error != EOWNERDEAD) return false;
+    if (!offset_heap_refresh(heap)) {
+        // blocks beyond the mapping are out of reach; a dead owner's chain stays unchecked,
+        // so the lock is left unrecoverable rather than marked consistent
+        pthread_mutex_unlock(&header_of(heap)->lock);
+        return false;
+    }
+
+    if (error == EOWNERDEAD) {
+        // owner died in the middle of something, broken chain makes the lock unrecoverable
+        if (!offset_heap_check(heap)) {
+            pthread_mutex_unlock(&header_of(heap)->lock);
+            return false;
+        }
+        pthread_mutex_consistent(&header_of(heap)->lock);
+    }
+    return true;
+}
+
+void offset_heap_unlock( struct offset_heap* heap ) {
+    if (heap->shared) pthread_mutex_unlock(&header_of(heap)->lock);
+}
+
+/**
+ * Writes the whole mapped part of the heap into a new memfd (for heaps whose state isn't in a file)
+ * @param heap heap
+ * @return descriptor of the copy or -1
+ */
+static int copy_image( struct offset_heap const* heap ) {
+    const int fd = memfd_create("offset_heap_snapshot", MFD_CLOEXEC);
+    if (fd < 0) return -1;
+
+    for (size_t written = 0; written < heap->mapped; ) {
+        const ssize_t chunk = pwrite(fd, heap->base + written, heap->mapped - written, (off_t) written);
+        if (chunk <= 0) {
+            close(fd);
+            return -1;
+        }
+        written += (size_t) chunk;
+    }
+    return fd;
+}
+
+/**
+ * Creates copy-on-write clone of the heap without copying it: the clone maps the heap's file
+ * MAP_PRIVATE and gets its own copy of a page only when it writes there. Pages the clone hasn't
+ * written yet are the file's, so later writes of the heap show through them: the heap should
+ * stay unchanged while the clone lives, or the clone should only rely on the pages it wrote.
+ * The heap keeps its shared mapping, goes on writing its file and detaches cleanly.
+ * A copy-on-write heap (a clone itself) has no file with its state, so its mapped part
+ * is copied into a memfd first, that costs a copy of the whole heap
+ * @param heap heap to clone, not shared
+ * @param clone process-local heap structure to fill
+ * @return true if cloned, the heap is left as it was either way
+ */
+bool offset_heap_snapshot( struct offset_heap const* heap, struct offset_heap* clone ) {
+    if (heap->shared) return false;
+
+    const int image = heap->cow ? copy_image(heap) : heap->fd;
+    if (image < 0) return false;
+
+    bool cloned = false;
+    void* const base = mmap(NULL, heap->reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base != MAP_FAILED) {
+        *clone = (struct offset_heap) { .base = base, .mapped = 0, .reserved = heap->reserved, .fd = -1 };
+        cloned = map_private(clone, image, heap->mapped);
+        if (!cloned) munmap(base, heap->reserved);
+    }
+
+    // the clone's mapping keeps the copy alive
+    if (image != heap->fd) close(image);
+    return cloned;
+}
+
+/**
+ * Flushes the heap, marks it cleanly shut down and unmaps it
+ * (shared heap is just unmapped, other processes may still use it,
+ * copy-on-write heap is just unmapped, its changes are thrown away)
+ * @param heap heap to detach
+ */
+void offset_heap_detach( struct offset_heap* heap ) {
+    if (!heap->shared && !heap->cow) {
+        // the marker must not reach the disk before the data it vouches for
+        msync(heap->base, heap->mapped, MS_SYNC);
+        header_of(heap)->clean = true;
+        msync(heap->base, getpagesize(), MS_SYNC);
+    }
+
+    munmap(heap->base, heap->reserved);
+    heap->base = NULL;
+    heap->mapped = 0;
+}
+
+/**
+ * Validates the block chain: every link stays inside the heap, points right after
+ * its block and the last block ends exactly at the end of the heap
+ * @param heap heap to check
+ * @return true if the chain is consistent
+ */
+bool offset_heap_check( struct offset_heap const* heap ) {
+    const struct offset_heap_header* const header = header_of(heap);
+    if (header->magic != OFFSET_HEAP_MAGIC || header->version != OFFSET_HEAP_VERSION) return false;
+    if (header->size > heap->mapped || header->first < sizeof(*header) || header->first >= header->size) return false;
+    if (header->root && (header->root < header->first + OFFSET_BLOCK_HEADER_SIZE || header->root >= header->size)) return false;
+
+    // offsets strictly grow, so the walk always ends
+    uint64_t offset = header->first;
+    while (true) {
+        if (header->size - offset < OFFSET_BLOCK_HEADER_SIZE) return false;
+        const struct offset_block_header* const block = block_at(heap, offset);
+
+        // is_free is read as a byte, a torn write may leave anything there
+        const uint8_t is_free = *((uint8_t const*) block + offsetof(struct offset_block_header, is_free));
+        if (is_free > 1) return false;
+
+        const uint64_t capacity = block->capacity.bytes;
+        if (capacity < BLOCK_MIN_CAPACITY || capacity > header->size - offset - OFFSET_BLOCK_HEADER_SIZE) return false;
+
+        const uint64_t end = offset + OFFSET_BLOCK_HEADER_SIZE + capacity;
+        if (!block->next) return end == header->size;
+        if (block->next != end) return false;
+        offset = block->next;
+    }
+}
+
+static bool offset_try_merge_with_next( struct offset_heap const* heap, struct offset_block_header* block ) {
+    if (!block->next || !block->is_free) return false;
+    const struct offset_block_header* const next = block_at(heap, block->next);
+    if (!next->is_free) return false;
+
+    // the chain is continuous, no need to check neighbourhood
+    block->capacity.bytes += OFFSET_BLOCK_HEADER_SIZE + next->capacity.bytes;
+    block->next = next->next;
+    return true;
+}
+
+static void offset_split_if_too_big( struct offset_heap const* heap, struct offset_block_header* block, size_t query ) {
+    if (query + OFFSET_BLOCK_HEADER_SIZE + BLOCK_MIN_CAPACITY > block->capacity.bytes) return;
+
+    // the new block is written before anything links to it
+    const uint64_t new_block = offset_of(heap, block) + OFFSET_BLOCK_HEADER_SIZE + query;
+    offset_block_init(heap, new_block, block->capacity.bytes - query, block->next);
+    block->capacity.bytes = query;
+    block->next = new_block;
+}
+
+/**
+ * Extends the file and appends the new space to the chain
+ * @param heap heap to grow
+ * @param last last block of the chain
+ * @param query amount of bytes we want to allocate
+ * @return free block big enough for query or NULL
+ */
+static struct offset_block_header* offset_grow_heap( struct offset_heap* heap, struct offset_block_header* last, size_t query ) {
+    struct offset_heap_header* const header = header_of(heap);
+    const size_t old_size = header->size;
+    const size_t extra = size_max(offset_heap_round_pages(query + OFFSET_BLOCK_HEADER_SIZE), REGION_MIN_SIZE);
+    if (extra > heap->reserved - old_size) return NULL;
+
+    if (!extend(heap, old_size, old_size + extra)) return NULL;
+
+    // new space either extends the free last block or becomes a block of its own
+    offset_block_init(heap, old_size, extra, 0);
+    last->next = old_size;
+    header->size = old_size + extra;
+    if (offset_try_merge_with_next(heap, last)) return last;
+    return block_at(heap, old_size);
+}
+
+/**
+ * Allocates block in the heap (first fit, growing the file if needed)
+ * @param heap heap we allocate in
+ * @param query amount of bytes you want to allocate
+ * @return pointer to the allocated memory or NULL
+ */
+void* offset_heap_malloc( struct offset_heap* heap, size_t query ) {
+    query = size_max(query, BLOCK_MIN_CAPACITY);
+    if (!offset_heap_lock(heap)) return NULL;
+
+    struct offset_block_header* block = block_at(heap, header_of(heap)->first);
+    while (true) {
+        if (block->is_free) {
+            while (offset_try_merge_with_next(heap, block));
+            if (block->capacity.bytes >= query) break;
+        }
+        if (!block->next) {
+            block = offset_grow_heap(heap, block, query);
+            break;
+        }
+        block = block_at(heap, block->next);
+    }
+
+    if (block) {
+        offset_split_if_too_big(heap, block, query);
+        block->is_free = false;
+    }
+
+    offset_heap_unlock(heap);
+    return block ? block->contents : NULL;
+}
+
+/**
+ * Deallocates memory of the heap
+ * @param heap heap the memory belongs to
+ * @param mem pointer returned by offset_heap_malloc
+ */
+void offset_heap_free( struct offset_heap* heap, void* mem ) {
+    if (!mem || !offset_heap_lock(heap)) return;
+    struct offset_block_header* const block = block_of_contents(mem);
+    block->is_free = true;
+    while (offset_try_merge_with_next(heap, block));
+    offset_heap_unlock(heap);
+}
+
+/**
+ * Converts pointer into the heap to the offset, which stays valid in every attachment
+ * @param heap heap
+ * @param mem pointer into the heap or NULL
+ * @return offset from the heap base, 0 for NULL
+ */
+uint64_t offset_heap_offset( struct offset_heap const* heap, void const* mem ) {
+    return mem ? (uint64_t) ((uint8_t const*) mem - heap->base) : 0;
+}
+
+/**
+ * Converts offset back to the pointer of the current attachment
+ * @param heap heap
+ * @param offset offset from the heap base, 0 for NULL
+ * @return pointer or NULL
+ */
+void* offset_heap_pointer( struct offset_heap const* heap, uint64_t offset ) {
+    return offset ? heap->base + offset : NULL;
+}
+
+/**
+ * Remembers the object a restarted process starts walking its data from
+ * @param heap heap
+ * @param mem root object or NULL
+ */
+void offset_heap_set_root( struct offset_heap* heap, void* mem ) {
+    if (!offset_heap_lock(heap)) return;
+    header_of(heap)->root = offset_heap_offset(heap, mem);
+    offset_heap_unlock(heap);
+}
+
+void* offset_heap_root( struct offset_heap const* heap ) {
+    return offset_heap_pointer(heap, header_of(heap)->root);
+}
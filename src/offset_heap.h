@@ -0,0 +1,53 @@
+#ifndef _OFFSET_HEAP_H_
+#define _OFFSET_HEAP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Heap kept in a file mapped MAP_SHARED. Block links are offsets from the heap base,
+ * so the heap can be attached at any address and its chain is usable right away.
+ * The structure itself is process-local, everything it points to lives in the file
+ */
+struct offset_heap {
+  uint8_t* base;      /* where the file is mapped in this process */
+  size_t   mapped;    /* bytes of the file mapped at base */
+  size_t   reserved;  /* address space reserved at base, the heap never grows beyond it */
+  int      fd;
+  bool     shared;    /* attached by several processes at once, every operation takes the heap lock */
+  bool     cow;       /* mapped MAP_PRIVATE, changes never reach fd */
+};
+
+enum offset_heap_state {
+  OFFSET_HEAP_FAILED = 0,
+  OFFSET_HEAP_CREATED,    /* file was empty and has been formatted */
+  OFFSET_HEAP_CLEAN,      /* previous user detached cleanly */
+  OFFSET_HEAP_UNCLEAN,    /* previous user crashed, run offset_heap_check before trusting the chain */
+  OFFSET_HEAP_JOINED      /* shared heap is already used by other processes */
+};
+
+enum offset_heap_state offset_heap_attach( struct offset_heap* heap, int fd, size_t max_size );
+void     offset_heap_detach( struct offset_heap* heap );
+bool     offset_heap_check( struct offset_heap const* heap );
+
+/* Process-shared heaps, blocks are passed between processes as offsets */
+enum offset_heap_state offset_heap_create_shared( struct offset_heap* heap, char const* name, size_t max_size );
+enum offset_heap_state offset_heap_attach_shared( struct offset_heap* heap, int fd, size_t max_size );
+bool     offset_heap_lock( struct offset_heap* heap );
+void     offset_heap_unlock( struct offset_heap* heap );
+bool     offset_heap_refresh( struct offset_heap* heap );
+
+/* Copy-on-write clone over the heap's file, discarded with offset_heap_detach. Nothing is copied:
+ * pages the clone hasn't written yet show later writes of the heap. Cloning a clone copies it */
+bool     offset_heap_snapshot( struct offset_heap const* heap, struct offset_heap* clone );
+
+void*    offset_heap_malloc( struct offset_heap* heap, size_t query );
+void     offset_heap_free( struct offset_heap* heap, void* mem );
+
+uint64_t offset_heap_offset( struct offset_heap const* heap, void const* mem );
+void*    offset_heap_pointer( struct offset_heap const* heap, uint64_t offset );
+void     offset_heap_set_root( struct offset_heap* heap, void* mem );
+void*    offset_heap_root( struct offset_heap const* heap );
+
+#endif
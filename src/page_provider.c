@@ -0,0 +1,123 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "page_provider.h"
+
+/*  --- Буфер, предоставленный пользователем --- */
+
+static void* buffer_map_at( struct page_provider* self, void const* addr, size_t length, int flags ) {
+    struct buffer_provider* const bp = (struct buffer_provider*) self;
+    (void) flags;
+
+    // the buffer is used like a stack, so only its current top can be mapped
+    if (addr != bp->buffer + bp->used || length > bp->size - bp->used) return MAP_FAILED;
+    bp->used += length;
+    return (void*) addr;
+}
+
+static void* buffer_map( struct page_provider* self, void const* addr, size_t length, int flags ) {
+    struct buffer_provider* const bp = (struct buffer_provider*) self;
+    (void) addr;
+    return buffer_map_at(self, bp->buffer + bp->used, length, flags);
+}
+
+static int buffer_unmap( struct page_provider* self, void* addr, size_t length ) {
+    struct buffer_provider* const bp = (struct buffer_provider*) self;
+
+    // only the top of the stack really goes back, holes are forgotten
+    if ((uint8_t*) addr + length == bp->buffer + bp->used) bp->used = (uint8_t*) addr - bp->buffer;
+    return 0;
+}
+
+static int buffer_advise( struct page_provider* self, void* addr, size_t length, int advice ) {
+    // pages of the buffer belong to the caller, nothing to advise
+    (void) self; (void) addr; (void) length; (void) advice;
+    return 0;
+}
+
+/**
+ * Initializes provider which hands out pages of the caller-supplied buffer
+ * @param bp provider storage, must outlive the heap
+ * @param buffer memory to hand out
+ * @param size buffer size
+ * @return provider to put into heap_options
+ */
+struct page_provider* buffer_provider_init( struct buffer_provider* bp, void* buffer, size_t size ) {
+    *bp = (struct buffer_provider) {
+        .provider = { .map = buffer_map, .map_at = buffer_map_at, .unmap = buffer_unmap, .advise = buffer_advise },
+        .buffer = buffer,
+        .size = size,
+        .used = 0
+    };
+    return &bp->provider;
+}
+
+/*  --- Файловый дескриптор (файл, memfd, hugetlbfs) --- */
+
+/**
+ * Extends the file and maps its new tail
+ * @param fp provider
+ * @param addr address hint
+ * @param length amount of bytes to map (multiple of page size of the file)
+ * @param flags additional mmap flags
+ * @return mapped address or MAP_FAILED
+ */
+static void* fd_map_tail( struct fd_provider* fp, void const* addr, size_t length, int flags ) {
+    if (ftruncate(fp->fd, fp->size + (off_t) length) != 0) return MAP_FAILED;
+
+    // hugetlbfs files are huge by themselves, MAP_HUGETLB is only for anonymous memory
+    void* const mapped = mmap((void*) addr, length, PROT_READ | PROT_WRITE, MAP_SHARED | (flags & ~MAP_HUGETLB), fp->fd, fp->size);
+    if (mapped == MAP_FAILED) {
+        // the caller wants the mmap error; if the file can't shrink back, the next extension
+        // starts at fp->size all the same and covers the stale tail
+        const int error = errno;
+        while (ftruncate(fp->fd, fp->size) != 0 && errno == EINTR);
+        errno = error;
+        return MAP_FAILED;
+    }
+
+    fp->size += (off_t) length;
+    return mapped;
+}
+
+static void* fd_map( struct page_provider* self, void const* addr, size_t length, int flags ) {
+    return fd_map_tail((struct fd_provider*) self, addr, length, flags);
+}
+
+static void* fd_map_at( struct page_provider* self, void const* addr, size_t length, int flags ) {
+    return fd_map_tail((struct fd_provider*) self, addr, length, flags | MAP_FIXED_NOREPLACE);
+}
+
+static int fd_unmap( struct page_provider* self, void* addr, size_t length ) {
+    (void) self;
+    return munmap(addr, length);
+}
+
+static int fd_advise( struct page_provider* self, void* addr, size_t length, int advice ) {
+    (void) self;
+    // dropping shared pages keeps them in the file, punch a hole instead
+    if (advice == MADV_DONTNEED) advice = MADV_REMOVE;
+    return madvise(addr, length, advice);
+}
+
+/**
+ * Initializes provider which maps the file descriptor shared, growing the file on demand
+ * @param fp provider storage, must outlive the heap
+ * @param fd opened for reading and writing file descriptor
+ * @return provider to put into heap_options or NULL if fd is unusable
+ */
+struct page_provider* fd_provider_init( struct fd_provider* fp, int fd ) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return NULL;
+
+    *fp = (struct fd_provider) {
+        .provider = { .map = fd_map, .map_at = fd_map_at, .unmap = fd_unmap, .advise = fd_advise },
+        .fd = fd,
+        .size = st.st_size
+    };
+    return &fp->provider;
+}
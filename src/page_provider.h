@@ -0,0 +1,49 @@
+#ifndef _PAGE_PROVIDER_H_
+#define _PAGE_PROVIDER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+/**
+ * Source of memory for a heap. Every operation follows mmap/munmap/madvise conventions,
+ * so map and map_at return MAP_FAILED on failure, unmap and advise return 0 on success
+ */
+struct page_provider {
+  /* maps length bytes anywhere, addr is only a hint */
+  void* (*map)   ( struct page_provider* self, void const* addr, size_t length, int flags );
+  /* maps length bytes exactly at addr (never replacing existing mappings) */
+  void* (*map_at)( struct page_provider* self, void const* addr, size_t length, int flags );
+  int   (*unmap) ( struct page_provider* self, void* addr, size_t length );
+  int   (*advise)( struct page_provider* self, void* addr, size_t length, int advice );
+};
+
+/* Private anonymous mmap, the default provider */
+extern struct page_provider page_provider_anonymous;
+
+/**
+ * Caller-supplied buffer, pages are handed out from its start like from a stack
+ */
+struct buffer_provider {
+  struct page_provider provider;
+  uint8_t* buffer;
+  size_t   size;
+  size_t   used;
+};
+
+struct page_provider* buffer_provider_init( struct buffer_provider* bp, void* buffer, size_t size );
+
+/**
+ * Shared mapping of a file descriptor (regular file, memfd or file on hugetlbfs),
+ * every mapping is appended to the end of the file
+ */
+struct fd_provider {
+  struct page_provider provider;
+  int   fd;
+  off_t size;
+};
+
+struct page_provider* fd_provider_init( struct fd_provider* fp, int fd );
+
+#endif
@@ -25,12 +25,10 @@ static void* create_heap(size_t initial_size) {
 }
 
 /**
- * Deallocate heap
- * @param heap heap to destroy
- * @param heap_size heap size
+ * Deallocate heap (every region it has mapped)
  */
-static void destroy_heap(void* heap, size_t heap_size) {
-    munmap(heap, size_from_capacity((block_capacity) {.bytes = heap_size}).bytes);
+static void destroy_heap() {
+    _heap_destroy();
 }
 
 
@@ -46,14 +44,14 @@ static bool test_usual_success_alloc() {
     void* first_alloc = _malloc(heap_size / 2);
     debug("Alloc", heap);
     if (!first_alloc) {
-        destroy_heap(heap, heap_size);
+        destroy_heap();
         return false;
     }
 
     _free(first_alloc);
     debug("Free", heap);
 
-    destroy_heap(heap, heap_size);
+    destroy_heap();
     return true;
 }
 
@@ -77,7 +75,7 @@ static bool test_single_block_free() {
 
     for (size_t i = 0; i < length; i++) {
         if (allocs[i] == NULL) {
-            destroy_heap(heap, heap_size);
+            destroy_heap();
             return false;
         }
     }
@@ -87,7 +85,7 @@ static bool test_single_block_free() {
     _free(allocs[9]);
     debug("Free", heap);
 
-    destroy_heap(heap, heap_size);
+    destroy_heap();
     return true;
 }
 
@@ -111,7 +109,7 @@ static bool test_double_block_free() {
 
     for (size_t i = 0; i < length; i++) {
         if (allocs[i] == NULL) {
-            destroy_heap(heap, heap_size);
+            destroy_heap();
             return false;
         }
     }
@@ -121,7 +119,7 @@ static bool test_double_block_free() {
     _free(allocs[3]);
     debug("Free", heap);
 
-    destroy_heap(heap, heap_size);
+    destroy_heap();
     return true;
 }
 
@@ -138,20 +136,20 @@ static bool test_grow_heap_and_merge() {
     void* first_alloc = _malloc(heap_size * 2);
     debug("Alloc", heap);
     if (!first_alloc) {
-        destroy_heap(heap, heap_size);
+        destroy_heap();
         return false;
     }
 
     struct block_header* heap_header = (struct block_header*) heap;
     if (heap_header->capacity.bytes < heap_size * 2) {
-        destroy_heap(heap, size_from_capacity(heap_header->capacity).bytes);
+        destroy_heap();
         return false;
     }
 
     _free(first_alloc);
     debug("Free", heap);
 
-    destroy_heap(heap, heap_size);
+    destroy_heap();
     return true;
 }
 
@@ -165,23 +163,23 @@ static bool test_grow_heap_no_merge() {
     debug("Init", heap);
     if (!heap) return false;
 
+    // the wall stands right after the initial region, so the heap can't extend it
     size_t wall_size = 1024;
-    void* wall = mmap(heap + heap_size, wall_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    void* wall = mmap((uint8_t*) heap + size_from_capacity(((struct block_header*) heap)->capacity).bytes, wall_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
 
     size_t alloc_size = heap_size * 2;
     void* first_alloc = _malloc(alloc_size);
     debug("Alloc", heap);
     if (!first_alloc) {
         munmap(wall, wall_size);
-        destroy_heap(heap, heap_size);
+        destroy_heap();
         return false;
     }
 
     struct block_header* heap_header = (struct block_header*) heap;
     if (!heap_header->is_free || heap_header->next->is_free) {
         munmap(wall, wall_size);
-        destroy_heap(heap, size_from_capacity(heap_header->capacity).bytes);
-        munmap(first_alloc, alloc_size);
+        destroy_heap();
         return false;
     }
 
@@ -189,8 +187,7 @@ static bool test_grow_heap_no_merge() {
     debug("Free", heap);
 
     munmap(wall, wall_size);
-    destroy_heap(heap, size_from_capacity(heap_header->capacity).bytes);
-    munmap(first_alloc, alloc_size);
+    destroy_heap();
     return true;
 }
 
@@ -1,5 +1,7 @@
 #include "test_utils.h"
 
+#include "mem.h"
+
 
 extern inline void run_test_group(const char * name, const test_in_group * tests, size_t amount);
 extern inline void base_mmap_checks(void * addr, size_t length, int prot, int flags, int fd, off_t offset);
@@ -165,3 +167,11 @@ void print_mmap_result(FILE * output, void * retval) {
         fputs("mmap(...) -> NULL\n", output);
     }
 }
+
+size_t live_bytes(struct heap * heap) {
+    struct heap_region_stats stats[64];
+    const size_t count = heap_regions(heap, stats, 64);
+    size_t live = 0;
+    for (size_t i = 0; i < count && i < 64; ++i) live += stats[i].live;
+    return live;
+}
@@ -58,6 +58,11 @@ inline void base_mmap_checks(void * addr, size_t length, int prot, int flags, in
 void print_mmap_call(FILE * output, void * addr, size_t length, int prot, int flags, int fd, off_t offset);
 void print_mmap_result(FILE * output, void * retval);
 
+struct heap;
+
+// bytes taken by live blocks over all regions of the heap
+size_t live_bytes(struct heap * heap);
+
 
 #ifdef TEST_SMART_MMAP
 #define DEFINE_MMAP_IMPL(_name) \
@@ -26,7 +26,7 @@ DEFINE_MMAP_IMPL(optimistic_case) {
 DEFINE_TEST(optimistic_case) {
     current_mmap_impl = MMAP_IMPL(optimistic_case);
 
-    const struct region region = alloc_region(HEAP_START, 0);
+    const struct region region = alloc_region(&default_heap, HEAP_START, 0);
 
     assert(region.addr == HEAP_START);
     assert(region.size == REGION_MIN_SIZE);
@@ -63,7 +63,7 @@ DEFINE_MMAP_IMPL(map_fixed_failed) {
 DEFINE_TEST(map_fixed_failed) {
     current_mmap_impl = MMAP_IMPL(map_fixed_failed);
 
-    const struct region region = alloc_region(HEAP_START, 0);
+    const struct region region = alloc_region(&default_heap, HEAP_START, 0);
 
     assert(region.addr != HEAP_START);
     assert(region.size == REGION_MIN_SIZE);
@@ -94,7 +94,7 @@ DEFINE_MMAP_IMPL(pessimistic_case) {
 DEFINE_TEST(pessimistic_case) {
     current_mmap_impl = MMAP_IMPL(pessimistic_case);
 
-    const struct region region = alloc_region(HEAP_START, 0);
+    const struct region region = alloc_region(&default_heap, HEAP_START, 0);
 
     assert(region.addr == NULL);
 
@@ -110,13 +110,13 @@ DEFINE_MMAP_IMPL(query_is_small) {
 // test with query = 0
 DEFINE_TEST(query_is_zero) {
     current_mmap_impl = MMAP_IMPL(query_is_small);
-    alloc_region(HEAP_START, 0);
+    alloc_region(&default_heap, HEAP_START, 0);
 }
 
 // test with query > 0 and query < REGION_MIN_SIZE
 DEFINE_TEST(query_is_small) {
     current_mmap_impl = MMAP_IMPL(query_is_small);
-    alloc_region(HEAP_START, 42);
+    alloc_region(&default_heap, HEAP_START, 42);
 }
 
 DEFINE_MMAP_IMPL(query_is_min_region_size) {
@@ -129,7 +129,7 @@ DEFINE_MMAP_IMPL(query_is_min_region_size) {
 DEFINE_TEST(query_is_min_region_size) {
     current_mmap_impl = MMAP_IMPL(query_is_min_region_size);
 
-    const struct region region = alloc_region(HEAP_START, REGION_MIN_SIZE);
+    const struct region region = alloc_region(&default_heap, HEAP_START, REGION_MIN_SIZE);
 
     assert(region.addr == HEAP_START);
     assert(region.size == (size_t) (REGION_MIN_SIZE + getpagesize()));
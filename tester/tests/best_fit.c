@@ -0,0 +1,161 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#define BUFFER_SIZE (4 * 1024 * 1024)
+#define SLOTS 256
+#define STEPS 20000
+
+
+DEFINE_MMAP_IMPL(passthrough) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+static _Alignas(4096) uint8_t buffer[BUFFER_SIZE];
+
+static struct heap * create(struct buffer_provider * bp) {
+    const struct heap_options options = { .provider = buffer_provider_init(bp, buffer, BUFFER_SIZE), .fit = HEAP_FIT_BEST };
+    struct heap * const heap = heap_create(0, &options);
+    assert(heap);
+    return heap;
+}
+
+// takes blocks of the given capacities separated by taken ones, then frees them
+static void make_holes(struct heap * heap, const size_t * sizes, size_t count, void ** holes) {
+    for (size_t i = 0; i < count; ++i) {
+        holes[i] = heap_malloc(heap, sizes[i]);
+        assert(heap_malloc(heap, 32));
+    }
+    for (size_t i = 0; i < count; ++i) heap_free(heap, holes[i]);
+}
+
+// the smallest hole that fits wins, equal ones by address
+DEFINE_TEST(smallest) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp);
+
+    static const size_t sizes[] = { 300, 100, 200, 200, 500 };
+    void * holes[5];
+    make_holes(heap, sizes, 5, holes);
+
+    assert(heap_malloc(heap, 150) == holes[2]);
+    assert(heap_malloc(heap, 150) == holes[3]);
+    assert(heap_malloc(heap, 90) == holes[1]);
+
+    // the remainder of the split goes back to the tree
+    assert(heap_malloc(heap, 40) == holes[0]);
+    uint8_t * const remainder = heap_malloc(heap, 240);
+    assert(remainder == (uint8_t *) holes[0] + 40 + offsetof(struct block_header, contents));
+    assert(heap_malloc(heap, 400) == holes[4]);
+
+    heap_destroy(heap);
+}
+
+// neighbours released in the wrong order are merged before the heap grows
+DEFINE_TEST(consolidate) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp);
+
+    void * const first = heap_malloc(heap, 1000);
+    void * const second = heap_malloc(heap, 1000);
+    assert(heap_malloc(heap, 32));
+    assert(heap_malloc(heap, heap->tail->capacity.bytes)); // nothing else fits
+    const size_t used = bp.used;
+
+    heap_free(heap, first);
+    heap_free(heap, second); // merges forward only, so the two stay apart
+    assert(block_get_header(first)->next == block_get_header(second));
+
+    assert(heap_malloc(heap, 1500) == first);
+    assert(bp.used == used);
+
+    heap_destroy(heap);
+}
+
+static size_t validate(struct heap * heap, struct block_header * root, struct block_header ** previous) {
+    if (!root) return 0;
+    struct free_node const * const node = free_node(root);
+    const size_t left = validate(heap, node->left, previous);
+
+    assert(root->is_free);
+    if (*previous) assert(key_less(tree_key_of(heap, *previous), tree_key_of(heap, root)));
+    *previous = root;
+    assert(node->max == size_max(root->capacity.bytes, size_max(subtree_max(node->left), subtree_max(node->right))));
+
+    return left + 1 + validate(heap, node->right, previous);
+}
+
+// the tree stays a valid index of every free block, each hit is the best individual block
+DEFINE_TEST(random) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp);
+
+    void * slots[SLOTS] = { 0 };
+    uint64_t state = 42;
+    for (size_t step = 0; step < STEPS; ++step) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        const size_t slot = (state >> 33) % SLOTS;
+        if (slots[slot]) {
+            heap_free(heap, slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            const size_t size = size_max(BLOCK_MIN_CAPACITY, 1 + (state >> 40) % 2048);
+
+            struct block_header * best = NULL;
+            for (struct block_header * block = heap->start; block; block = block->next) {
+                if (!block->is_free || block->capacity.bytes < size) continue;
+                if (!best || block->capacity.bytes < best->capacity.bytes) best = block;
+            }
+
+            slots[slot] = heap_malloc(heap, size);
+            assert(slots[slot]);
+            if (best) assert(block_get_header(slots[slot]) == best);
+        }
+
+        size_t free_blocks = 0;
+        for (struct block_header * block = heap->start; block; block = block->next) free_blocks += block->is_free;
+        struct block_header * previous = NULL;
+        assert(validate(heap, heap->free_root, &previous) == free_blocks);
+    }
+
+    heap_destroy(heap);
+}
+
+// purge merges the neighbours and zeroes whole pages of them, the tree node must survive that
+DEFINE_TEST(purge) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+    struct heap * const heap = heap_create(0, &(struct heap_options) { .fit = HEAP_FIT_BEST });
+
+    // the only free block, the filler ends where contents of the first neighbour start a page
+    while (heap_malloc_try(heap, BLOCK_MIN_CAPACITY));
+    uint8_t * const room = heap_malloc(heap, 5 * 4096);
+    heap_free(heap, room);
+    const size_t header = offsetof(struct block_header, contents);
+    const uintptr_t end = round_up((uintptr_t) room + header + BLOCK_MIN_CAPACITY, 4096) - header;
+    assert(heap_malloc(heap, end - (uintptr_t) room) == room);
+
+    void * const first = heap_malloc(heap, 4096);
+    void * const second = heap_malloc(heap, 2 * 4096);
+    assert((uintptr_t) first % 4096 == 0);
+    assert(heap_malloc(heap, 32));
+    heap_free(heap, first);
+    heap_free(heap, second);
+    assert(block_get_header(first)->next == block_get_header(second));
+
+    heap_purge(heap);
+    assert(block_get_header(first)->capacity.bytes >= 3 * 4096);
+    struct block_header * previous = NULL;
+    assert(validate(heap, heap->free_root, &previous) > 0);
+    assert(heap_malloc(heap, 2 * 4096) == first);
+
+    heap_destroy(heap);
+}
+
+int main() {
+    RUN_SINGLE_TEST(smallest);
+    RUN_SINGLE_TEST(consolidate);
+    RUN_SINGLE_TEST(random);
+    RUN_SINGLE_TEST(purge);
+    return 0;
+}
@@ -0,0 +1,135 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include "buddy.h"
+
+#include <stdlib.h>
+
+#define ALLOCATIONS 2000
+
+
+DEFINE_MMAP_IMPL(passthrough) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+// fresh arena: one free block of every order
+static void assert_initial(struct buddy_heap * heap) {
+    for (unsigned order = 0; order <= BUDDY_MAX_ORDER; ++order) assert(buddy_free_blocks(heap, order) == 1);
+}
+
+// a page splits the smallest block, freeing it coalesces everything back
+DEFINE_TEST(split_and_coalesce) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+
+    struct buddy_heap heap;
+    buddy_init(&heap, NULL);
+
+    uint8_t * const page = buddy_malloc(&heap, 100);
+    assert(page);
+    assert((uintptr_t) page % BUDDY_PAGE_SIZE == 0);
+    assert(buddy_usable_size(&heap, page) == BUDDY_PAGE_SIZE);
+    assert(buddy_arenas(&heap) == 1);
+    assert(buddy_free_blocks(&heap, 0) == 0);
+
+    // 3 pages take 4, they come from the order 2 block
+    uint8_t * const four = buddy_malloc(&heap, 3 * BUDDY_PAGE_SIZE);
+    assert(buddy_usable_size(&heap, four) == 4 * BUDDY_PAGE_SIZE);
+    assert((uintptr_t) four % (4 * BUDDY_PAGE_SIZE) == 0);
+    assert(buddy_free_blocks(&heap, 2) == 0);
+
+    // 6 KiB takes the order 1 block, the next one splits the order 3 block into buddies XOR apart
+    uint8_t * const a = buddy_malloc(&heap, 6 * 1024);
+    uint8_t * const b = buddy_malloc(&heap, 6 * 1024);
+    uint8_t * const c = buddy_malloc(&heap, 6 * 1024);
+    assert(buddy_free_blocks(&heap, 3) == 0);
+    assert(((uintptr_t) b ^ (uintptr_t) c) == 2 * BUDDY_PAGE_SIZE);
+    assert(buddy_free_blocks(&heap, 2) == 1);
+
+    buddy_free(&heap, b);
+    assert(buddy_free_blocks(&heap, 1) == 1);
+    buddy_free(&heap, c);
+    assert(buddy_free_blocks(&heap, 1) == 0);
+    assert(buddy_free_blocks(&heap, 2) == 0);
+    assert(buddy_free_blocks(&heap, 3) == 1);
+
+    buddy_free(&heap, a);
+    buddy_free(&heap, four);
+    buddy_free(&heap, page);
+    assert_initial(&heap);
+
+    // freed twice is ignored
+    buddy_free(&heap, page);
+    assert_initial(&heap);
+
+    buddy_destroy(&heap);
+    assert(buddy_arenas(&heap) == 0);
+}
+
+// the largest blocks take a whole arena each half, too big queries fail
+DEFINE_TEST(limits) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+
+    struct buddy_heap heap;
+    buddy_init(&heap, NULL);
+
+    const size_t max = (size_t) BUDDY_PAGE_SIZE << BUDDY_MAX_ORDER;
+    assert(buddy_malloc(&heap, max + 1) == NULL);
+
+    void * const first = buddy_malloc(&heap, max);
+    void * const second = buddy_malloc(&heap, max);
+    assert(first && second);
+    assert(buddy_arenas(&heap) == 2);
+    assert(buddy_usable_size(&heap, second) == max);
+
+    // empty arena goes back, the last one stays
+    buddy_free(&heap, first);
+    buddy_free(&heap, second);
+    assert(buddy_arenas(&heap) == 1);
+    assert_initial(&heap);
+
+    buddy_destroy(&heap);
+}
+
+// random sizes: blocks never overlap, everything coalesces in the end
+DEFINE_TEST(random) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+    srand(37);
+
+    struct buddy_heap heap;
+    buddy_init(&heap, NULL);
+
+    static uint8_t * blocks[ALLOCATIONS];
+    static size_t sizes[ALLOCATIONS];
+    for (size_t step = 0; step < 4 * ALLOCATIONS; ++step) {
+        const size_t i = rand() % ALLOCATIONS;
+        if (blocks[i]) {
+            for (size_t j = 0; j < sizes[i]; j += BUDDY_PAGE_SIZE) assert(blocks[i][j] == (uint8_t) i);
+            buddy_free(&heap, blocks[i]);
+            blocks[i] = NULL;
+            continue;
+        }
+
+        sizes[i] = BUDDY_PAGE_SIZE << (rand() % 6);
+        sizes[i] -= rand() % (sizes[i] / 2);
+        blocks[i] = buddy_malloc(&heap, sizes[i]);
+        assert(blocks[i]);
+        assert(buddy_usable_size(&heap, blocks[i]) >= sizes[i]);
+        assert(buddy_usable_size(&heap, blocks[i]) < 2 * sizes[i]);
+        for (size_t j = 0; j < sizes[i]; j += BUDDY_PAGE_SIZE) blocks[i][j] = (uint8_t) i;
+    }
+
+    for (size_t i = 0; i < ALLOCATIONS; ++i) buddy_free(&heap, blocks[i]);
+    assert(buddy_arenas(&heap) == 1);
+    assert_initial(&heap);
+
+    buddy_destroy(&heap);
+}
+
+int main() {
+    RUN_SINGLE_TEST(split_and_coalesce);
+    RUN_SINGLE_TEST(limits);
+    RUN_SINGLE_TEST(random);
+    return 0;
+}
@@ -0,0 +1,143 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SLOTS 256
+#define STEPS 20000
+
+
+static _Alignas(4096) uint8_t buffer[16 * 1024 * 1024];
+
+DEFINE_MMAP_IMPL(passthrough) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+static const enum heap_fit fits[] = { HEAP_FIT_FIRST, HEAP_FIT_FIRST_INDEXED, HEAP_FIT_BEST, HEAP_FIT_NEXT };
+
+static struct heap * create(struct buffer_provider * bp, enum heap_fit fit) {
+    // region tables and page map nodes are mapped apart from the buffer
+    current_mmap_impl = MMAP_IMPL(passthrough);
+    const struct heap_options options = {
+        .provider = buffer_provider_init(bp, buffer, sizeof(buffer)), .fit = fit, .cacheline_pad = true,
+        .fastbin_max = 128, .slabs = true, .tiny = true
+    };
+    struct heap * const heap = heap_create(0, &options);
+    assert(heap);
+    return heap;
+}
+
+static int by_address(void const * a, void const * b) {
+    uint8_t * const x = *(uint8_t * const *) a;
+    uint8_t * const y = *(uint8_t * const *) b;
+    return x < y ? -1 : x > y;
+}
+
+// every allocation owns the cache lines it touches
+static void assert_padded(uint8_t * const * slots, size_t const * sizes) {
+    static uint8_t * live[SLOTS];
+    size_t count = 0;
+    for (size_t i = 0; i < SLOTS; ++i) {
+        if (!slots[i]) continue;
+        assert((uintptr_t) slots[i] % CACHE_LINE == 0);
+        live[count++] = slots[i];
+    }
+    qsort(live, count, sizeof(*live), by_address);
+
+    for (size_t i = 1; i < count; ++i) {
+        size_t size = 0;
+        for (size_t j = 0; j < SLOTS; ++j) if (slots[j] == live[i - 1]) size = sizes[j];
+        assert(live[i - 1] + round_up(size, CACHE_LINE) <= live[i]);
+    }
+}
+
+// small queries take a whole line, the next block starts after it
+DEFINE_TEST(counters) {
+    for (size_t f = 0; f < sizeof(fits) / sizeof(*fits); ++f) {
+        struct buffer_provider bp;
+        struct heap * const heap = create(&bp, fits[f]);
+
+        uint8_t * counters[16];
+        for (size_t i = 0; i < 16; ++i) {
+            counters[i] = heap_malloc(heap, 8);
+            assert((uintptr_t) counters[i] % CACHE_LINE == 0);
+            assert(heap_usable_size(heap, counters[i]) >= CACHE_LINE);
+            assert(!slab_find(heap, counters[i]));
+            if (i) assert(counters[i] - counters[i - 1] >= 2 * CACHE_LINE);
+        }
+
+        // the cached block of the class comes back
+        heap_free(heap, counters[3]);
+        assert(heap_malloc(heap, 40) == counters[3]);
+        assert(heap_malloc_try(heap, 8));
+
+        heap_destroy(heap);
+    }
+}
+
+// random trace with every policy: contents survive, no two live allocations share a line
+static void random_trace(enum heap_fit fit) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, fit);
+    srand(47);
+
+    static uint8_t * slots[SLOTS];
+    static size_t sizes[SLOTS];
+    for (size_t step = 0; step < STEPS; ++step) {
+        const size_t i = rand() % SLOTS;
+        if (slots[i]) {
+            for (size_t j = 0; j < sizes[i]; ++j) assert(slots[i][j] == (uint8_t) i);
+            heap_free(heap, slots[i]);
+            slots[i] = NULL;
+        } else {
+            sizes[i] = rand() % 4 ? 1 + rand() % 200 : 1 + rand() % 5000;
+            slots[i] = heap_malloc(heap, sizes[i]);
+            assert(slots[i]);
+            memset(slots[i], (int) i, sizes[i]);
+        }
+        if (step % 1000 == 0) assert_padded(slots, sizes);
+    }
+    assert_padded(slots, sizes);
+
+    for (size_t i = 0; i < SLOTS; ++i) {
+        heap_free(heap, slots[i]);
+        slots[i] = NULL;
+    }
+    heap_destroy(heap);
+}
+
+DEFINE_TEST(random) {
+    for (size_t f = 0; f < sizeof(fits) / sizeof(*fits); ++f) random_trace(fits[f]);
+}
+
+// objects cut from a group run are padded like any other allocation of the heap
+DEFINE_TEST(group) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, HEAP_FIT_FIRST);
+    struct heap_group group;
+    assert(heap_group_init(heap, &group, 4096));
+
+    static const size_t sizes[] = { 8, 64, 65, 1, 100, 24, 200, 40 };
+    uint8_t * objects[8];
+    for (size_t i = 0; i < 8; ++i) {
+        objects[i] = heap_group_malloc(&group, sizes[i]);
+        assert((uintptr_t) objects[i] % CACHE_LINE == 0);
+        if (i) assert(objects[i - 1] + round_up(sizes[i - 1], CACHE_LINE) < objects[i]);
+    }
+    // the header line is between them, nothing else
+    assert(objects[1] == objects[0] + 2 * CACHE_LINE);
+    heap_group_release(&group);
+
+    for (size_t i = 0; i < 8; ++i) heap_free(heap, objects[i]);
+    heap_destroy(heap);
+}
+
+int main() {
+    RUN_SINGLE_TEST(counters);
+    RUN_SINGLE_TEST(random);
+    RUN_SINGLE_TEST(group);
+    return 0;
+}
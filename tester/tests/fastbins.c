@@ -0,0 +1,142 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BUFFER_SIZE (4 * 1024 * 1024)
+#define SLOTS 256
+#define STEPS 20000
+
+
+static _Alignas(4096) uint8_t buffer[BUFFER_SIZE];
+
+static struct heap * create(struct buffer_provider * bp, size_t size, enum heap_fit fit) {
+    const struct heap_options options = { .provider = buffer_provider_init(bp, buffer, size), .fit = fit, .fastbin_max = 128 };
+    struct heap * const heap = heap_create(0, &options);
+    assert(heap);
+    return heap;
+}
+
+// released blocks come back last in first out, they stay taken meanwhile
+DEFINE_TEST(lifo) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, BUFFER_SIZE, HEAP_FIT_FIRST);
+
+    void * const first = heap_malloc(heap, 40);
+    void * const second = heap_malloc(heap, 40);
+    heap_free(heap, first);
+    heap_free(heap, second);
+    assert(!block_get_header(first)->is_free);
+    assert(!block_get_header(second)->is_free);
+    assert(block_get_header(first)->next == block_get_header(second));
+
+    assert(heap_malloc(heap, 40) == second);
+    assert(heap_malloc(heap, 40) == first);
+
+    // small queries are rounded, so a neighbouring size hits the same bin
+    void * const odd = heap_malloc(heap, 33);
+    assert(block_get_header(odd)->capacity.bytes == 40);
+    heap_free(heap, odd);
+    assert(heap_malloc_try(heap, 36) == odd);
+
+    // a bigger block goes to the class below its capacity, it fits every query of the class
+    void * const above = heap_malloc(heap, 131);
+    heap_free(heap, above);
+    assert(!block_get_header(above)->is_free);
+    assert(heap_malloc(heap, 121) == above);
+
+    // bigger blocks are released as usual
+    void * const big = heap_malloc(heap, 136);
+    heap_free(heap, big);
+    assert(block_get_header(big)->is_free);
+
+    heap_destroy(heap);
+}
+
+// cached neighbours are merged before the heap has to grow
+DEFINE_TEST(consolidate) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, REGION_MIN_SIZE, HEAP_FIT_FIRST);
+
+    void * const first = heap_malloc(heap, 40);
+    void * const second = heap_malloc(heap, 40);
+    assert(heap_malloc(heap, block_get_header(second)->next->capacity.bytes)); // nothing is left at the end
+    heap_free(heap, first);
+    heap_free(heap, second);
+
+    // the buffer is full, only the merged pair fits
+    assert(heap_malloc(heap, 90) == first);
+    assert(block_get_header(first)->capacity.bytes == 40 + size_from_capacity((block_capacity) {40}).bytes);
+
+    heap_destroy(heap);
+}
+
+// trimming sees the cached tail as free
+DEFINE_TEST(trim) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, BUFFER_SIZE, HEAP_FIT_FIRST);
+
+    void * const big = heap_malloc(heap, 4 * REGION_MIN_SIZE);
+    void * const small = heap_malloc(heap, 64);
+    heap_free(heap, big);
+    heap_free(heap, small);
+    const size_t used = bp.used;
+
+    heap_trim(heap);
+    assert(block_get_header(big)->is_free);
+    assert(bp.used < used);
+
+    heap_destroy(heap);
+}
+
+// random trace with every policy: contents survive and statistics stay consistent
+static void random_trace(enum heap_fit fit) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, BUFFER_SIZE, fit);
+    srand(39);
+
+    static uint8_t * slots[SLOTS];
+    static size_t sizes[SLOTS];
+    for (size_t step = 0; step < STEPS; ++step) {
+        const size_t i = rand() % SLOTS;
+        if (slots[i]) {
+            for (size_t j = 0; j < sizes[i]; ++j) assert(slots[i][j] == (uint8_t) i);
+            heap_free(heap, slots[i]);
+            slots[i] = NULL;
+        } else {
+            sizes[i] = rand() % 8 ? 1 + rand() % 160 : 1 + rand() % 4000;
+            slots[i] = rand() % 4 ? heap_malloc(heap, sizes[i]) : heap_malloc_try(heap, sizes[i]);
+            if (slots[i]) memset(slots[i], (int) i, sizes[i]);
+        }
+    }
+
+    for (size_t i = 0; i < SLOTS; ++i) {
+        heap_free(heap, slots[i]);
+        slots[i] = NULL;
+    }
+    heap_trim(heap);
+
+    // everything is free after consolidation
+    struct heap_region_stats stats[64];
+    const size_t count = heap_regions(heap, stats, 64);
+    for (size_t i = 0; i < count && i < 64; ++i) assert(stats[i].live == 0);
+
+    heap_destroy(heap);
+}
+
+DEFINE_TEST(random) {
+    random_trace(HEAP_FIT_FIRST);
+    random_trace(HEAP_FIT_FIRST_INDEXED);
+    random_trace(HEAP_FIT_BEST);
+    random_trace(HEAP_FIT_NEXT);
+}
+
+int main() {
+    RUN_SINGLE_TEST(lifo);
+    RUN_SINGLE_TEST(consolidate);
+    RUN_SINGLE_TEST(trim);
+    RUN_SINGLE_TEST(random);
+    return 0;
+}
@@ -16,7 +16,7 @@ DEFINE_TEST(single_block_is_good) {
     block_init(buffer, (block_size) { .bytes = BUFFER_SIZE }, NULL);
     struct block_header * const block = (void*) buffer;
 
-    const struct block_search_result bsr = find_good_or_last(block, BUFFER_SIZE / 2);
+    const struct block_search_result bsr = find_good_or_last_in(NULL, block, BUFFER_SIZE / 2);
 
     assert(bsr.type == BSR_FOUND_GOOD_BLOCK);
     assert(bsr.block == block);
@@ -36,7 +36,7 @@ DEFINE_TEST(single_block_is_dirty) {
     struct block_header * const block = (void*) buffer;
     block->is_free = false;
 
-    const struct block_search_result bsr = find_good_or_last(block, BUFFER_SIZE / 2);
+    const struct block_search_result bsr = find_good_or_last_in(NULL, block, BUFFER_SIZE / 2);
 
     assert(bsr.type == BSR_REACHED_END_NOT_FOUND);
     assert(bsr.block == block);
@@ -55,7 +55,7 @@ DEFINE_TEST(single_block_is_small) {
     block_init(buffer, (block_size) { .bytes = BUFFER_SIZE / 4 }, NULL);
     struct block_header * const block = (void*) buffer;
 
-    const struct block_search_result bsr = find_good_or_last(block, BUFFER_SIZE / 2);
+    const struct block_search_result bsr = find_good_or_last_in(NULL, block, BUFFER_SIZE / 2);
 
     assert(bsr.type == BSR_REACHED_END_NOT_FOUND);
     assert(bsr.block == block);
@@ -92,7 +92,7 @@ DEFINE_TEST(multiple_blocks_fail) {
     block2->is_free = false;
     block7->is_free = false;
 
-    const struct block_search_result bsr = find_good_or_last(block1, BUFFER_SIZE / 2);
+    const struct block_search_result bsr = find_good_or_last_in(NULL, block1, BUFFER_SIZE / 2);
 
     assert(bsr.type == BSR_REACHED_END_NOT_FOUND);
     assert(bsr.block == block8);
@@ -145,7 +145,7 @@ DEFINE_TEST(multiple_blocks_success) {
     block2->is_free = false;
     block8->is_free = false;
 
-    const struct block_search_result bsr = find_good_or_last(block1, BUFFER_SIZE / 2);
+    const struct block_search_result bsr = find_good_or_last_in(NULL, block1, BUFFER_SIZE / 2);
 
     assert(bsr.type == BSR_FOUND_GOOD_BLOCK);
     assert(bsr.block == block3);
@@ -0,0 +1,197 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#define BUFFER_SIZE (8 * 1024 * 1024)
+#define SLOTS 256
+#define STEPS 20000
+
+
+DEFINE_MMAP_IMPL(passthrough) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+static uint64_t random_state;
+
+static uint64_t next_random(void) {
+    random_state = random_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return random_state >> 33;
+}
+
+static size_t random_size(void) {
+    const uint64_t kind = next_random() % 100;
+    if (kind < 70) return 1 + next_random() % 256;
+    if (kind < 95) return 256 + next_random() % 4096;
+    return 4096 + next_random() % (5 * REGION_MIN_SIZE);
+}
+
+// position of the block which doesn't depend on where the regions are mapped
+struct position { size_t seq; size_t offset; };
+
+static struct position position_of(struct heap * heap, void * mem) {
+    struct region_desc const * const region = region_find(heap, mem);
+    assert(region);
+    return (struct position) { region->seq, (uint8_t *) mem - region->addr };
+}
+
+// regions are compared in chain order, their addresses differ
+static void assert_same_regions(struct heap * scanned, struct heap * indexed) {
+    assert(scanned->regions.count == indexed->regions.count);
+    struct region_desc const * const a = region_descs(&scanned->regions);
+    struct region_desc const * const b = region_descs(&indexed->regions);
+    for (size_t i = 0; i < scanned->regions.count; ++i) {
+        size_t j = 0;
+        while (j < indexed->regions.count && b[j].seq != a[i].seq) ++j;
+        assert(j < indexed->regions.count);
+        assert(a[i].size == b[j].size);
+        assert(a[i].live == b[j].live);
+        assert(a[i].free == b[j].free);
+    }
+}
+
+// the same trace gives the same placement with and without the index
+static void replay(struct heap_options options, uint64_t seed) {
+    struct heap * const scanned = heap_create(0, &options);
+    options.fit = HEAP_FIT_FIRST_INDEXED;
+    struct heap * const indexed = heap_create(0, &options);
+
+    void * scanned_slots[SLOTS] = { 0 };
+    void * indexed_slots[SLOTS] = { 0 };
+    random_state = seed;
+
+    for (size_t step = 0; step < STEPS; ++step) {
+        const size_t slot = next_random() % SLOTS;
+        if (scanned_slots[slot]) {
+            heap_free(scanned, scanned_slots[slot]);
+            heap_free(indexed, indexed_slots[slot]);
+            scanned_slots[slot] = indexed_slots[slot] = NULL;
+            continue;
+        }
+
+        const size_t size = random_size();
+        const bool try_only = next_random() % 8 == 0;
+        scanned_slots[slot] = try_only ? heap_malloc_try(scanned, size) : heap_malloc(scanned, size);
+        indexed_slots[slot] = try_only ? heap_malloc_try(indexed, size) : heap_malloc(indexed, size);
+
+        assert(!scanned_slots[slot] == !indexed_slots[slot]);
+        if (!scanned_slots[slot]) continue;
+        const struct position expected = position_of(scanned, scanned_slots[slot]);
+        const struct position actual = position_of(indexed, indexed_slots[slot]);
+        assert(expected.seq == actual.seq && expected.offset == actual.offset);
+    }
+    assert_same_regions(scanned, indexed);
+
+    for (size_t slot = 0; slot < SLOTS; ++slot) {
+        heap_free(scanned, scanned_slots[slot]);
+        heap_free(indexed, indexed_slots[slot]);
+    }
+    heap_trim(scanned);
+    heap_trim(indexed);
+    assert_same_regions(scanned, indexed);
+
+    heap_destroy(indexed);
+    heap_destroy(scanned);
+}
+
+static _Alignas(4096) uint8_t buffers[2][BUFFER_SIZE];
+
+// one continuous run
+DEFINE_TEST(buffer) {
+    struct buffer_provider scanned_bp, indexed_bp;
+    for (uint64_t seed = 1; seed <= 4; ++seed) {
+        buffer_provider_init(&scanned_bp, buffers[0], BUFFER_SIZE);
+        buffer_provider_init(&indexed_bp, buffers[1], BUFFER_SIZE);
+
+        // heap_create takes the provider from options, so each heap gets its own copy of them
+        struct heap_options options = { .provider = &scanned_bp.provider };
+        struct heap * const scanned = heap_create(0, &options);
+        options = (struct heap_options) { .provider = &indexed_bp.provider, .fit = HEAP_FIT_FIRST_INDEXED };
+        struct heap * const indexed = heap_create(0, &options);
+
+        void * scanned_slots[SLOTS] = { 0 };
+        void * indexed_slots[SLOTS] = { 0 };
+        random_state = seed;
+        for (size_t step = 0; step < STEPS; ++step) {
+            const size_t slot = next_random() % SLOTS;
+            if (scanned_slots[slot]) {
+                heap_free(scanned, scanned_slots[slot]);
+                heap_free(indexed, indexed_slots[slot]);
+                scanned_slots[slot] = indexed_slots[slot] = NULL;
+                continue;
+            }
+
+            const size_t size = random_size();
+            scanned_slots[slot] = heap_malloc(scanned, size);
+            indexed_slots[slot] = heap_malloc(indexed, size);
+            assert((uint8_t *) scanned_slots[slot] - buffers[0] == (uint8_t *) indexed_slots[slot] - buffers[1]);
+        }
+        assert(scanned_bp.used == indexed_bp.used);
+
+        heap_destroy(indexed);
+        heap_destroy(scanned);
+    }
+}
+
+static void * map_at_failed(struct page_provider * self, void const * addr, size_t length, int flags) {
+    (void) self; (void) addr; (void) length; (void) flags;
+    return MAP_FAILED;
+}
+
+static void * map_anywhere(struct page_provider * self, void const * addr, size_t length, int flags) {
+    (void) addr;
+    return page_provider_anonymous.map(self, NULL, length, flags);
+}
+
+// growth always starts a new region, so chain order differs from address order
+DEFINE_TEST(scattered) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+
+    struct page_provider scattered = page_provider_anonymous;
+    scattered.map = map_anywhere;
+    scattered.map_at = map_at_failed;
+    for (uint64_t seed = 1; seed <= 4; ++seed) replay((struct heap_options) { .provider = &scattered }, seed);
+}
+
+// frees a 3-page block whose contents start a page, with taken blocks around it, and purges the heap
+static void * purged_hole(struct heap * heap) {
+    // the free block big enough for all three is the only one, the filler ends where the hole's contents must start
+    while (heap_malloc_try(heap, BLOCK_MIN_CAPACITY));
+    uint8_t * const room = heap_malloc(heap, 5 * 4096);
+    heap_free(heap, room);
+    const size_t header = offsetof(struct block_header, contents);
+    const uintptr_t end = round_up((uintptr_t) room + header + BLOCK_MIN_CAPACITY, 4096) - header;
+    assert(heap_malloc(heap, end - (uintptr_t) room) == room);
+
+    void * const hole = heap_malloc(heap, 3 * 4096);
+    assert((uintptr_t) hole % 4096 == 0);
+    assert(heap_malloc(heap, 32));
+    heap_free(heap, hole);
+    heap_purge(heap);
+    return hole;
+}
+
+// purged pages come back zeroed, the index node of a free block must survive that
+DEFINE_TEST(purge) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+
+    struct heap * const scanned = heap_create(0, NULL);
+    struct heap * const indexed = heap_create(0, &(struct heap_options) { .fit = HEAP_FIT_FIRST_INDEXED });
+    void * const scanned_hole = purged_hole(scanned);
+    void * const indexed_hole = purged_hole(indexed);
+
+    void * const expected = heap_malloc(scanned, 2 * 4096);
+    void * const actual = heap_malloc(indexed, 2 * 4096);
+    assert(expected == scanned_hole && actual == indexed_hole);
+    assert(position_of(scanned, expected).offset == position_of(indexed, actual).offset);
+
+    heap_destroy(indexed);
+    heap_destroy(scanned);
+}
+
+int main() {
+    RUN_SINGLE_TEST(buffer);
+    RUN_SINGLE_TEST(scattered);
+    RUN_SINGLE_TEST(purge);
+    return 0;
+}
@@ -30,7 +30,7 @@ DEFINE_TEST(mmap_failed) {
     block_init(block, (block_size) { .bytes = BLOCK_SIZE }, NULL);
 
     test_mmap_counter = 0;
-    struct block_header * const result = grow_heap(block, BLOCK_MIN_CAPACITY);
+    struct block_header * const result = grow_heap(&default_heap, block, BLOCK_MIN_CAPACITY);
     assert(result == NULL);
 
     assert(test_mmap_counter == 2);
@@ -62,7 +62,7 @@ DEFINE_TEST(mmap_fixed_failed) {
     block_init(block, (block_size) { .bytes = BLOCK_SIZE / 2 }, NULL);
 
     test_mmap_counter = 0;
-    struct block_header * const result = grow_heap(block, BLOCK_MIN_CAPACITY);
+    struct block_header * const result = grow_heap(&default_heap, block, BLOCK_MIN_CAPACITY);
     assert((uint8_t*) result == buffer + BLOCK_SIZE);
 
     assert(test_mmap_counter == 2);
@@ -96,7 +96,7 @@ DEFINE_TEST(mmap_success_last_dirty) {
     block->is_free = false;
 
     test_mmap_counter = 0;
-    struct block_header * const result = grow_heap(block, BLOCK_MIN_CAPACITY);
+    struct block_header * const result = grow_heap(&default_heap, block, BLOCK_MIN_CAPACITY);
     assert((uint8_t*) result == buffer + BLOCK_SIZE);
 
     assert(test_mmap_counter == 1);
@@ -118,7 +118,7 @@ DEFINE_TEST(mmap_success_last_free) {
     block_init(block, (block_size) { .bytes = BLOCK_SIZE }, NULL);
 
     test_mmap_counter = 0;
-    struct block_header * const result = grow_heap(block, BLOCK_MIN_CAPACITY);
+    struct block_header * const result = grow_heap(&default_heap, block, BLOCK_MIN_CAPACITY);
     assert((uint8_t*) result == (uint8_t*) buffer);
 
     assert(test_mmap_counter == 1);
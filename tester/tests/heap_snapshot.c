@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include "offset_heap.h"
+
+#include <unistd.h>
+
+#define MAX_SIZE (64 * REGION_MIN_SIZE)
+#define NODES 1000
+
+
+struct node {
+    uint64_t next;
+    uint64_t value;
+};
+
+static void fill(struct offset_heap * heap) {
+    uint64_t head = 0;
+    for (uint64_t i = 0; i < NODES; ++i) {
+        struct node * const node = offset_heap_malloc(heap, sizeof(struct node));
+        assert(node);
+        node->next = head;
+        node->value = i;
+        head = offset_heap_offset(heap, node);
+    }
+    offset_heap_set_root(heap, offset_heap_pointer(heap, head));
+}
+
+static uint64_t sum(struct offset_heap * heap) {
+    uint64_t result = 0;
+    for (struct node * node = offset_heap_root(heap); node; node = offset_heap_pointer(heap, node->next)) {
+        result += node->value;
+    }
+    return result;
+}
+
+static void add(struct offset_heap * heap, uint64_t delta) {
+    for (struct node * node = offset_heap_root(heap); node; node = offset_heap_pointer(heap, node->next)) {
+        node->value += delta;
+    }
+}
+
+static const uint64_t initial_sum = NODES * (NODES - 1) / 2;
+
+// clone and origin diverge independently
+DEFINE_TEST(diverge) {
+    const int fd = memfd_create("origin", 0);
+    assert(fd >= 0);
+
+    struct offset_heap origin, clone;
+    assert(offset_heap_attach(&origin, fd, MAX_SIZE) == OFFSET_HEAP_CREATED);
+    fill(&origin);
+
+    assert(offset_heap_snapshot(&origin, &clone));
+    assert(clone.base != origin.base);
+    assert(clone.mapped == origin.mapped);
+    assert(sum(&clone) == initial_sum);
+
+    // clone mutates and grows privately
+    add(&clone, 1);
+    assert(offset_heap_malloc(&clone, 8 * REGION_MIN_SIZE));
+    assert(clone.mapped > origin.mapped);
+    assert(sum(&clone) == initial_sum + NODES);
+    assert(sum(&origin) == initial_sum);
+
+    // origin mutates without disturbing the pages the clone wrote and keeps writing its file
+    assert(!origin.cow);
+    add(&origin, 2);
+    assert(sum(&origin) == initial_sum + 2 * NODES);
+    assert(sum(&clone) == initial_sum + NODES);
+    uint64_t value;
+    assert(pread(fd, &value, sizeof(value), (off_t) (offset_heap_offset(&origin, offset_heap_root(&origin)) + sizeof(uint64_t))) == sizeof(value));
+    assert(value == NODES - 1 + 2);
+
+    assert(offset_heap_check(&origin));
+    assert(offset_heap_check(&clone));
+
+    offset_heap_detach(&clone);
+    assert(sum(&origin) == initial_sum + 2 * NODES);
+    offset_heap_detach(&origin);
+
+    // the origin detached cleanly with its changes
+    assert(offset_heap_attach(&origin, fd, MAX_SIZE) == OFFSET_HEAP_CLEAN);
+    assert(sum(&origin) == initial_sum + 2 * NODES);
+    offset_heap_detach(&origin);
+    close(fd);
+}
+
+// pages the clone hasn't written show the origin's writes, the written ones are the clone's own
+DEFINE_TEST(show_through) {
+    const int fd = memfd_create("origin", 0);
+    assert(fd >= 0);
+
+    struct offset_heap origin, clone;
+    assert(offset_heap_attach(&origin, fd, MAX_SIZE) == OFFSET_HEAP_CREATED);
+    fill(&origin);
+    assert(offset_heap_snapshot(&origin, &clone));
+
+    add(&origin, 1);
+    assert(sum(&clone) == initial_sum + NODES);
+    add(&clone, 1);
+    add(&origin, 1);
+    assert(sum(&clone) == initial_sum + 2 * NODES);
+    assert(sum(&origin) == initial_sum + 2 * NODES);
+
+    offset_heap_detach(&clone);
+    offset_heap_detach(&origin);
+    close(fd);
+}
+
+// snapshots of copy-on-write heaps are copies with their private changes
+DEFINE_TEST(nested) {
+    const int fd = memfd_create("origin", 0);
+    assert(fd >= 0);
+
+    struct offset_heap origin, first, second, third;
+    assert(offset_heap_attach(&origin, fd, MAX_SIZE) == OFFSET_HEAP_CREATED);
+    fill(&origin);
+    assert(offset_heap_snapshot(&origin, &first));
+
+    // the first clone wrote nothing, every page of it is still the file's
+    add(&origin, 1);
+    assert(offset_heap_snapshot(&origin, &second));
+    assert(sum(&second) == initial_sum + NODES);
+    assert(sum(&first) == initial_sum + NODES);
+
+    add(&second, 1);
+    assert(offset_heap_snapshot(&second, &third));
+    add(&second, 1);
+    assert(sum(&third) == initial_sum + 2 * NODES);
+    assert(sum(&second) == initial_sum + 3 * NODES);
+    assert(sum(&origin) == initial_sum + NODES);
+
+    offset_heap_detach(&third);
+    offset_heap_detach(&second);
+    offset_heap_detach(&first);
+    offset_heap_detach(&origin);
+    close(fd);
+}
+
+// other processes write a shared heap, it can't be frozen
+DEFINE_TEST(shared) {
+    struct offset_heap heap, clone;
+    assert(offset_heap_create_shared(&heap, "shared", MAX_SIZE) == OFFSET_HEAP_CREATED);
+    assert(!offset_heap_snapshot(&heap, &clone));
+    close(heap.fd);
+    offset_heap_detach(&heap);
+}
+
+int main() {
+    RUN_SINGLE_TEST(diverge);
+    RUN_SINGLE_TEST(show_through);
+    RUN_SINGLE_TEST(nested);
+    RUN_SINGLE_TEST(shared);
+    return 0;
+}
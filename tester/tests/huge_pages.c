@@ -0,0 +1,177 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include <errno.h>
+#include <string.h>
+
+#define HUGE_THRESHOLD (HUGE_PAGE_SIZE / 2)
+
+
+static int mmap_counter = 0;
+static int hugetlb_counter = 0;
+static bool fail_fixed = false;
+
+DEFINE_MMAP_IMPL(no_hugetlb_pool) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+
+    ++mmap_counter;
+    if (flags & MAP_HUGETLB) {
+        ++hugetlb_counter;
+        return MAP_FAILED;
+    }
+    if (fail_fixed && (flags & MAP_FIXED_NOREPLACE)) return MAP_FAILED;
+
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+static void reset(bool huge_tlb, bool fixed_fails) {
+    current_mmap_impl = MMAP_IMPL(no_hugetlb_pool);
+    default_heap.options = (struct heap_options) { .huge_threshold = HUGE_THRESHOLD, .huge_tlb = huge_tlb };
+    mmap_counter = 0;
+    hugetlb_counter = 0;
+    fail_fixed = fixed_fails;
+}
+
+static bool is_mapped(void * addr, size_t length) {
+    unsigned char vec[length / getpagesize() + 1];
+    return mincore(addr, length, vec) == 0 || errno != ENOMEM;
+}
+
+// regions below the threshold are mapped as usual
+DEFINE_TEST(small_region) {
+    reset(true, false);
+
+    const struct region region = alloc_region(&default_heap, HEAP_START, 0);
+
+    assert(region.addr == HEAP_START);
+    assert(region.size == REGION_MIN_SIZE);
+    assert(mmap_counter == 1);
+    assert(hugetlb_counter == 0);
+
+    munmap(region.addr, region.size);
+}
+
+// no hugetlb pool -> falls back to THP at the requested address (HEAP_START rounded up for the first region)
+DEFINE_TEST(hugetlb_fallback) {
+    reset(true, false);
+
+    const struct region region = alloc_region(&default_heap, HEAP_START, HUGE_THRESHOLD);
+
+    assert(region.addr == (void *) round_up((uintptr_t) HEAP_START, HUGE_PAGE_SIZE));
+    assert(!region.extends);
+    assert(region.size == HUGE_PAGE_SIZE);
+    assert(hugetlb_counter == 2);
+
+    struct block_header * block = region.addr;
+    assert(block->next == NULL);
+    assert(block->capacity.bytes == HUGE_PAGE_SIZE - offsetof(struct block_header, contents));
+    assert(block->is_free);
+
+    memset(block->contents, 42, block->capacity.bytes);
+
+    munmap(region.addr, region.size);
+}
+
+// requested address is busy -> region is mapped elsewhere aligned to the huge page
+DEFINE_TEST(aligned_elsewhere) {
+    reset(false, true);
+
+    const struct region region = alloc_region(&default_heap, HEAP_START, 3 * HUGE_PAGE_SIZE / 2);
+
+    assert(region.addr != NULL);
+    assert(!region.extends);
+    assert((uintptr_t) region.addr % HUGE_PAGE_SIZE == 0);
+    assert(region.size == 2 * HUGE_PAGE_SIZE);
+    assert(hugetlb_counter == 0);
+
+    // head and tail of the oversized mapping are returned
+    assert(!is_mapped((uint8_t*) region.addr - getpagesize(), getpagesize()));
+    assert(!is_mapped((uint8_t*) region.addr + region.size, getpagesize()));
+
+    munmap(region.addr, region.size);
+}
+
+// trimming keeps the tail block up to the huge page boundary
+DEFINE_TEST(trim_granularity) {
+    reset(false, false);
+
+    struct heap_options options = default_heap.options;
+    struct block_header * const heap = heap_init_with(3 * HUGE_PAGE_SIZE, &options);
+    assert((uintptr_t) heap % HUGE_PAGE_SIZE == 0);
+
+    void * const taken = _malloc(HUGE_PAGE_SIZE / 4);
+    assert(taken);
+
+    _heap_trim();
+
+    struct block_header * const last = heap->next;
+    assert(last->is_free);
+    assert(last->next == NULL);
+    assert((uintptr_t) block_after(last) % HUGE_PAGE_SIZE == 0);
+    assert(block_after(last) == (void*) round_up((uintptr_t) (last->contents + BLOCK_MIN_CAPACITY), HUGE_PAGE_SIZE));
+    assert(!is_mapped(block_after(last), getpagesize()));
+
+    munmap(heap, (uint8_t*) block_after(last) - (uint8_t*) heap);
+}
+
+// purging zeroes only whole huge pages inside free blocks
+DEFINE_TEST(purge_granularity) {
+    reset(false, false);
+
+    struct heap_options options = default_heap.options;
+    struct block_header * const heap = heap_init_with(3 * HUGE_PAGE_SIZE, &options);
+    assert((uintptr_t) heap % HUGE_PAGE_SIZE == 0);
+
+    uint8_t * const taken = _malloc(HUGE_PAGE_SIZE / 4);
+    memset(taken, 42, HUGE_PAGE_SIZE / 4);
+
+    struct block_header * const free_block = heap->next;
+    uint8_t * const head = free_block->contents;
+    uint8_t * const purged = (uint8_t*) heap + HUGE_PAGE_SIZE;
+    *head = 42;
+    *purged = 42;
+
+    _heap_purge();
+
+    assert(*taken == 42);
+    assert(*head == 42);
+    assert(*purged == 0);
+    assert(free_block->is_free);
+
+    munmap(heap, 4 * HUGE_PAGE_SIZE);
+}
+
+// the first region of the default heap starts on a huge page, later ones still extend it
+DEFINE_TEST(first_region_aligned) {
+    reset(false, false);
+
+    struct heap_options options = default_heap.options;
+    struct block_header * const heap = heap_init_with(HUGE_THRESHOLD, &options);
+    assert(heap);
+    assert((uintptr_t) heap % HUGE_PAGE_SIZE == 0);
+    assert(_heap_regions(NULL, 0) == 1);
+
+    const struct region next = alloc_region(&default_heap, (uint8_t *) heap + HUGE_PAGE_SIZE, HUGE_THRESHOLD);
+    assert(next.addr == (uint8_t *) heap + HUGE_PAGE_SIZE && next.extends);
+
+    munmap(heap, 2 * HUGE_PAGE_SIZE);
+}
+
+DEFINE_TEST_GROUP(region) {
+    TEST_IN_GROUP(small_region),
+    TEST_IN_GROUP(hugetlb_fallback),
+    TEST_IN_GROUP(aligned_elsewhere),
+    TEST_IN_GROUP(first_region_aligned),
+};
+
+DEFINE_TEST_GROUP(granularity) {
+    TEST_IN_GROUP(trim_granularity),
+    TEST_IN_GROUP(purge_granularity),
+};
+
+int main() {
+    RUN_TEST_GROUP(region);
+    RUN_TEST_GROUP(granularity);
+    return 0;
+}
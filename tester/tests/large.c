@@ -0,0 +1,184 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SLOTS 64
+#define STEPS 4000
+
+
+DEFINE_MMAP_IMPL(passthrough) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+// chunks come from anonymous mappings, so residency can be checked
+static struct heap * create(size_t purge_delay) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+    const struct heap_options options = { .large_min = 32 * 1024, .large_purge_delay = purge_delay };
+    struct heap * const heap = heap_create(0, &options);
+    assert(heap);
+    return heap;
+}
+
+static bool resident(void * page) {
+    unsigned char vec;
+    assert(mincore(page, LARGE_PAGE_SIZE, &vec) == 0);
+    return vec & 1;
+}
+
+static size_t tree_size(struct large_run const * root) {
+    return root ? 1 + tree_size(root->left) + tree_size(root->right) : 0;
+}
+
+// large objects take exactly their pages, the block chain never sees them
+DEFINE_TEST(exact_pages) {
+    struct heap * const heap = create(0);
+    const size_t live = live_bytes(heap);
+
+    uint8_t * const mem = heap_malloc(heap, 40000);
+    assert((uintptr_t) mem % LARGE_PAGE_SIZE == 0);
+    assert(heap_usable_size(heap, mem) == 10 * LARGE_PAGE_SIZE);
+    assert(heap_owns(heap, mem + 10 * LARGE_PAGE_SIZE - 1));
+    assert(large_find(heap, mem));
+
+    // the next one follows it right away
+    assert(heap_malloc(heap, 32 * 1024) == mem + 10 * LARGE_PAGE_SIZE);
+    assert(live_bytes(heap) == live);
+
+    // smaller and bigger queries are blocks
+    assert(!large_find(heap, heap_malloc(heap, 32 * 1024 - 1)));
+    assert(!large_find(heap, heap_malloc(heap, LARGE_MAX_OBJECT + 1)));
+
+    heap_destroy(heap);
+}
+
+// the smallest run that fits is taken, freed runs merge with both neighbours
+DEFINE_TEST(best_fit_and_coalesce) {
+    struct heap * const heap = create(0);
+
+    uint8_t * const a = heap_malloc(heap, 100 * 1024);
+    uint8_t * const b = heap_malloc(heap, 100 * 1024);
+    uint8_t * const c = heap_malloc(heap, 100 * 1024);
+    uint8_t * const d = heap_malloc(heap, 200 * 1024);
+    heap_free(heap, a);
+    heap_free(heap, c);
+    heap_free(heap, c);
+    assert(tree_size(heap->large.free_root) == 3);
+
+    // both holes fit, the tail run is bigger
+    assert(heap_malloc(heap, 60 * 1024) == a);
+    heap_free(heap, a);
+
+    heap_free(heap, b);
+    assert(tree_size(heap->large.free_root) == 2);
+    heap_free(heap, d);
+    assert(tree_size(heap->large.free_root) == 1);
+
+    struct large_chunk * const chunk = heap->large.chunks;
+    assert(chunk->runs[LARGE_HEADER_PAGES].is_free);
+    assert(chunk->runs[LARGE_HEADER_PAGES].pages == LARGE_CHUNK_PAGES - LARGE_HEADER_PAGES);
+
+    // the whole chunk is one run again
+    assert(heap_malloc(heap, LARGE_MAX_OBJECT) == a);
+
+    heap_destroy(heap);
+}
+
+// a free run stays resident until enough frees have happened after it
+DEFINE_TEST(delayed_purge) {
+    struct heap * const heap = create(4);
+
+    uint8_t * const a = heap_malloc(heap, 64 * 1024);
+    uint8_t * const guard = heap_malloc(heap, 64 * 1024);
+    memset(a, 1, 64 * 1024);
+    heap_free(heap, a);
+    assert(resident(a));
+
+    for (int i = 0; i < 3; ++i) heap_free(heap, heap_malloc(heap, 128 * 1024));
+    assert(resident(a));
+    heap_free(heap, heap_malloc(heap, 128 * 1024));
+    assert(!resident(a));
+
+    // reused pages are fine to touch again
+    assert(heap_malloc(heap, 64 * 1024) == a);
+    memset(a, 2, 64 * 1024);
+    heap_free(heap, a);
+    assert(resident(a));
+
+    // purge doesn't wait
+    heap_purge(heap);
+    assert(!resident(a));
+    assert(heap->large.oldest == NULL);
+
+    heap_free(heap, guard);
+    heap_destroy(heap);
+}
+
+// trimming unmaps chunks without taken pages
+DEFINE_TEST(trim) {
+    struct heap * const heap = create(0);
+
+    void * const first = heap_malloc(heap, LARGE_MAX_OBJECT);
+    void * const second = heap_malloc(heap, LARGE_MAX_OBJECT);
+    assert(large_find(heap, first) != large_find(heap, second));
+
+    heap_free(heap, first);
+    heap_trim(heap);
+    assert(!heap_owns(heap, first));
+    assert(heap_owns(heap, second));
+
+    heap_free(heap, second);
+    heap_trim(heap);
+    assert(heap->large.chunks == NULL);
+    assert(heap->large.free_root == NULL);
+
+    heap_destroy(heap);
+}
+
+// random trace of large and small objects
+DEFINE_TEST(random) {
+    struct heap * const heap = create(8);
+    srand(43);
+
+    static uint8_t * slots[SLOTS];
+    static size_t sizes[SLOTS];
+    for (size_t step = 0; step < STEPS; ++step) {
+        const size_t i = rand() % SLOTS;
+        if (slots[i]) {
+            assert(heap_usable_size(heap, slots[i]) >= sizes[i]);
+            assert(slots[i][0] == (uint8_t) i && slots[i][sizes[i] - 1] == (uint8_t) i && slots[i][sizes[i] / 2] == (uint8_t) i);
+            heap_free(heap, slots[i]);
+            slots[i] = NULL;
+        } else {
+            sizes[i] = rand() % 4 ? 32 * 1024 + rand() % (1024 * 1024) : 1 + rand() % 2000;
+            slots[i] = rand() % 4 ? heap_malloc(heap, sizes[i]) : heap_malloc_try(heap, sizes[i]);
+            if (slots[i]) memset(slots[i], (int) i, sizes[i]);
+        }
+    }
+
+    for (size_t i = 0; i < SLOTS; ++i) {
+        heap_free(heap, slots[i]);
+        slots[i] = NULL;
+    }
+
+    // every chunk is a single free run
+    size_t chunks = 0;
+    for (struct large_chunk * chunk = heap->large.chunks; chunk; chunk = chunk->next) ++chunks;
+    assert(tree_size(heap->large.free_root) == chunks);
+    heap_trim(heap);
+    assert(heap->large.chunks == NULL);
+
+    heap_destroy(heap);
+}
+
+int main() {
+    RUN_SINGLE_TEST(exact_pages);
+    RUN_SINGLE_TEST(best_fit_and_coalesce);
+    RUN_SINGLE_TEST(delayed_purge);
+    RUN_SINGLE_TEST(trim);
+    RUN_SINGLE_TEST(random);
+    return 0;
+}
@@ -0,0 +1,149 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SHORT_LIFETIME 32
+
+
+DEFINE_MMAP_IMPL(passthrough) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+static struct heap * create(size_t short_lifetime) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+    const struct heap_options options = { .short_lifetime = short_lifetime };
+    struct heap * const heap = heap_create(0, &options);
+    assert(heap);
+    return heap;
+}
+
+static size_t mapped_bytes(struct heap * heap) {
+    struct heap_region_stats stats[64];
+    const size_t count = heap_regions(heap, stats, 64);
+    size_t mapped = 0;
+    for (size_t i = 0; i < count && i < 64; ++i) mapped += stats[i].size;
+    return mapped;
+}
+
+// hinted objects go to a sub-heap of their class, free and the queries find them there
+DEFINE_TEST(hints) {
+    struct heap * const heap = create(0);
+    const size_t regions = heap_regions(heap, NULL, 0);
+
+    void * const plain = heap_malloc_hint(heap, 100, HINT_NONE);
+    void * const brief = heap_malloc_hint(heap, 100, HINT_SHORT_LIVED);
+    void * const lasting = heap_malloc_hint(heap, 100, HINT_LONG_LIVED);
+    assert(heap->lifetimes[0] && heap->lifetimes[1]);
+    assert(heap_owns(heap->lifetimes[0], brief) && !heap_owns(heap->lifetimes[0], lasting));
+    assert(heap_owns(heap->lifetimes[1], lasting) && !heap_owns(heap->lifetimes[1], plain));
+    assert(heap_owns(heap, brief) && heap_owns(heap, lasting));
+    assert(heap_usable_size(heap, brief) >= 100);
+
+    // the sub-heaps' regions follow the heap's own ones
+    assert(heap_regions(heap, NULL, 0) == regions + 2);
+
+    // both hints at once mean nothing
+    assert(!heap_owns(heap->lifetimes[0], heap_malloc_hint(heap, 100, HINT_SHORT_LIVED | HINT_LONG_LIVED)));
+
+    heap_free(heap, brief);
+    assert(heap_malloc_hint(heap, 100, HINT_SHORT_LIVED) == brief);
+    heap_free(heap, brief);
+    heap_free(heap, lasting);
+    heap_free(heap, plain);
+
+    heap_destroy(heap);
+}
+
+// temporaries between long-lived objects pin the heap, apart they are trimmed away
+DEFINE_TEST(trim_short_lived) {
+    for (int hinted = 0; hinted < 2; ++hinted) {
+        struct heap * const heap = create(0);
+
+        static void * lasting[256];
+        static void * brief[256];
+        for (size_t i = 0; i < 256; ++i) {
+            lasting[i] = heap_malloc_hint(heap, 64, hinted ? HINT_LONG_LIVED : HINT_NONE);
+            brief[i] = heap_malloc_hint(heap, 4000, hinted ? HINT_SHORT_LIVED : HINT_NONE);
+        }
+        for (size_t i = 0; i < 256; ++i) heap_free(heap, brief[i]);
+        heap_trim(heap);
+
+        const size_t mapped = mapped_bytes(heap);
+        if (hinted) assert(mapped < 96 * 1024);
+        else assert(mapped > 384 * 1024);
+
+        for (size_t i = 0; i < 256; ++i) heap_free(heap, lasting[i]);
+        heap_destroy(heap);
+    }
+}
+
+// sites are learned from the lifetimes of their sampled objects
+DEFINE_TEST(learned) {
+    struct heap * const heap = create(SHORT_LIFETIME);
+    enum { TEMPORARY = 7, TABLE = 8, MODERATE = 9 };
+
+    static void * kept[4096];
+    size_t kept_count = 0;
+    static void * moderate[64];
+    for (size_t step = 0; step < 4096; ++step) {
+        void * const temporary = heap_malloc_site(heap, 48, TEMPORARY);
+        heap_free(heap, temporary);
+        kept[kept_count++] = heap_malloc_site(heap, 48, TABLE);
+
+        // lives 64 steps of 3 allocations
+        heap_free(heap, moderate[step % 64]);
+        moderate[step % 64] = heap_malloc_site(heap, 48, MODERATE);
+    }
+
+    struct lifetime_table * const table = heap->lifetime;
+    assert(table);
+    assert(lifetime_predict(heap, lifetime_site(table, TEMPORARY)) == HINT_SHORT_LIVED);
+    assert(lifetime_predict(heap, lifetime_site(table, TABLE)) == HINT_LONG_LIVED);
+    assert(lifetime_predict(heap, lifetime_site(table, MODERATE)) == HINT_NONE);
+    assert(lifetime_predict(heap, lifetime_site(table, 100)) == HINT_NONE);
+
+    void * const temporary = heap_malloc_site(heap, 48, TEMPORARY);
+    void * const lasting = heap_malloc_site(heap, 48, TABLE);
+    assert(heap_owns(heap->lifetimes[0], temporary));
+    assert(heap_owns(heap->lifetimes[1], lasting));
+    assert(heap_owns(heap->lifetimes[1], kept[kept_count - 1]));
+    heap_free(heap, temporary);
+    heap_free(heap, lasting);
+
+    for (size_t i = 0; i < kept_count; ++i) heap_free(heap, kept[i]);
+    for (size_t i = 0; i < 64; ++i) heap_free(heap, moderate[i]);
+    heap_destroy(heap);
+}
+
+// without a bound sites allocate in the heap itself and nothing is learned
+DEFINE_TEST(not_learning) {
+    struct heap * const heap = create(0);
+    for (size_t i = 0; i < 64; ++i) heap_free(heap, heap_malloc_site(heap, 48, 1));
+    assert(!heap->lifetime && !heap->lifetimes[0] && !heap->lifetimes[1]);
+    heap_destroy(heap);
+}
+
+// the default heap gets sub-heaps too, destroy forgets them
+DEFINE_TEST(default_heap) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+    assert(heap_init(0));
+    void * const brief = _malloc_hint(100, HINT_SHORT_LIVED);
+    assert(brief && _heap_owns(brief));
+    assert(default_heap.lifetimes[0] && heap_owns(default_heap.lifetimes[0], brief));
+    _free(brief);
+    _heap_destroy();
+    assert(!default_heap.lifetimes[0]);
+}
+
+int main() {
+    RUN_SINGLE_TEST(hints);
+    RUN_SINGLE_TEST(trim_short_lived);
+    RUN_SINGLE_TEST(learned);
+    RUN_SINGLE_TEST(not_learning);
+    RUN_SINGLE_TEST(default_heap);
+    return 0;
+}
@@ -0,0 +1,279 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define THREADS 4
+#define STEPS   100000
+#define HELD    32
+
+
+DEFINE_MMAP_IMPL(passthrough) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+struct object {
+    uint64_t state;
+    uint64_t owner;  /* thread holding the object, 0 while it's cached */
+};
+
+static size_t constructed;
+static size_t destroyed;
+
+// constructors run under no lock of the cache, the counters are only read when the threads are done
+static pthread_mutex_t counters = PTHREAD_MUTEX_INITIALIZER;
+
+static bool object_ctor(void * mem) {
+    struct object * const object = mem;
+    *object = (struct object) { .state = 0xBEEF, .owner = 0 };
+    pthread_mutex_lock(&counters);
+    ++constructed;
+    pthread_mutex_unlock(&counters);
+    return true;
+}
+
+static void object_dtor(void * mem) {
+    struct object * const object = mem;
+    assert(object->state == 0xBEEF && object->owner == 0);
+    pthread_mutex_lock(&counters);
+    ++destroyed;
+    pthread_mutex_unlock(&counters);
+}
+
+static struct objcache * create(struct heap ** heap, size_t rounds, size_t max_rounds) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+    constructed = destroyed = 0;
+    *heap = heap_create(0, NULL);
+    assert(*heap);
+    struct objcache * const cache = heap_objcache_create(*heap, sizeof(struct object), object_ctor, object_dtor);
+    objcache_magazines(cache, rounds, max_rounds);
+    return cache;
+}
+
+// a thread fills its two magazines before it gives a full one to the depot, another thread takes it
+DEFINE_TEST(depot) {
+    struct heap * heap;
+    struct objcache * const cache = create(&heap, 4, 4);
+    struct objcache_stats stats;
+
+    void * objects[9];
+    for (size_t i = 0; i < 9; ++i) objects[i] = objcache_alloc(cache);
+
+    struct objcache_thread producer;
+    objcache_thread_init(cache, &producer);
+    for (size_t i = 0; i < 8; ++i) objcache_thread_free(&producer, objects[i]);
+    objcache_stats(cache, &stats);
+    assert(stats.full == 0 && stats.full_returned == 0);
+    assert(producer.loaded->rounds == 4 && producer.previous->rounds == 4);
+
+    // both are full: the previous one goes to the depot
+    objcache_thread_free(&producer, objects[8]);
+    objcache_stats(cache, &stats);
+    assert(stats.full == 1 && stats.full_returned == 1 && stats.rounds == 4);
+
+    // the consumer gets the whole magazine in one trade, the first objects freed are in it
+    struct objcache_thread consumer;
+    objcache_thread_init(cache, &consumer);
+    void * taken[4];
+    for (size_t i = 0; i < 4; ++i) taken[i] = objcache_thread_alloc(&consumer);
+    for (size_t i = 0; i < 4; ++i) assert(taken[i] == objects[3 - i]);
+    objcache_stats(cache, &stats);
+    assert(stats.full == 0 && stats.full_taken == 1);
+
+    // nothing full left, the cache constructs
+    void * const fresh = objcache_thread_alloc(&consumer);
+    assert(constructed == 10);
+
+    // the producer's partial magazine goes to the cache, the full one to the depot
+    for (size_t i = 0; i < 4; ++i) objcache_thread_free(&consumer, taken[i]);
+    objcache_thread_free(&consumer, fresh);
+    objcache_thread_flush(&producer);
+    objcache_thread_flush(&consumer);
+    objcache_stats(cache, &stats);
+    assert(stats.cached == 2 && stats.full == 2);
+    assert(!producer.loaded && !producer.previous);
+
+    // the first reap sets the working set up, the second one destroys what nobody needed
+    heap_trim(heap);
+    assert(destroyed == 0);
+    heap_trim(heap);
+    assert(destroyed == 10);
+    objcache_stats(cache, &stats);
+    assert(stats.full == 0 && stats.empty == 0 && stats.cached == 0);
+    heap_destroy(heap);
+}
+
+static void * lock_depot(void * cache) {
+    depot_lock(&((struct objcache *) cache)->depot);
+    pthread_mutex_unlock(&((struct objcache *) cache)->depot.lock);
+    return NULL;
+}
+
+// contended lockings make new magazines bigger, empty magazines of the old size are dropped
+DEFINE_TEST(growth) {
+    struct heap * heap;
+    struct objcache * const cache = create(&heap, 2, 4);
+    struct objcache_stats stats;
+
+    // an empty magazine of two rounds gets to the depot
+    struct objcache_thread thread;
+    objcache_thread_init(cache, &thread);
+    objcache_thread_free(&thread, objcache_alloc(cache));
+    void * const kept = objcache_thread_alloc(&thread);
+    objcache_thread_flush(&thread);
+    objcache_stats(cache, &stats);
+    assert(stats.empty == 1);
+
+    // the locker waits for the lock the test holds, unless it comes too late
+    for (size_t attempt = 0; attempt < 64 * MAGAZINE_CONTENTION; ++attempt) {
+        pthread_mutex_lock(&cache->depot.lock);
+        pthread_t locker;
+        pthread_create(&locker, NULL, lock_depot, cache);
+        nanosleep(&(struct timespec) { .tv_nsec = 1000000 }, NULL);
+        pthread_mutex_unlock(&cache->depot.lock);
+        pthread_join(locker, NULL);
+
+        objcache_stats(cache, &stats);
+        if (stats.resizes) break;
+    }
+    assert(stats.contended == MAGAZINE_CONTENTION);
+    assert(stats.rounds == 4 && stats.resizes == 1);
+
+    void * const object = objcache_alloc(cache);
+    objcache_thread_free(&thread, object);
+    assert(thread.loaded->capacity == 4);
+    objcache_stats(cache, &stats);
+    assert(stats.empty == 0 && stats.empty_taken == 0);
+    objcache_thread_flush(&thread);
+    objcache_free(cache, kept);
+
+    objcache_destroy(cache);
+    assert(destroyed == constructed);
+    heap_destroy(heap);
+}
+
+// without magazines the thread calls go to the cache
+DEFINE_TEST(off) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+    struct heap * const heap = heap_create(0, NULL);
+    struct objcache * const cache = heap_objcache_create(heap, sizeof(struct object), object_ctor, object_dtor);
+    struct objcache_thread thread;
+    objcache_thread_init(cache, &thread);
+    void * const object = objcache_thread_alloc(&thread);
+    objcache_thread_free(&thread, object);
+    assert(!thread.loaded && cache->cached_count == 1);
+    assert(objcache_thread_alloc(&thread) == object);
+    objcache_thread_free(&thread, object);
+    heap_destroy(heap);
+}
+
+struct worker { struct objcache * cache; uint64_t id; };
+
+static void * work(void * arg) {
+    struct worker const * const worker = arg;
+    struct objcache_thread thread;
+    objcache_thread_init(worker->cache, &thread);
+
+    struct object * held[HELD] = {0};
+    uint64_t seed = worker->id;
+    for (size_t step = 0; step < STEPS; ++step) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        const size_t i = (seed >> 33) % HELD;
+        if (held[i]) {
+            assert(held[i]->owner == worker->id);
+            held[i]->owner = 0;
+            objcache_thread_free(&thread, held[i]);
+            held[i] = NULL;
+        } else {
+            held[i] = objcache_thread_alloc(&thread);
+            assert(held[i] && held[i]->state == 0xBEEF && held[i]->owner == 0);
+            held[i]->owner = worker->id;
+        }
+    }
+    for (size_t i = 0; i < HELD; ++i) {
+        if (!held[i]) continue;
+        held[i]->owner = 0;
+        objcache_thread_free(&thread, held[i]);
+    }
+    objcache_thread_flush(&thread);
+    return NULL;
+}
+
+// threads trade objects through the depot, nobody gets an object somebody else holds
+DEFINE_TEST(threads) {
+    struct heap * heap;
+    struct objcache * const cache = create(&heap, 8, 64);
+
+    pthread_t threads[THREADS];
+    struct worker workers[THREADS];
+    for (size_t t = 0; t < THREADS; ++t) {
+        workers[t] = (struct worker) { .cache = cache, .id = t + 1 };
+        pthread_create(&threads[t], NULL, work, &workers[t]);
+    }
+    for (size_t t = 0; t < THREADS; ++t) pthread_join(threads[t], NULL);
+
+    struct objcache_stats stats;
+    objcache_stats(cache, &stats);
+    assert(stats.full_taken <= stats.full_returned);
+    assert(constructed <= THREADS * (HELD + 2 * stats.rounds));
+
+    objcache_destroy(cache);
+    assert(destroyed == constructed);
+    heap_destroy(heap);
+}
+
+struct owner { struct objcache * cache; uint64_t id; };
+
+static void * own(void * arg) {
+    struct owner const * const owner = arg;
+    struct object * held[HELD];
+    for (size_t round = 0; round < STEPS / HELD; ++round) {
+        // a half-round leaves half of the objects unneeded, the reap gives them back to the heap
+        // and the next round allocates them again
+        const size_t count = round % 2 ? HELD / 2 : HELD;
+        for (size_t i = 0; i < count; ++i) {
+            held[i] = objcache_alloc(owner->cache);
+            assert(held[i] && held[i]->state == 0xBEEF && held[i]->owner == 0);
+            held[i]->owner = owner->id;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            assert(held[i]->owner == owner->id);
+            held[i]->owner = 0;
+            objcache_free(owner->cache, held[i]);
+        }
+        objcache_reap(owner->cache);
+    }
+    return NULL;
+}
+
+// caches of one heap used by different threads share the heap, its calls are serialized
+DEFINE_TEST(two_caches) {
+    struct heap * heap;
+    struct objcache * const first = create(&heap, 0, 0);
+    struct objcache * const second = heap_objcache_create(heap, 3 * sizeof(struct object), object_ctor, object_dtor);
+
+    pthread_t threads[2];
+    struct owner owners[2] = { { .cache = first, .id = 1 }, { .cache = second, .id = 2 } };
+    for (size_t t = 0; t < 2; ++t) pthread_create(&threads[t], NULL, own, &owners[t]);
+    for (size_t t = 0; t < 2; ++t) pthread_join(threads[t], NULL);
+
+    assert(destroyed >= STEPS / HELD / 2 * HELD / 2);
+    objcache_destroy(second);
+    objcache_destroy(first);
+    assert(destroyed == constructed);
+    assert(!heap->objcaches);
+    heap_destroy(heap);
+}
+
+int main() {
+    RUN_SINGLE_TEST(depot);
+    RUN_SINGLE_TEST(growth);
+    RUN_SINGLE_TEST(off);
+    RUN_SINGLE_TEST(threads);
+    RUN_SINGLE_TEST(two_caches);
+    return 0;
+}
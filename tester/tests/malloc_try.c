@@ -0,0 +1,68 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#define HEAP_SIZE 4096
+
+
+static int mmap_counter = 0;
+
+DEFINE_MMAP_IMPL(counting) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+
+    ++mmap_counter;
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+static size_t heap_size(struct block_header * heap) {
+    size_t size = 0;
+    for (struct block_header * block = heap; block; block = block->next) {
+        size += size_from_capacity(block->capacity).bytes;
+    }
+    return size;
+}
+
+// try-allocation never maps memory
+DEFINE_TEST(no_growth) {
+    current_mmap_impl = MMAP_IMPL(counting);
+
+    struct block_header * const heap = heap_init(HEAP_SIZE);
+    mmap_counter = 0;
+
+    void * const small = _malloc_try(HEAP_SIZE / 4);
+    assert(small);
+    assert(_malloc_try(4 * HEAP_SIZE) == NULL);
+    assert(mmap_counter == 0);
+
+    _free(small);
+    munmap(heap, heap_size(heap));
+}
+
+// reserve grows the heap once, after that try-allocation succeeds without mapping
+DEFINE_TEST(reserve) {
+    current_mmap_impl = MMAP_IMPL(counting);
+
+    struct block_header * const heap = heap_init(HEAP_SIZE);
+    mmap_counter = 0;
+
+    assert(_heap_reserve(HEAP_SIZE / 2));
+    assert(mmap_counter == 0);
+
+    assert(_heap_reserve(4 * HEAP_SIZE));
+    assert(mmap_counter == 1);
+    assert(_heap_reserve(4 * HEAP_SIZE));
+    assert(mmap_counter == 1);
+
+    void * const big = _malloc_try(4 * HEAP_SIZE);
+    assert(big);
+    assert(mmap_counter == 1);
+
+    _free(big);
+    munmap(heap, heap_size(heap));
+}
+
+int main() {
+    RUN_SINGLE_TEST(no_growth);
+    RUN_SINGLE_TEST(reserve);
+    return 0;
+}
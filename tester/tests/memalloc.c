@@ -35,7 +35,7 @@ DEFINE_TEST(memalloc_existing_big_query) {
     block2->is_free = false;
     block8->is_free = false;
 
-    struct block_header * const result = memalloc(BUFFER_SIZE / 2, block1);
+    struct block_header * const result = memalloc(&default_heap, BUFFER_SIZE / 2, block1);
 
     assert(result == block3);
 
@@ -88,7 +88,7 @@ DEFINE_TEST(memalloc_existing_small_query) {
     block1->is_free = false;
     block7->is_free = false;
 
-    struct block_header * const result = memalloc(10, block1);
+    struct block_header * const result = memalloc(&default_heap, 10, block1);
 
     assert(result == block2);
 
@@ -157,7 +157,7 @@ DEFINE_TEST(grow_heap_fail_big_query) {
     mmap_length = REGION_MIN_SIZE + getpagesize();
     test_mmap_counter = 0;
 
-    struct block_header * const result = memalloc(REGION_MIN_SIZE, block1);
+    struct block_header * const result = memalloc(&default_heap, REGION_MIN_SIZE, block1);
 
     assert(result == NULL);
     assert(test_mmap_counter == 2);
@@ -197,7 +197,7 @@ DEFINE_TEST(grow_heap_fail_small_query) {
     mmap_length = REGION_MIN_SIZE;
     test_mmap_counter = 0;
 
-    struct block_header * const result = memalloc(10, block);
+    struct block_header * const result = memalloc(&default_heap, 10, block);
 
     assert(result == NULL);
     assert(test_mmap_counter == 2);
@@ -252,7 +252,7 @@ DEFINE_TEST(grow_heap_success_big_query) {
     block7->is_free = false;
 
     test_mmap_counter = 0;
-    struct block_header * const result = memalloc(BUFFER_SIZE / 2, block1);
+    struct block_header * const result = memalloc(&default_heap, BUFFER_SIZE / 2, block1);
 
     assert(result == (void*) mmap_buffer);
     assert(test_mmap_counter == 2);
@@ -302,7 +302,7 @@ DEFINE_TEST(grow_heap_success_small_query) {
     mmap_length = REGION_MIN_SIZE;
     test_mmap_counter = 0;
 
-    struct block_header * const result = memalloc(10, block);
+    struct block_header * const result = memalloc(&default_heap, 10, block);
 
     assert(result == (void*) mmap_buffer);
     assert(test_mmap_counter == 2);
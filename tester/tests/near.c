@@ -0,0 +1,129 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define OBJECTS 64
+
+
+static _Alignas(4096) uint8_t buffer[64 * REGION_MIN_SIZE];
+
+DEFINE_MMAP_IMPL(passthrough) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+static const enum heap_fit fits[] = { HEAP_FIT_FIRST, HEAP_FIT_FIRST_INDEXED, HEAP_FIT_BEST, HEAP_FIT_NEXT };
+
+static struct heap * create(struct buffer_provider * bp, enum heap_fit fit) {
+    const struct heap_options options = { .provider = buffer_provider_init(bp, buffer, sizeof(buffer)), .fit = fit };
+    struct heap * const heap = heap_create(0, &options);
+    assert(heap);
+    return heap;
+}
+
+// the hole next to the neighbour is taken, not the first one that fits
+DEFINE_TEST(nearest_hole) {
+    for (size_t f = 0; f < sizeof(fits) / sizeof(*fits); ++f) {
+        struct buffer_provider bp;
+        struct heap * const heap = create(&bp, fits[f]);
+
+        uint8_t * objects[OBJECTS];
+        for (size_t i = 0; i < OBJECTS; ++i) objects[i] = heap_malloc(heap, 100);
+        heap_free(heap, objects[2]);
+        heap_free(heap, objects[40]);
+        heap_free(heap, objects[50]);
+
+        assert(heap_malloc_near(heap, 100, objects[41]) == objects[40]);
+        assert(heap_malloc_near(heap, 100, objects[48]) == objects[50]);
+
+        // the closest one may be before the neighbour too
+        assert(heap_malloc_near(heap, 50, objects[10]) == objects[2]);
+
+        heap_destroy(heap);
+    }
+}
+
+// no room in the neighbour's region, no neighbour or a slab object: normal placement
+DEFINE_TEST(fallback) {
+    for (size_t f = 0; f < sizeof(fits) / sizeof(*fits); ++f) {
+        struct buffer_provider bp;
+        struct heap * const heap = create(&bp, fits[f]);
+
+        uint8_t * const first = heap_malloc(heap, 100);
+        uint8_t * const second = heap_malloc(heap, 100);
+        heap_free(heap, first);
+        uint8_t * const placed = heap_malloc_near(heap, 100, NULL);
+        if (fits[f] == HEAP_FIT_NEXT) assert(placed > second);
+        else assert(placed == first);
+
+        uint8_t * const big = heap_malloc_near(heap, 8 * REGION_MIN_SIZE, second);
+        assert(big && heap_owns(heap, big));
+        heap_destroy(heap);
+    }
+}
+
+// the neighbour's lifetime sub-heap is searched
+DEFINE_TEST(sub_heap) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+    struct heap * const heap = heap_create(0, NULL);
+    void * const lasting = heap_malloc_hint(heap, 100, HINT_LONG_LIVED);
+    void * const near = heap_malloc_near(heap, 100, lasting);
+    assert(heap_owns(heap->lifetimes[1], near));
+    assert(block_get_header(lasting)->next == block_get_header(near));
+    heap_free(heap, near);
+    heap_free(heap, lasting);
+    heap_destroy(heap);
+}
+
+// objects of a group follow each other in its run, they are ordinary blocks
+DEFINE_TEST(group) {
+    for (size_t f = 0; f < sizeof(fits) / sizeof(*fits); ++f) {
+        struct buffer_provider bp;
+        struct heap * const heap = create(&bp, fits[f]);
+
+        // scattered holes the group's objects would land in otherwise
+        uint8_t * objects[OBJECTS];
+        for (size_t i = 0; i < OBJECTS; ++i) objects[i] = heap_malloc(heap, 100);
+        for (size_t i = 0; i < OBJECTS; i += 4) heap_free(heap, objects[i]);
+
+        struct heap_group group;
+        assert(heap_group_init(heap, &group, 10 * (64 + offsetof(struct block_header, contents))));
+        uint8_t * members[12];
+        for (size_t i = 0; i < 12; ++i) {
+            members[i] = heap_group_malloc(&group, 64);
+            assert(members[i]);
+            memset(members[i], (int) i, 64);
+        }
+
+        // the run holds ten of them, the rest go near the last one
+        for (size_t i = 1; i < 10; ++i) assert(members[i] == members[i - 1] + 64 + offsetof(struct block_header, contents));
+        assert(!group.rest);
+        assert(heap_usable_size(heap, members[9]) >= 64);
+
+        // an ordinary allocation doesn't take the reserved rest, once released first fit takes it
+        struct heap_group partial;
+        assert(heap_group_init(heap, &partial, 4096));
+        uint8_t * const member = heap_group_malloc(&partial, 100);
+        assert(heap_malloc(heap, 1000) != (void *) (member + 100 + offsetof(struct block_header, contents)));
+        heap_group_release(&partial);
+        void * const reused = heap_malloc(heap, 1000);
+        if (fits[f] == HEAP_FIT_FIRST || fits[f] == HEAP_FIT_FIRST_INDEXED) assert(reused == member + 100 + offsetof(struct block_header, contents));
+
+        for (size_t i = 0; i < 12; ++i) {
+            for (size_t j = 0; j < 64; ++j) assert(members[i][j] == (uint8_t) i);
+            heap_free(heap, members[i]);
+        }
+        heap_destroy(heap);
+    }
+}
+
+int main() {
+    RUN_SINGLE_TEST(nearest_hole);
+    RUN_SINGLE_TEST(fallback);
+    RUN_SINGLE_TEST(sub_heap);
+    RUN_SINGLE_TEST(group);
+    return 0;
+}
@@ -0,0 +1,119 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BUFFER_SIZE (4 * 1024 * 1024)
+#define SLOTS 256
+#define STEPS 20000
+
+
+static _Alignas(4096) uint8_t buffer[BUFFER_SIZE];
+
+static struct heap * create(struct buffer_provider * bp, size_t size) {
+    const struct heap_options options = { .provider = buffer_provider_init(bp, buffer, size), .fit = HEAP_FIT_NEXT };
+    struct heap * const heap = heap_create(0, &options);
+    assert(heap);
+    return heap;
+}
+
+// a hole behind the rover waits until the search wraps around
+DEFINE_TEST(resume_and_wrap) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, REGION_MIN_SIZE);
+
+    void * const first = heap_malloc(heap, 64);
+    void * const second = heap_malloc(heap, 64);
+    heap_free(heap, first);
+
+    // first fit would take the hole
+    uint8_t * const third = heap_malloc(heap, 64);
+    assert(third != first);
+    assert(block_get_header(third) == block_get_header(second)->next);
+
+    // the hole is taken only when the rest is full, the heap can't grow in its buffer
+    for (void * taken = heap_malloc_try(heap, 64); taken != first; taken = heap_malloc_try(heap, 64)) assert(taken);
+    assert(heap_malloc(heap, 64) == NULL);
+
+    heap_destroy(heap);
+}
+
+// the rover follows its block when a block before it absorbs it
+DEFINE_TEST(merged_rover) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, BUFFER_SIZE);
+
+    void * const first = heap_malloc(heap, 64);
+    void * const second = heap_malloc(heap, 64);
+    assert(heap->rover == block_get_header(second));
+
+    heap_free(heap, second);
+    heap_free(heap, first);
+    assert(heap->rover == block_get_header(first));
+
+    // the merged block fits a bigger query
+    assert(heap_malloc(heap, 150) == first);
+
+    heap_destroy(heap);
+}
+
+// the wrapped search doesn't merge the rover away, so the heap grows from its real last block
+DEFINE_TEST(wrap_keeps_last) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, BUFFER_SIZE);
+
+    void * const first = heap_malloc(heap, 64);
+    void * const second = heap_malloc(heap, 64);
+    void * const rest = heap_malloc(heap, block_get_header(second)->next->capacity.bytes);
+    heap_free(heap, rest);
+    heap_free(heap, first);
+    heap_free(heap, second);
+    assert(heap->rover == block_get_header(second));
+
+    // the tail from the rover is too small, the head is too, the last block grows
+    assert(heap_malloc(heap, 2 * REGION_MIN_SIZE) == second);
+    assert(block_get_header(first)->next == block_get_header(second));
+    assert(block_get_header(first)->is_free);
+
+    heap_destroy(heap);
+}
+
+static bool in_chain(struct heap * heap, struct block_header const * block) {
+    for (struct block_header * b = heap->start; b; b = b->next) if (b == block) return true;
+    return false;
+}
+
+// random trace: contents survive, the rover is always a block of the chain
+DEFINE_TEST(random) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, BUFFER_SIZE);
+    srand(38);
+
+    static uint8_t * slots[SLOTS];
+    static size_t sizes[SLOTS];
+    for (size_t step = 0; step < STEPS; ++step) {
+        const size_t i = rand() % SLOTS;
+        if (slots[i]) {
+            for (size_t j = 0; j < sizes[i]; ++j) assert(slots[i][j] == (uint8_t) i);
+            heap_free(heap, slots[i]);
+            slots[i] = NULL;
+        } else {
+            sizes[i] = 1 + rand() % 2000;
+            slots[i] = rand() % 4 ? heap_malloc(heap, sizes[i]) : heap_malloc_try(heap, sizes[i]);
+            if (slots[i]) memset(slots[i], (int) i, sizes[i]);
+        }
+        assert(heap->rover == NULL || in_chain(heap, heap->rover));
+    }
+
+    heap_destroy(heap);
+}
+
+int main() {
+    RUN_SINGLE_TEST(resume_and_wrap);
+    RUN_SINGLE_TEST(merged_rover);
+    RUN_SINGLE_TEST(wrap_keeps_last);
+    RUN_SINGLE_TEST(random);
+    return 0;
+}
@@ -0,0 +1,182 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OBJECTS 100
+
+
+DEFINE_MMAP_IMPL(passthrough) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+// an object with a buffer of its own, as if it held a mutex and a preallocated scratch area
+struct connection {
+    uint64_t state;
+    uint8_t * scratch;
+    uint8_t id[20];
+};
+
+static size_t constructed;
+static size_t destroyed;
+static bool refuse;
+
+static bool connection_ctor(void * object) {
+    if (refuse) return false;
+    struct connection * const connection = object;
+    connection->state = 0xC0FFEE;
+    connection->scratch = malloc(256);
+    ++constructed;
+    return true;
+}
+
+static void connection_dtor(void * object) {
+    struct connection * const connection = object;
+    assert(connection->state == 0xC0FFEE);
+    free(connection->scratch);
+    ++destroyed;
+}
+
+static struct heap * create(bool slabs) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+    constructed = destroyed = 0;
+    refuse = false;
+    const struct heap_options options = { .slabs = slabs };
+    struct heap * const heap = heap_create(0, &options);
+    assert(heap);
+    return heap;
+}
+
+// a freed object comes back constructed, as it was left, without the constructor
+DEFINE_TEST(reuse) {
+    struct heap * const heap = create(false);
+    struct objcache * const cache = heap_objcache_create(heap, sizeof(struct connection), connection_ctor, connection_dtor);
+    assert(cache);
+
+    struct connection * const first = objcache_alloc(cache);
+    assert(first && first->state == 0xC0FFEE && first->scratch);
+    memset(first->id, 7, sizeof(first->id));
+    uint8_t * const scratch = first->scratch;
+    objcache_free(cache, first);
+
+    struct connection * const again = objcache_alloc(cache);
+    assert(again == first && again->scratch == scratch && again->id[19] == 7);
+    assert(constructed == 1 && destroyed == 0);
+
+    // the cache is empty, a fresh one is constructed
+    struct connection * const second = objcache_alloc(cache);
+    assert(second != first && constructed == 2);
+
+    objcache_free(cache, again);
+    objcache_free(cache, second);
+    objcache_destroy(cache);
+    assert(destroyed == 2);
+    assert(!heap->objcaches);
+    heap_destroy(heap);
+}
+
+// trim destroys only what wasn't needed since the previous trim
+DEFINE_TEST(reap_on_trim) {
+    struct heap * const heap = create(false);
+    struct objcache * const cache = heap_objcache_create(heap, sizeof(struct connection), connection_ctor, connection_dtor);
+
+    void * objects[OBJECTS];
+    for (size_t i = 0; i < OBJECTS; ++i) objects[i] = objcache_alloc(cache);
+    for (size_t i = 0; i < OBJECTS; ++i) objcache_free(cache, objects[i]);
+    assert(cache->cached_count == OBJECTS);
+
+    // the first reap sets the working set up, nothing stayed cached all along before it
+    heap_trim(heap);
+    assert(destroyed == 0);
+
+    // 30 of them were in use between the trims, the other 70 are surplus
+    for (size_t i = 0; i < 30; ++i) objects[i] = objcache_alloc(cache);
+    for (size_t i = 0; i < 30; ++i) objcache_free(cache, objects[i]);
+    heap_trim(heap);
+    assert(destroyed == OBJECTS - 30);
+    assert(cache->cached_count == 30);
+    assert(constructed == OBJECTS);
+
+    // an idle period reaps the rest
+    assert(objcache_reap(cache) == 30);
+    assert(destroyed == OBJECTS && cache->cached_count == 0);
+    heap_destroy(heap);
+}
+
+// small objects come from slabs, destroying the heap runs the destructors of the cached ones
+DEFINE_TEST(slabs_and_destroy) {
+    struct heap * const heap = create(true);
+    struct objcache * const small = heap_objcache_create(heap, 24, NULL, connection_dtor);
+    struct objcache * const big = heap_objcache_create(heap, sizeof(struct connection), connection_ctor, connection_dtor);
+
+    struct connection * const object = objcache_alloc(small);
+    assert(slab_find(heap, object));
+    object->state = 0xC0FFEE;
+    object->scratch = NULL;
+    objcache_free(small, object);
+    objcache_free(big, objcache_alloc(big));
+
+    heap_destroy(heap);
+    assert(destroyed == 2);
+}
+
+// a failed constructor fails the allocation and leaves nothing behind
+DEFINE_TEST(ctor_fails) {
+    struct heap * const heap = create(false);
+    struct objcache * const cache = heap_objcache_create(heap, sizeof(struct connection), connection_ctor, connection_dtor);
+    refuse = true;
+    assert(!objcache_alloc(cache));
+    assert(cache->cached_count == 0 && constructed == 0);
+    refuse = false;
+    objcache_free(cache, objcache_alloc(cache));
+    objcache_destroy(cache);
+    heap_destroy(heap);
+}
+
+// objects are aligned for any type, whatever the size and wherever they come from
+DEFINE_TEST(aligned) {
+    static const size_t sizes[] = { 1, 8, 17, 24, 40, 64, 100, sizeof(struct connection), 1000 };
+    for (int slabs = 0; slabs < 2; ++slabs) {
+        struct heap * const heap = create(slabs);
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i) {
+            struct objcache * const cache = heap_objcache_create(heap, sizes[i], NULL, NULL);
+            void * objects[4];
+            for (size_t j = 0; j < 4; ++j) {
+                objects[j] = objcache_alloc(cache);
+                assert((uintptr_t) objects[j] % alignof(max_align_t) == 0);
+            }
+            for (size_t j = 0; j < 4; ++j) objcache_free(cache, objects[j]);
+        }
+        heap_destroy(heap);
+    }
+}
+
+// the default heap has caches too
+DEFINE_TEST(default_heap) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+    constructed = destroyed = 0;
+    assert(heap_init(0));
+    struct objcache * const cache = _objcache_create(sizeof(struct connection), connection_ctor, connection_dtor);
+    void * const object = objcache_alloc(cache);
+    assert(object && _heap_owns(object));
+    objcache_free(cache, object);
+    _heap_trim();
+    _heap_trim();
+    assert(destroyed == 1);
+    _heap_destroy();
+    assert(!default_heap.objcaches);
+}
+
+int main() {
+    RUN_SINGLE_TEST(reuse);
+    RUN_SINGLE_TEST(reap_on_trim);
+    RUN_SINGLE_TEST(slabs_and_destroy);
+    RUN_SINGLE_TEST(ctor_fails);
+    RUN_SINGLE_TEST(aligned);
+    RUN_SINGLE_TEST(default_heap);
+    return 0;
+}
@@ -0,0 +1,126 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include "offset_heap.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_SIZE (64 * REGION_MIN_SIZE)
+#define NODES 1000
+
+
+struct node {
+    uint64_t next;
+    uint64_t value;
+    uint8_t payload[40];
+};
+
+static int open_temp(void) {
+    char path[] = "/tmp/offset_heap_XXXXXX";
+    const int fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+    return fd;
+}
+
+// build list of NODES nodes (bigger than the initial file), keep it as the root
+static void fill(struct offset_heap * heap) {
+    uint64_t head = 0;
+    for (uint64_t i = 0; i < NODES; ++i) {
+        struct node * const node = offset_heap_malloc(heap, sizeof(struct node));
+        assert(node);
+        node->next = head;
+        node->value = i;
+        head = offset_heap_offset(heap, node);
+    }
+    offset_heap_set_root(heap, offset_heap_pointer(heap, head));
+}
+
+static void verify(struct offset_heap * heap) {
+    uint64_t expected = NODES;
+    for (struct node * node = offset_heap_root(heap); node; node = offset_heap_pointer(heap, node->next)) {
+        assert(node->value == --expected);
+    }
+    assert(expected == 0);
+}
+
+// heap survives detach and attaches at another address
+DEFINE_TEST(warm_restart) {
+    const int fd = open_temp();
+
+    struct offset_heap heap;
+    assert(offset_heap_attach(&heap, fd, MAX_SIZE) == OFFSET_HEAP_CREATED);
+    fill(&heap);
+    assert(offset_heap_check(&heap));
+    uint8_t * const old_base = heap.base;
+    offset_heap_detach(&heap);
+
+    // occupy the old address, so the heap has to move
+    void * const blocker = mmap(old_base, MAX_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    assert(blocker == old_base);
+
+    assert(offset_heap_attach(&heap, fd, MAX_SIZE) == OFFSET_HEAP_CLEAN);
+    assert(heap.base != old_base);
+    assert(offset_heap_check(&heap));
+    verify(&heap);
+
+    // chain is fully usable: free everything and allocate again
+    for (struct node * node = offset_heap_root(&heap); node; ) {
+        struct node * const next = offset_heap_pointer(&heap, node->next);
+        offset_heap_free(&heap, node);
+        node = next;
+    }
+    offset_heap_set_root(&heap, NULL);
+    assert(offset_heap_check(&heap));
+    assert(offset_heap_malloc(&heap, MAX_SIZE / 2));
+
+    offset_heap_detach(&heap);
+    munmap(blocker, MAX_SIZE);
+    close(fd);
+}
+
+// heap which was not detached is reported unclean, the chain is still validated
+DEFINE_TEST(crash) {
+    const int fd = open_temp();
+
+    struct offset_heap heap;
+    assert(offset_heap_attach(&heap, fd, MAX_SIZE) == OFFSET_HEAP_CREATED);
+    fill(&heap);
+    munmap(heap.base, heap.reserved); // "crash"
+
+    assert(offset_heap_attach(&heap, fd, MAX_SIZE) == OFFSET_HEAP_UNCLEAN);
+    assert(offset_heap_check(&heap));
+    verify(&heap);
+
+    // torn link is detected
+    struct node * const root = offset_heap_root(&heap);
+    uint64_t * const link = (uint64_t *) ((uint8_t *) root - offsetof(struct block_header, contents));
+    const uint64_t saved = *link;
+    *link += 8;
+    assert(!offset_heap_check(&heap));
+    *link = saved;
+    assert(offset_heap_check(&heap));
+
+    offset_heap_detach(&heap);
+    close(fd);
+}
+
+// garbage is not attached
+DEFINE_TEST(not_a_heap) {
+    const int fd = open_temp();
+    assert(write(fd, "definitely not a heap, just some text in the file....", 53) == 53);
+
+    struct offset_heap heap;
+    assert(offset_heap_attach(&heap, fd, MAX_SIZE) == OFFSET_HEAP_FAILED);
+    close(fd);
+}
+
+int main() {
+    RUN_SINGLE_TEST(warm_restart);
+    RUN_SINGLE_TEST(crash);
+    RUN_SINGLE_TEST(not_a_heap);
+    return 0;
+}
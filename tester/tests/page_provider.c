@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#define BUFFER_SIZE (8 * REGION_MIN_SIZE)
+
+
+static _Alignas(4096) uint8_t buffer[BUFFER_SIZE];
+
+// heap lives entirely in the caller-supplied buffer
+DEFINE_TEST(buffer) {
+    struct buffer_provider bp;
+    const struct heap_options options = { .provider = buffer_provider_init(&bp, buffer, BUFFER_SIZE) };
+
+    struct heap * const heap = heap_create(0, &options);
+    assert((void*) heap == buffer);
+    assert(bp.used == REGION_MIN_SIZE);
+
+    // growth continues right after the first region
+    uint8_t * const big = heap_malloc(heap, 2 * REGION_MIN_SIZE);
+    assert(block_get_header(big) == heap->start);
+    assert(heap->start->next->is_free);
+    assert(bp.used == REGION_MIN_SIZE + 2 * REGION_MIN_SIZE + (size_t) getpagesize());
+
+    // nothing beyond the buffer
+    assert(heap_malloc(heap, BUFFER_SIZE) == NULL);
+
+    heap_free(heap, big);
+    heap_destroy(heap);
+    assert(bp.used == 0);
+}
+
+struct counting_provider {
+    struct page_provider provider;
+    int map_calls;
+    int map_at_calls;
+    int unmap_calls;
+};
+
+static void * counting_map(struct page_provider * self, void const * addr, size_t length, int flags) {
+    ++((struct counting_provider *) self)->map_calls;
+    return page_provider_anonymous.map(&page_provider_anonymous, addr, length, flags);
+}
+
+static void * counting_map_at(struct page_provider * self, void const * addr, size_t length, int flags) {
+    ++((struct counting_provider *) self)->map_at_calls;
+    return page_provider_anonymous.map_at(&page_provider_anonymous, addr, length, flags);
+}
+
+static int counting_unmap(struct page_provider * self, void * addr, size_t length) {
+    ++((struct counting_provider *) self)->unmap_calls;
+    return page_provider_anonymous.unmap(&page_provider_anonymous, addr, length);
+}
+
+DEFINE_MMAP_IMPL(passthrough) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+// injected provider gets every mapping of the heap
+DEFINE_TEST(injected) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+
+    struct counting_provider cp = {
+        .provider = { counting_map, counting_map_at, counting_unmap, page_provider_anonymous.advise },
+    };
+    const struct heap_options options = { .provider = &cp.provider };
+
+    struct heap * const heap = heap_create(0, &options);
+    assert(heap);
+    assert(cp.map_calls == 1);
+    assert(cp.map_at_calls == 0);
+
+    void * const big = heap_malloc(heap, 4 * REGION_MIN_SIZE);
+    assert(big);
+    assert(cp.map_at_calls == 1);
+
+    heap_free(heap, big);
+    heap_destroy(heap);
+    assert(cp.unmap_calls >= 1);
+}
+
+// heap over memfd writes through to the file
+DEFINE_TEST(memfd) {
+    const int fd = memfd_create("heap", 0);
+    assert(fd >= 0);
+
+    struct fd_provider fp;
+    const struct heap_options options = { .provider = fd_provider_init(&fp, fd) };
+
+    struct heap * const heap = heap_create(0, &options);
+    assert(heap);
+    assert(fp.size == REGION_MIN_SIZE);
+
+    char * const text = heap_malloc(heap, 16);
+    strcpy(text, "shared");
+
+    char read_back[16] = { 0 };
+    assert(pread(fd, read_back, sizeof(read_back), (uint8_t*) text - (uint8_t*) heap) == sizeof(read_back));
+    assert(strcmp(read_back, "shared") == 0);
+
+    heap_free(heap, text);
+    heap_destroy(heap);
+    close(fd);
+}
+
+int main() {
+    RUN_SINGLE_TEST(buffer);
+    RUN_SINGLE_TEST(injected);
+    RUN_SINGLE_TEST(memfd);
+    return 0;
+}
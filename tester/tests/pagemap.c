@@ -0,0 +1,129 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BUFFER_SIZE (4 * 1024 * 1024)
+#define SLOTS 256
+#define STEPS 20000
+
+
+static _Alignas(4096) uint8_t buffer[BUFFER_SIZE];
+static _Alignas(4096) uint8_t foreign[4096];
+
+DEFINE_MMAP_IMPL(passthrough) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+// the page map is mapped anonymously
+static struct heap * create(struct buffer_provider * bp, bool pagemap, bool slabs) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+    const struct heap_options options = { .provider = buffer_provider_init(bp, buffer, BUFFER_SIZE), .pagemap = pagemap, .slabs = slabs };
+    struct heap * const heap = heap_create(0, &options);
+    assert(heap);
+    return heap;
+}
+
+// ownership is the same with and without the map
+DEFINE_TEST(owns) {
+    for (int pagemap = 0; pagemap < 2; ++pagemap) {
+        struct buffer_provider bp;
+        struct heap * const heap = create(&bp, pagemap, false);
+
+        uint8_t * const mem = heap_malloc(heap, 100);
+        assert(heap_owns(heap, mem));
+        assert(heap_owns(heap, mem + 99));
+        assert(heap_owns(heap, heap));
+        assert(!heap_owns(heap, foreign));
+        assert(!heap_owns(heap, NULL));
+        assert(!heap_owns(heap, buffer + BUFFER_SIZE - 1));
+
+        // a freed block is still the heap's memory
+        heap_free(heap, mem);
+        assert(heap_owns(heap, mem));
+
+        heap_destroy(heap);
+    }
+}
+
+// trimmed pages are forgotten
+DEFINE_TEST(trim) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, true, false);
+
+    uint8_t * const big = heap_malloc(heap, 4 * REGION_MIN_SIZE);
+    uint8_t * const end = big + 4 * REGION_MIN_SIZE;
+    assert(heap_owns(heap, end - 1));
+    heap_free(heap, big);
+    heap_trim(heap);
+    assert(!heap_owns(heap, end - 1));
+    assert(heap_owns(heap, big));
+
+    // the heap grows over the same pages again
+    assert(heap_malloc(heap, 4 * REGION_MIN_SIZE) == big);
+    assert(heap_owns(heap, end - 1));
+
+    heap_destroy(heap);
+}
+
+// slab pages point to their slabs, usable size comes from there
+DEFINE_TEST(usable_size) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, false, true);
+
+    void * const small = heap_malloc(heap, 13);
+    assert(slab_find(heap, small));
+    assert(heap_usable_size(heap, small) == 16);
+    assert(heap_owns(heap, small));
+
+    void * const block = heap_malloc(heap, 100);
+    assert(!slab_find(heap, block));
+    assert(heap_usable_size(heap, block) == 100);
+    assert(heap_usable_size(heap, NULL) == 0);
+
+    heap_free(heap, small);
+    heap_free(heap, block);
+    heap_destroy(heap);
+}
+
+// random trace: every live pointer is owned, slab objects are found by the map
+DEFINE_TEST(random) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, true, true);
+    srand(41);
+
+    static uint8_t * slots[SLOTS];
+    static size_t sizes[SLOTS];
+    for (size_t step = 0; step < STEPS; ++step) {
+        const size_t i = rand() % SLOTS;
+        if (slots[i]) {
+            assert(heap_owns(heap, slots[i]));
+            assert(heap_usable_size(heap, slots[i]) >= sizes[i]);
+            assert((slab_find(heap, slots[i]) != NULL) == (sizes[i] <= SLAB_MAX_OBJECT));
+            for (size_t j = 0; j < sizes[i]; ++j) assert(slots[i][j] == (uint8_t) i);
+            heap_free(heap, slots[i]);
+            slots[i] = NULL;
+        } else {
+            sizes[i] = rand() % 2 ? 1 + rand() % 64 : 1 + rand() % 4000;
+            slots[i] = heap_malloc(heap, sizes[i]);
+            if (slots[i]) memset(slots[i], (int) i, sizes[i]);
+        }
+    }
+
+    for (size_t i = 0; i < SLOTS; ++i) {
+        heap_free(heap, slots[i]);
+        slots[i] = NULL;
+    }
+    heap_destroy(heap);
+}
+
+int main() {
+    RUN_SINGLE_TEST(owns);
+    RUN_SINGLE_TEST(trim);
+    RUN_SINGLE_TEST(usable_size);
+    RUN_SINGLE_TEST(random);
+    return 0;
+}
@@ -0,0 +1,77 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#define HEAP_SIZE (4 * 4096)
+
+
+static int mmap_counter = 0;
+
+DEFINE_MMAP_IMPL(populate) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+    assert(flags & MAP_POPULATE);
+
+    ++mmap_counter;
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+static bool is_resident(void * addr, size_t length) {
+    unsigned char vec[length / getpagesize()];
+    assert(mincore(addr, length, vec) == 0);
+    for (size_t i = 0; i < sizeof(vec); ++i) {
+        if (!(vec[i] & 1)) return false;
+    }
+    return true;
+}
+
+// pinned heap is prefaulted and locked on init
+DEFINE_TEST(init) {
+    current_mmap_impl = MMAP_IMPL(populate);
+    mmap_counter = 0;
+
+    const struct heap_options options = { .pinned = true, .locked = true };
+    struct block_header * const heap = heap_init_with(HEAP_SIZE, &options);
+
+    assert(heap == HEAP_START);
+    assert(mmap_counter == 1);
+    assert(is_resident(heap, size_from_capacity(heap->capacity).bytes));
+    assert(_heap_pinned_left() == heap->capacity.bytes);
+
+    munmap(heap, size_from_capacity(heap->capacity).bytes);
+}
+
+// pinned heap serves from its capacity and never grows
+DEFINE_TEST(exhaust) {
+    current_mmap_impl = MMAP_IMPL(populate);
+
+    const struct heap_options options = { .pinned = true };
+    struct block_header * const heap = heap_init_with(HEAP_SIZE, &options);
+    const size_t heap_size = size_from_capacity(heap->capacity).bytes;
+    const size_t initial_left = _heap_pinned_left();
+    mmap_counter = 0;
+
+    void * const first = _malloc(HEAP_SIZE / 2);
+    assert(first);
+    assert(_heap_pinned_left() == initial_left - HEAP_SIZE / 2 - offsetof(struct block_header, contents));
+
+    assert(_malloc(HEAP_SIZE) == NULL);
+    assert(mmap_counter == 0);
+
+    _free(first);
+    assert(_heap_pinned_left() == initial_left);
+
+    // purge and trim would bring the faults back
+    _heap_purge();
+    _heap_trim();
+    assert(heap->next == NULL);
+    assert(size_from_capacity(heap->capacity).bytes == heap_size);
+    assert(is_resident(heap, heap_size));
+
+    munmap(heap, heap_size);
+}
+
+int main() {
+    RUN_SINGLE_TEST(init);
+    RUN_SINGLE_TEST(exhaust);
+    return 0;
+}
@@ -0,0 +1,68 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#define REGIONS 10
+#define QUERY (REGION_MIN_SIZE / 2 + 1000)
+
+
+DEFINE_MMAP_IMPL(passthrough) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+static void * map_at_failed(struct page_provider * self, void const * addr, size_t length, int flags) {
+    (void) self; (void) addr; (void) length; (void) flags;
+    return MAP_FAILED;
+}
+
+// without the hint the kernel never puts a region right after the tail
+static void * map_anywhere(struct page_provider * self, void const * addr, size_t length, int flags) {
+    (void) addr;
+    return page_provider_anonymous.map(self, NULL, length, flags);
+}
+
+// regions without a big enough free block are jumped over, freeing brings them back
+DEFINE_TEST(skip) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+
+    struct page_provider scattered = page_provider_anonymous;
+    scattered.map = map_anywhere;
+    scattered.map_at = map_at_failed;
+    const struct heap_options options = { .provider = &scattered };
+
+    // every block takes a region of its own, less than QUERY stays free in each
+    struct heap * const heap = heap_create(0, &options);
+    assert(heap_malloc(heap, QUERY));
+    struct block_header * blocks[REGIONS];
+    for (size_t i = 0; i < REGIONS; ++i) {
+        blocks[i] = block_get_header(heap_malloc(heap, REGION_MIN_SIZE));
+        assert(blocks[i]->next->capacity.bytes < QUERY);
+    }
+
+    // a failed scan makes the bounds exact
+    assert(find_good_or_last_in(heap, heap->start, QUERY).type == BSR_REACHED_END_NOT_FOUND);
+    for (size_t i = 0; i < REGIONS; ++i) {
+        struct region_desc const * const region = region_find(heap, blocks[i]);
+        assert(region->max_free == blocks[i]->next->capacity.bytes);
+    }
+
+    // released behind the heap's back: the bound doesn't know, so the region is skipped
+    blocks[3]->is_free = true;
+    void * const grown = heap_malloc(heap, QUERY);
+    assert(block_get_header(grown) != blocks[3]);
+    assert(region_find(heap, grown) != region_find(heap, blocks[3]));
+    blocks[3]->is_free = false;
+
+    // released properly: found again, exactly where first fit puts it
+    heap_free(heap, blocks[5]->contents);
+    assert(find_good_or_last_in(heap, heap->start, QUERY).block == blocks[5]);
+    assert(heap_malloc(heap, QUERY) == blocks[5]->contents);
+
+    heap_destroy(heap);
+}
+
+int main() {
+    RUN_SINGLE_TEST(skip);
+    return 0;
+}
@@ -0,0 +1,164 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include <errno.h>
+
+#define REGIONS (2 * REGION_TABLE_INLINE + 8)
+
+
+DEFINE_MMAP_IMPL(passthrough) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+static bool is_mapped(void * addr, size_t length) {
+    return msync(addr, length, MS_ASYNC) == 0 || errno != ENOMEM;
+}
+
+static size_t region_total(struct heap * heap, size_t (*field)(struct heap_region_stats const *)) {
+    struct heap_region_stats stats[REGIONS + 1];
+    const size_t count = heap_regions(heap, stats, REGIONS + 1);
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i) total += field(stats + i);
+    return total;
+}
+
+static size_t live_of(struct heap_region_stats const * stats) { return stats->live; }
+
+static _Alignas(4096) uint8_t buffer[8 * REGION_MIN_SIZE];
+
+// live and free bytes follow allocations, growth at the end extends the same region
+DEFINE_TEST(stats) {
+    struct buffer_provider bp;
+    const struct heap_options options = { .provider = buffer_provider_init(&bp, buffer, sizeof(buffer)) };
+
+    struct heap * const heap = heap_create(0, &options);
+    struct heap_region_stats stats[2];
+    assert(heap_regions(heap, stats, 2) == 1);
+    assert(stats[0].addr == heap);
+    assert(stats[0].live == 0);
+    assert(stats[0].free == stats[0].size - heap_handle_size());
+
+    void * const small = heap_malloc(heap, 100);
+    void * const big = heap_malloc(heap, 4 * REGION_MIN_SIZE);
+    assert(heap_regions(heap, stats, 2) == 1);
+    assert(stats[0].live == 100 + 4 * REGION_MIN_SIZE + 2 * offsetof(struct block_header, contents));
+    assert(stats[0].live + stats[0].free + heap_handle_size() == stats[0].size);
+    assert(region_find(heap, big) == region_find(heap, small));
+
+    heap_free(heap, big);
+    heap_free(heap, big); // double free changes nothing
+    heap_free(heap, small);
+    assert(heap_regions(heap, stats, 2) == 1);
+    assert(stats[0].live == 0);
+
+    // trim gives the tail back and shrinks the region
+    const size_t size = stats[0].size;
+    heap_trim(heap);
+    assert(heap_regions(heap, stats, 2) == 1);
+    assert(stats[0].size < size);
+    assert(stats[0].free + heap_handle_size() == stats[0].size);
+
+    heap_destroy(heap);
+    assert(bp.used == 0);
+}
+
+static void * map_at_failed(struct page_provider * self, void const * addr, size_t length, int flags) {
+    (void) self; (void) addr; (void) length; (void) flags;
+    return MAP_FAILED;
+}
+
+// every growth lands in a region of its own, the table overflows its inline array
+DEFINE_TEST(many_regions) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+
+    struct page_provider scattered = page_provider_anonymous;
+    scattered.map_at = map_at_failed;
+    const struct heap_options options = { .provider = &scattered };
+
+    struct heap * const heap = heap_create(0, &options);
+    void * blocks[REGIONS];
+    for (size_t i = 0; i < REGIONS; ++i) {
+        blocks[i] = heap_malloc(heap, REGION_MIN_SIZE);
+        assert(blocks[i]);
+    }
+    assert(heap->regions.overflow);
+
+    struct heap_region_stats stats[REGIONS + 1];
+    assert(heap_regions(heap, stats, REGIONS + 1) == REGIONS + 1);
+    for (size_t i = 1; i <= REGIONS; ++i) assert((uint8_t *) stats[i - 1].addr < (uint8_t *) stats[i].addr);
+    assert(region_total(heap, live_of) == REGIONS * size_from_capacity((block_capacity) { REGION_MIN_SIZE }).bytes);
+
+    for (size_t i = 0; i < REGIONS; ++i) {
+        struct region_desc const * const region = region_find(heap, blocks[i]);
+        assert(region);
+        assert(region->addr <= (uint8_t *) blocks[i] && (uint8_t *) blocks[i] < region->addr + region->size);
+    }
+    assert(region_find(heap, (uint8_t *) stats[REGIONS].addr + stats[REGIONS].size) == NULL);
+
+    heap_destroy(heap);
+    for (size_t i = 0; i <= REGIONS; ++i) assert(!is_mapped(stats[i].addr, stats[i].size));
+}
+
+// trim unmaps regions without live blocks in the middle of the chain, every policy keeps working
+DEFINE_TEST(release_empty) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+
+    struct page_provider scattered = page_provider_anonymous;
+    scattered.map_at = map_at_failed;
+    static const enum heap_fit fits[] = { HEAP_FIT_FIRST, HEAP_FIT_FIRST_INDEXED, HEAP_FIT_BEST, HEAP_FIT_NEXT };
+    for (size_t f = 0; f < sizeof(fits) / sizeof(*fits); ++f) {
+        const struct heap_options options = { .provider = &scattered, .fit = fits[f] };
+        struct heap * const heap = heap_create(0, &options);
+
+        void * blocks[8];
+        for (size_t i = 0; i < 8; ++i) assert(blocks[i] = heap_malloc(heap, REGION_MIN_SIZE));
+        struct heap_region_stats stats[9];
+        assert(heap_regions(heap, stats, 9) == 9);
+
+        // every other region empties, the last one too
+        for (size_t i = 1; i < 8; i += 2) heap_free(heap, blocks[i]);
+        heap_trim(heap);
+        assert(heap_regions(heap, NULL, 0) == 5);
+        for (size_t i = 0; i < 8; ++i) assert((region_find(heap, blocks[i]) != NULL) == (i % 2 == 0));
+        for (size_t i = 1; i < 8; i += 2) assert(!is_mapped(block_get_header(blocks[i]), REGION_MIN_SIZE));
+
+        // the chain goes around the holes
+        for (size_t i = 1; i < 8; i += 2) assert(blocks[i] = heap_malloc(heap, REGION_MIN_SIZE));
+        for (size_t i = 0; i < 8; ++i) heap_free(heap, blocks[i]);
+        heap_trim(heap);
+        assert(heap_regions(heap, NULL, 0) == 1);
+        assert(heap_malloc(heap, 100));
+
+        heap_destroy(heap);
+    }
+}
+
+// region unmapped behind the heap's back is replaced, not duplicated
+DEFINE_TEST(stale) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+
+    struct block_header * const first = heap_init(0);
+    assert(_malloc(4 * REGION_MIN_SIZE));
+    struct heap_region_stats stats[2];
+    assert(_heap_regions(stats, 2) == 1);
+    munmap(first, stats[0].size);
+
+    assert(heap_init(0) == first);
+    assert(_heap_regions(stats, 2) == 1);
+    assert(stats[0].size == REGION_MIN_SIZE);
+    assert(stats[0].live == 0);
+
+    _heap_destroy();
+    assert(_heap_regions(stats, 2) == 0);
+    assert(!is_mapped(first, REGION_MIN_SIZE));
+}
+
+int main() {
+    RUN_SINGLE_TEST(stats);
+    RUN_SINGLE_TEST(many_regions);
+    RUN_SINGLE_TEST(release_empty);
+    RUN_SINGLE_TEST(stale);
+    return 0;
+}
@@ -0,0 +1,146 @@
+#define _GNU_SOURCE
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include "offset_heap.h"
+
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_SIZE (64 * REGION_MIN_SIZE)
+
+
+static void wait_child(pid_t pid) {
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// child attaches the heap at another address, reads parent's block and answers with its own
+DEFINE_TEST(fork_exchange) {
+    struct offset_heap heap;
+    assert(offset_heap_create_shared(&heap, "shared_heap", MAX_SIZE) == OFFSET_HEAP_CREATED);
+
+    char * const message = offset_heap_malloc(&heap, 32);
+    strcpy(message, "from parent");
+    const uint64_t message_offset = offset_heap_offset(&heap, message);
+
+    int channel[2];
+    assert(pipe(channel) == 0);
+
+    const pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        // inherited mapping is dropped, the heap is reached through the descriptor only
+        munmap(heap.base, heap.reserved);
+        void * const blocker = mmap(heap.base, heap.reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        if (blocker != heap.base) _exit(1);
+
+        struct offset_heap child;
+        if (offset_heap_attach_shared(&child, heap.fd, MAX_SIZE) != OFFSET_HEAP_JOINED) _exit(2);
+        if (child.base == heap.base) _exit(3);
+
+        char * const received = offset_heap_pointer(&child, message_offset);
+        if (strcmp(received, "from parent") != 0) _exit(4);
+        offset_heap_free(&child, received);
+
+        // bigger than the file, the parent has to map the growth
+        char * const reply = offset_heap_malloc(&child, 4 * REGION_MIN_SIZE);
+        if (!reply) _exit(5);
+        strcpy(reply, "from child");
+        const uint64_t reply_offset = offset_heap_offset(&child, reply);
+        if (write(channel[1], &reply_offset, sizeof(reply_offset)) != sizeof(reply_offset)) _exit(6);
+
+        offset_heap_detach(&child);
+        _exit(0);
+    }
+
+    uint64_t reply_offset;
+    assert(read(channel[0], &reply_offset, sizeof(reply_offset)) == sizeof(reply_offset));
+    wait_child(pid);
+
+    // freed message is the start of the reply, its tail lies in the growth
+    assert(reply_offset == message_offset);
+    assert(reply_offset + 4 * REGION_MIN_SIZE > heap.mapped);
+    assert(offset_heap_refresh(&heap));
+    assert(reply_offset + 4 * REGION_MIN_SIZE <= heap.mapped);
+    assert(strcmp(offset_heap_pointer(&heap, reply_offset), "from child") == 0);
+    assert(offset_heap_check(&heap));
+
+    char * const reply = offset_heap_pointer(&heap, reply_offset);
+    reply[4 * REGION_MIN_SIZE - 1] = 1;
+    offset_heap_free(&heap, reply);
+    assert(offset_heap_malloc(&heap, 32) == message);
+
+    close(channel[0]);
+    close(channel[1]);
+    close(heap.fd);
+    offset_heap_detach(&heap);
+}
+
+// process dying with the lock held doesn't block the others
+DEFINE_TEST(owner_died) {
+    struct offset_heap heap;
+    assert(offset_heap_create_shared(&heap, "shared_heap", MAX_SIZE) == OFFSET_HEAP_CREATED);
+
+    const pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        if (!offset_heap_lock(&heap)) _exit(1);
+        _exit(0);
+    }
+    wait_child(pid);
+
+    void * const mem = offset_heap_malloc(&heap, 64);
+    assert(mem);
+    offset_heap_free(&heap, mem);
+    assert(offset_heap_check(&heap));
+
+    close(heap.fd);
+    offset_heap_detach(&heap);
+}
+
+// child reserves more than the parent and grows the heap past the parent's reservation
+DEFINE_TEST(outgrown) {
+    struct offset_heap heap;
+    assert(offset_heap_create_shared(&heap, "shared_heap", 2 * REGION_MIN_SIZE) == OFFSET_HEAP_CREATED);
+
+    const pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        struct offset_heap child;
+        if (offset_heap_attach_shared(&child, heap.fd, MAX_SIZE) != OFFSET_HEAP_JOINED) _exit(1);
+        if (!offset_heap_malloc(&child, 4 * REGION_MIN_SIZE)) _exit(2);
+        offset_heap_detach(&child);
+        _exit(0);
+    }
+    wait_child(pid);
+
+    // the growth doesn't fit the parent's address space, the lock is given back
+    const size_t mapped = heap.mapped;
+    assert(!offset_heap_refresh(&heap));
+    assert(!offset_heap_lock(&heap));
+    assert(!offset_heap_malloc(&heap, 64));
+    assert(heap.mapped == mapped);
+
+    // a wider attachment reaches the growth, it would hang if the lock were still held
+    struct offset_heap wide;
+    assert(offset_heap_attach_shared(&wide, heap.fd, MAX_SIZE) == OFFSET_HEAP_JOINED);
+    void * const mem = offset_heap_malloc(&wide, 64);
+    assert(mem);
+    offset_heap_free(&wide, mem);
+    assert(offset_heap_check(&wide));
+    offset_heap_detach(&wide);
+
+    close(heap.fd);
+    offset_heap_detach(&heap);
+}
+
+int main() {
+    RUN_SINGLE_TEST(fork_exchange);
+    RUN_SINGLE_TEST(owner_died);
+    RUN_SINGLE_TEST(outgrown);
+    return 0;
+}
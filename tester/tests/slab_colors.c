@@ -0,0 +1,112 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BUFFER_SIZE (4 * 1024 * 1024)
+#define SLOTS 512
+#define STEPS 40000
+
+
+static _Alignas(4096) uint8_t buffer[BUFFER_SIZE];
+
+DEFINE_MMAP_IMPL(passthrough) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+// the page map is mapped anonymously
+static struct heap * create(struct buffer_provider * bp, size_t colors, bool tiny) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+    const struct heap_options options = {
+        .provider = buffer_provider_init(bp, buffer, BUFFER_SIZE), .slabs = true, .tiny = tiny, .slab_colors = colors
+    };
+    struct heap * const heap = heap_create(0, &options);
+    assert(heap);
+    return heap;
+}
+
+// successive slabs of a class shift their objects line by line and start over
+DEFINE_TEST(rotation) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, 4, false);
+
+    // 62 objects of 64 bytes fill a slab without slack, three lines of it go to the colours
+    const size_t capacity = (SLAB_SIZE - SLAB_OBJECTS_OFFSET - 3 * CACHE_LINE) / 64;
+    for (size_t s = 0; s < 6; ++s) {
+        uint8_t * const first = heap_malloc(heap, 64);
+        assert((uintptr_t) first % SLAB_SIZE == SLAB_OBJECTS_OFFSET + s % 4 * CACHE_LINE);
+        assert(slab_find(heap, first)->capacity == capacity);
+        for (size_t i = 1; i < capacity; ++i) assert(heap_malloc(heap, 64) == first + i * 64);
+    }
+
+    // classes count their colours apart
+    assert((uintptr_t) heap_malloc(heap, 24) % SLAB_SIZE == SLAB_OBJECTS_OFFSET);
+    assert((uintptr_t) heap_malloc(heap, 64) % SLAB_SIZE == SLAB_OBJECTS_OFFSET + 2 * CACHE_LINE);
+    heap_destroy(heap);
+}
+
+// without colours the layout is the classic one
+DEFINE_TEST(layout) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, 0, false);
+    uint8_t * const plain = heap_malloc(heap, 64);
+    assert((uintptr_t) plain % SLAB_SIZE == SLAB_OBJECTS_OFFSET);
+    assert(slab_find(heap, plain)->capacity == (SLAB_SIZE - SLAB_OBJECTS_OFFSET) / 64);
+    heap_destroy(heap);
+
+    // 70 objects of 56 bytes leave 48 bytes, less than a line: the second colour costs an object
+    struct heap * const colored = create(&bp, 2, false);
+    uint8_t * const first = heap_malloc(colored, 56);
+    assert(slab_find(colored, first)->capacity == (SLAB_SIZE - SLAB_OBJECTS_OFFSET - CACHE_LINE) / 56);
+    heap_destroy(colored);
+}
+
+// tiny slabs take colours too
+DEFINE_TEST(tiny) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, 3, true);
+    for (size_t s = 0; s < 4; ++s) {
+        uint8_t * const first = heap_malloc(heap, 8);
+        assert((uintptr_t) first % TINY_SLAB_SIZE == TINY_OBJECTS_OFFSET + s % 3 * CACHE_LINE);
+        const size_t capacity = slab_find(heap, first)->capacity;
+        for (size_t i = 1; i < capacity; ++i) heap_malloc(heap, 8);
+    }
+    heap_destroy(heap);
+}
+
+// random trace over coloured slabs: contents survive, freed slots are found again
+DEFINE_TEST(random) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, 16, true);
+    srand(48);
+
+    static uint8_t * slots[SLOTS];
+    static size_t sizes[SLOTS];
+    for (size_t step = 0; step < STEPS; ++step) {
+        const size_t i = rand() % SLOTS;
+        if (slots[i]) {
+            for (size_t j = 0; j < sizes[i]; ++j) assert(slots[i][j] == (uint8_t) i);
+            heap_free(heap, slots[i]);
+            slots[i] = NULL;
+        } else {
+            sizes[i] = 1 + rand() % 80;
+            slots[i] = heap_malloc(heap, sizes[i]);
+            assert(slots[i]);
+            memset(slots[i], (int) i, sizes[i]);
+        }
+    }
+    for (size_t i = 0; i < SLOTS; ++i) heap_free(heap, slots[i]);
+    assert(heap->slab_count <= SLAB_CLASSES);
+    heap_destroy(heap);
+}
+
+int main() {
+    RUN_SINGLE_TEST(rotation);
+    RUN_SINGLE_TEST(layout);
+    RUN_SINGLE_TEST(tiny);
+    RUN_SINGLE_TEST(random);
+    return 0;
+}
@@ -0,0 +1,146 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BUFFER_SIZE (4 * 1024 * 1024)
+#define SLOTS 512
+#define STEPS 40000
+
+
+static _Alignas(4096) uint8_t buffer[BUFFER_SIZE];
+
+DEFINE_MMAP_IMPL(passthrough) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+// the page map is mapped anonymously
+static struct heap * create(struct buffer_provider * bp, enum heap_fit fit, bool slabs) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+    const struct heap_options options = { .provider = buffer_provider_init(bp, buffer, BUFFER_SIZE), .fit = fit, .slabs = slabs };
+    struct heap * const heap = heap_create(0, &options);
+    assert(heap);
+    return heap;
+}
+
+static const size_t slab_block = SLAB_SIZE + offsetof(struct block_header, contents);
+
+// objects of a class are packed next to each other in an aligned page
+DEFINE_TEST(packed) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, HEAP_FIT_FIRST, true);
+
+    uint8_t * const a = heap_malloc(heap, 1);
+    uint8_t * const b = heap_malloc(heap, 8);
+    assert(b == a + 8);
+    assert((uintptr_t) a % SLAB_SIZE == SLAB_OBJECTS_OFFSET);
+
+    uint8_t * const c = heap_malloc(heap, 60);
+    assert((uintptr_t) c % SLAB_SIZE == SLAB_OBJECTS_OFFSET);
+    assert(heap_malloc(heap, 57) == c + 64);
+    assert(heap->slab_count == 2);
+
+    // bigger queries are blocks
+    uint8_t * const block = heap_malloc(heap, 65);
+    assert(block_get_header(block)->capacity.bytes == 65);
+
+    assert(live_bytes(heap) == 2 * slab_block + size_from_capacity((block_capacity) {65}).bytes);
+
+    // freed slot is taken again first
+    heap_free(heap, b);
+    heap_free(heap, b);
+    assert(heap_malloc(heap, 7) == b);
+
+    heap_destroy(heap);
+}
+
+// a full slab leaves the list, an empty one goes back to the block heap unless it's the last one
+DEFINE_TEST(lifecycle) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, HEAP_FIT_FIRST, true);
+
+    const size_t capacity = (SLAB_SIZE - SLAB_OBJECTS_OFFSET) / 64;
+    void * objects[2 * 62];
+    assert(capacity == 62);
+    for (size_t i = 0; i < 2 * capacity; ++i) objects[i] = heap_malloc(heap, 64);
+    assert(heap->slab_count == 2);
+    assert(heap->slabs[SLAB_CLASSES - 1] == NULL);
+
+    void * const extra = heap_malloc(heap, 64);
+    assert(heap->slab_count == 3);
+
+    for (size_t i = 0; i < 2 * capacity; ++i) heap_free(heap, objects[i]);
+    assert(heap->slab_count == 1);
+    assert(live_bytes(heap) == slab_block);
+
+    // the last slab stays even when it's empty
+    heap_free(heap, extra);
+    assert(heap->slab_count == 1);
+    assert(heap_malloc(heap, 64) == extra);
+
+    heap_destroy(heap);
+}
+
+// small objects take far less than blocks with headers
+DEFINE_TEST(footprint) {
+    size_t live[2];
+    for (int slabs = 0; slabs < 2; ++slabs) {
+        struct buffer_provider bp;
+        struct heap * const heap = create(&bp, HEAP_FIT_FIRST, slabs);
+        for (size_t i = 0; i < 1000; ++i) assert(heap_malloc(heap, 16));
+        live[slabs] = live_bytes(heap);
+        heap_destroy(heap);
+    }
+    assert(live[1] * 2 < live[0]);
+}
+
+// random trace of small and bigger queries with every policy
+static void random_trace(enum heap_fit fit) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, fit, true);
+    srand(40);
+
+    static uint8_t * slots[SLOTS];
+    static size_t sizes[SLOTS];
+    for (size_t step = 0; step < STEPS; ++step) {
+        const size_t i = rand() % SLOTS;
+        if (slots[i]) {
+            for (size_t j = 0; j < sizes[i]; ++j) assert(slots[i][j] == (uint8_t) i);
+            heap_free(heap, slots[i]);
+            slots[i] = NULL;
+        } else {
+            sizes[i] = rand() % 4 ? 1 + rand() % 64 : 1 + rand() % 2000;
+            slots[i] = rand() % 4 ? heap_malloc(heap, sizes[i]) : heap_malloc_try(heap, sizes[i]);
+            if (slots[i]) memset(slots[i], (int) i, sizes[i]);
+        }
+    }
+
+    for (size_t i = 0; i < SLOTS; ++i) {
+        heap_free(heap, slots[i]);
+        slots[i] = NULL;
+    }
+
+    // only the last slab of each class may stay
+    assert(heap->slab_count <= SLAB_CLASSES);
+    assert(live_bytes(heap) == heap->slab_count * slab_block);
+
+    heap_destroy(heap);
+}
+
+DEFINE_TEST(random) {
+    random_trace(HEAP_FIT_FIRST);
+    random_trace(HEAP_FIT_FIRST_INDEXED);
+    random_trace(HEAP_FIT_BEST);
+    random_trace(HEAP_FIT_NEXT);
+}
+
+int main() {
+    RUN_SINGLE_TEST(packed);
+    RUN_SINGLE_TEST(lifecycle);
+    RUN_SINGLE_TEST(footprint);
+    RUN_SINGLE_TEST(random);
+    return 0;
+}
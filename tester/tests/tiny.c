@@ -0,0 +1,163 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BUFFER_SIZE (16 * 1024 * 1024)
+#define OBJECTS 200000
+#define SLOTS 512
+#define STEPS 40000
+
+
+static _Alignas(4096) uint8_t buffer[BUFFER_SIZE];
+
+DEFINE_MMAP_IMPL(passthrough) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+// the page map is mapped anonymously
+static struct heap * create(struct buffer_provider * bp, bool tiny, bool slabs) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+    const struct heap_options options = { .provider = buffer_provider_init(bp, buffer, BUFFER_SIZE), .tiny = tiny, .slabs = slabs };
+    struct heap * const heap = heap_create(0, &options);
+    assert(heap);
+    return heap;
+}
+
+// tiny objects are packed back to back in two classes, bigger ones are blocks or small slabs
+DEFINE_TEST(packed) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, true, false);
+
+    uint8_t * const a = heap_malloc(heap, 1);
+    assert(heap_malloc(heap, 8) == a + 8);
+    assert((uintptr_t) a % TINY_SLAB_SIZE == TINY_OBJECTS_OFFSET);
+    assert(heap_usable_size(heap, a) == 8);
+
+    uint8_t * const b = heap_malloc(heap, 9);
+    assert(heap_malloc(heap, 16) == b + 16);
+    assert((uintptr_t) b % TINY_SLAB_SIZE == TINY_OBJECTS_OFFSET);
+    assert(heap_usable_size(heap, b) == 16);
+    assert(heap->slab_count == 2);
+
+    // without small slabs the next size is a block
+    void * const block = heap_malloc(heap, 17);
+    assert(!slab_find(heap, block));
+    heap_destroy(heap);
+
+    // with them it gets a small slab, tiny classes keep their big slabs
+    struct heap * const both = create(&bp, true, true);
+    void * const small = heap_malloc(both, 17);
+    assert(slab_find(both, small)->size == SLAB_SIZE);
+    assert(slab_find(both, heap_malloc(both, 16))->size == TINY_SLAB_SIZE);
+    heap_destroy(both);
+}
+
+// every page of a tiny slab leads to it, a full slab makes a new one
+DEFINE_TEST(pages) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, true, false);
+
+    const size_t capacity = (TINY_SLAB_SIZE - TINY_OBJECTS_OFFSET) / 16;
+    uint8_t * const first = heap_malloc(heap, 16);
+    struct slab * const slab = slab_find(heap, first);
+    assert(slab->capacity == capacity);
+
+    uint8_t * last = first;
+    for (size_t i = 1; i < capacity; ++i) last = heap_malloc(heap, 16);
+    assert(last == first + (capacity - 1) * 16);
+    assert(slab_find(heap, last) == slab);
+    assert(heap->slabs[1] == NULL);
+
+    uint8_t * const next = heap_malloc(heap, 16);
+    assert(slab_find(heap, next) != slab);
+
+    // the emptied slab goes back to the block heap, its pages are blocks again
+    for (size_t i = 0; i < capacity; ++i) heap_free(heap, first + i * 16);
+    assert(heap->slab_count == 1);
+    assert(!slab_find(heap, last));
+    assert(heap_owns(heap, last));
+
+    heap_destroy(heap);
+}
+
+// a tiny object takes its slot and a share of the slab, a block takes a header and the minimal capacity
+// (blocks are found through the index, a scan over every taken block per query would be quadratic)
+DEFINE_TEST(footprint) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+    size_t live[2];
+    for (int tiny = 0; tiny < 2; ++tiny) {
+        struct buffer_provider bp;
+        const struct heap_options options = {
+            .provider = buffer_provider_init(&bp, buffer, BUFFER_SIZE), .tiny = tiny, .fit = HEAP_FIT_FIRST_INDEXED
+        };
+        struct heap * const heap = heap_create(0, &options);
+        assert(heap);
+        for (size_t i = 0; i < OBJECTS; ++i) assert(heap_malloc(heap, 1 + i % 8));
+        live[tiny] = live_bytes(heap);
+        heap_destroy(heap);
+    }
+    assert(live[1] * 4 < live[0]);
+    assert(live[1] < OBJECTS * 9);
+}
+
+// the default heap packs tiny objects behind _malloc and _free
+DEFINE_TEST(default_heap) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+    const struct heap_options options = { .tiny = true };
+    assert(heap_init_with(0, &options));
+
+    char * const tag = _malloc(6);
+    strcpy(tag, "hello");
+    char * const other = _malloc(3);
+    assert(other == tag + 8);
+    assert(_malloc_usable_size(other) == 8);
+    assert(_heap_owns(tag));
+
+    _free(tag);
+    assert(_malloc(8) == tag);
+    _heap_destroy();
+}
+
+// random trace of tiny and bigger queries
+DEFINE_TEST(random) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, true, false);
+    srand(42);
+
+    static uint8_t * slots[SLOTS];
+    static size_t sizes[SLOTS];
+    for (size_t step = 0; step < STEPS; ++step) {
+        const size_t i = rand() % SLOTS;
+        if (slots[i]) {
+            for (size_t j = 0; j < sizes[i]; ++j) assert(slots[i][j] == (uint8_t) i);
+            heap_free(heap, slots[i]);
+            slots[i] = NULL;
+        } else {
+            sizes[i] = rand() % 4 ? 1 + rand() % 16 : 1 + rand() % 2000;
+            slots[i] = rand() % 4 ? heap_malloc(heap, sizes[i]) : heap_malloc_try(heap, sizes[i]);
+            if (slots[i]) memset(slots[i], (int) i, sizes[i]);
+        }
+    }
+
+    for (size_t i = 0; i < SLOTS; ++i) {
+        heap_free(heap, slots[i]);
+        slots[i] = NULL;
+    }
+
+    // only the last slab of each tiny class may stay
+    assert(heap->slab_count <= 2);
+    heap_destroy(heap);
+}
+
+int main() {
+    RUN_SINGLE_TEST(packed);
+    RUN_SINGLE_TEST(pages);
+    RUN_SINGLE_TEST(footprint);
+    RUN_SINGLE_TEST(default_heap);
+    RUN_SINGLE_TEST(random);
+    return 0;
+}
@@ -34,7 +34,7 @@ DEFINE_TEST(fail) {
     block2->is_free = false;
     block7->is_free = false;
 
-    const struct block_search_result bsr = try_memalloc_existing(BUFFER_SIZE / 2, block1);
+    const struct block_search_result bsr = try_memalloc_in(NULL, BUFFER_SIZE / 2, block1);
 
     assert(bsr.type == BSR_REACHED_END_NOT_FOUND);
     assert(bsr.block == block8);
@@ -87,7 +87,7 @@ DEFINE_TEST(split) {
     block2->is_free = false;
     block8->is_free = false;
 
-    const struct block_search_result bsr = try_memalloc_existing(BUFFER_SIZE / 2, block1);
+    const struct block_search_result bsr = try_memalloc_in(NULL, BUFFER_SIZE / 2, block1);
 
     assert(bsr.type == BSR_FOUND_GOOD_BLOCK);
     assert(bsr.block == block3);
@@ -0,0 +1,198 @@
+#define TEST_SMART_MMAP
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BUFFER_SIZE (4 * 1024 * 1024)
+#define SLOTS 256
+#define STEPS 20000
+
+
+static _Alignas(4096) uint8_t buffer[BUFFER_SIZE];
+
+DEFINE_MMAP_IMPL(passthrough) {
+    base_mmap_checks(addr, length, prot, flags, fd, offset);
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+static struct heap * create(struct buffer_provider * bp, size_t size, enum heap_fit fit, bool wilderness) {
+    const struct heap_options options = {
+        .provider = buffer_provider_init(bp, buffer, size), .fit = fit, .wilderness = wilderness, .fastbin_max = 128
+    };
+    struct heap * const heap = heap_create(0, &options);
+    assert(heap);
+    return heap;
+}
+
+static struct block_header * top(struct heap * heap) {
+    struct block_header * block = heap->start;
+    while (block->next) block = block->next;
+    return block;
+}
+
+// cached neighbours are merged before the top is carved
+DEFINE_TEST(fastbins_before_top) {
+    for (int wilderness = 0; wilderness < 2; ++wilderness) {
+        struct buffer_provider bp;
+        struct heap * const heap = create(&bp, BUFFER_SIZE, HEAP_FIT_FIRST, wilderness);
+
+        void * const first = heap_malloc(heap, 40);
+        void * const second = heap_malloc(heap, 40);
+        struct block_header * const old_top = block_get_header(second)->next;
+        heap_free(heap, first);
+        heap_free(heap, second);
+
+        void * const merged = heap_malloc(heap, 90);
+        if (wilderness) assert(merged == first);
+        else assert(block_get_header(merged) == old_top);
+
+        heap_destroy(heap);
+    }
+}
+
+// next fit wraps around to the hole behind the rover before it carves the top
+DEFINE_TEST(next_fit_wraps_first) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, BUFFER_SIZE, HEAP_FIT_NEXT, true);
+
+    void * const first = heap_malloc(heap, 200);
+    void * const second = heap_malloc(heap, 200);
+    heap_free(heap, first);
+    assert(heap->rover == block_get_header(second));
+
+    assert(heap_malloc(heap, 200) == first);
+
+    // nothing else fits, the top is carved
+    uint8_t * const third = heap_malloc(heap, 200);
+    assert(block_get_header(third) == block_get_header(second)->next);
+    assert(top(heap) == block_get_header(third)->next);
+
+    heap_destroy(heap);
+}
+
+// best fit takes a bigger hole rather than the top, even if the top fits better
+DEFINE_TEST(best_fit_spares_top) {
+    for (int wilderness = 0; wilderness < 2; ++wilderness) {
+        struct buffer_provider bp;
+        struct heap * const heap = create(&bp, REGION_MIN_SIZE, HEAP_FIT_BEST, wilderness);
+
+        void * const hole = heap_malloc(heap, 500);
+        void * const guard = heap_malloc(heap, 200);
+        const size_t rest = block_get_header(guard)->next->capacity.bytes;
+        heap_malloc(heap, rest - 300 - offsetof(struct block_header, contents));
+        struct block_header * const old_top = top(heap);
+        assert(old_top->is_free && old_top->capacity.bytes == 300);
+        heap_free(heap, hole);
+
+        void * const taken = heap_malloc(heap, 200);
+        if (wilderness) assert(taken == hole);
+        else assert(block_get_header(taken) == old_top);
+
+        // when the top is the only fit it's taken anyway
+        assert(heap_malloc(heap, 280));
+
+        heap_destroy(heap);
+    }
+}
+
+// random trace with every policy: contents survive, the heap stays consistent
+static void random_trace(enum heap_fit fit) {
+    struct buffer_provider bp;
+    struct heap * const heap = create(&bp, BUFFER_SIZE, fit, true);
+    srand(44);
+
+    static uint8_t * slots[SLOTS];
+    static size_t sizes[SLOTS];
+    for (size_t step = 0; step < STEPS; ++step) {
+        const size_t i = rand() % SLOTS;
+        if (slots[i]) {
+            for (size_t j = 0; j < sizes[i]; ++j) assert(slots[i][j] == (uint8_t) i);
+            heap_free(heap, slots[i]);
+            slots[i] = NULL;
+        } else {
+            sizes[i] = rand() % 4 ? 1 + rand() % 160 : 1 + rand() % 4000;
+            slots[i] = rand() % 4 ? heap_malloc(heap, sizes[i]) : heap_malloc_try(heap, sizes[i]);
+            if (slots[i]) memset(slots[i], (int) i, sizes[i]);
+        }
+    }
+
+    for (size_t i = 0; i < SLOTS; ++i) {
+        heap_free(heap, slots[i]);
+        slots[i] = NULL;
+    }
+    heap_trim(heap);
+
+    struct heap_region_stats stats[64];
+    const size_t count = heap_regions(heap, stats, 64);
+    for (size_t i = 0; i < count && i < 64; ++i) assert(stats[i].live == 0);
+
+    heap_destroy(heap);
+}
+
+DEFINE_TEST(random) {
+    random_trace(HEAP_FIT_FIRST);
+    random_trace(HEAP_FIT_FIRST_INDEXED);
+    random_trace(HEAP_FIT_BEST);
+    random_trace(HEAP_FIT_NEXT);
+}
+
+// regions emptied in the middle of the chain go back, the top stays the last block after the live one
+DEFINE_TEST(trim_empty_middle) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+    struct heap * const heap = heap_create(0, &(struct heap_options) { .wilderness = true });
+    const size_t regions = heap_regions(heap, NULL, 0);
+
+    static void * brief[64];
+    size_t count = 0;
+    while (heap_regions(heap, NULL, 0) < regions + 3) {
+        assert(count < 64);
+        brief[count++] = heap_malloc(heap, 4000);
+    }
+    void * const lasting = heap_malloc(heap, 3 * REGION_MIN_SIZE);
+    const size_t grown = heap_regions(heap, NULL, 0);
+    for (size_t i = 0; i < count; ++i) heap_free(heap, brief[i]);
+
+    heap_trim(heap);
+    assert(heap_regions(heap, NULL, 0) < grown);
+    assert(heap_owns(heap, lasting));
+    struct block_header * const last = top(heap);
+    assert(last == block_get_header(lasting) || last == block_get_header(lasting)->next);
+
+    heap_free(heap, lasting);
+    heap_destroy(heap);
+}
+
+// a short-lived sub-heap inherits the wilderness and still goes back almost whole once it's empty
+DEFINE_TEST(trim_lifetimes) {
+    current_mmap_impl = MMAP_IMPL(passthrough);
+    struct heap * const heap = heap_create(0, &(struct heap_options) { .wilderness = true });
+
+    static void * lasting[256];
+    static void * brief[256];
+    for (size_t i = 0; i < 256; ++i) {
+        lasting[i] = heap_malloc_hint(heap, 64, HINT_LONG_LIVED);
+        brief[i] = heap_malloc_hint(heap, 4000, HINT_SHORT_LIVED);
+    }
+    struct heap * const sub = heap->lifetimes[0];
+    assert(sub->options.wilderness);
+    for (size_t i = 0; i < 256; ++i) heap_free(heap, brief[i]);
+
+    heap_trim(heap);
+    assert(heap_regions(sub, NULL, 0) == 1);
+    assert(heap_malloc_hint(heap, 4000, HINT_SHORT_LIVED));
+
+    for (size_t i = 0; i < 256; ++i) heap_free(heap, lasting[i]);
+    heap_destroy(heap);
+}
+
+int main() {
+    RUN_SINGLE_TEST(fastbins_before_top);
+    RUN_SINGLE_TEST(next_fit_wraps_first);
+    RUN_SINGLE_TEST(best_fit_spares_top);
+    RUN_SINGLE_TEST(random);
+    RUN_SINGLE_TEST(trim_empty_middle);
+    RUN_SINGLE_TEST(trim_lifetimes);
+    return 0;
+}